@@ -0,0 +1,255 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*-----------------------------------------------------------------------------*/
+/** @file    bench.c                                                           */
+/** @brief   Time the host build of the message codec, one message of each op  */
+/*-----------------------------------------------------------------------------*/
+
+#include "messages.h"
+#include "serial_framing_protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MESSAGES 15
+#define BENCH_FRAME 256
+
+typedef struct benchCase_s {
+    const char *name;
+    message_any_t msg;
+    uint8_t buf[BENCH_FRAME];
+    size_t len;
+    double encode;
+    double decode;
+} benchCase_t;
+
+static benchCase_t benchCases[BENCH_MESSAGES];
+
+static uint8_t benchValue[64] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+static uint8_t benchBatch[64];
+static uint8_t benchPairs[8] = {MESSAGES_TOPIC_CLOCK, 0x00, MESSAGES_TOPIC_MOTOR, 0xff, MESSAGES_TOPIC_ANALOG, 0x01,
+                                MESSAGES_TOPIC_ENCODER, 0x00};
+
+static void
+benchSetup(void)
+{
+    benchCase_t *c = benchCases;
+    message_any_t msg;
+    size_t offset = 0;
+    c->name = "ping";
+    message_ping_timed_frame(&c->msg.ping, 7, 123456789);
+    c++;
+    c->name = "pong";
+    message_pong_timed_frame(&c->msg.pong, 7, 123456789, 123456800, 123456801);
+    c++;
+    c->name = "info";
+    message_info_frame(&c->msg.info, MESSAGES_TOPIC_MOTOR, 0xff, 10, benchValue);
+    c++;
+    c->name = "data";
+    message_data_frame(&c->msg.data, 0x1234, MESSAGES_TOPIC_MOTOR, 0xff, MESSAGES_DATA_FLAG_PUB, 123456789, 10, benchValue);
+    c++;
+    c->name = "data_compact";
+    message_data_compact_frame(&c->msg.compact, 0x1234, MESSAGES_TOPIC_MOTOR, 0xff, MESSAGES_DATA_FLAG_PUB, 20, 10, benchValue);
+    c++;
+    c->name = "data_long";
+    message_data_long_frame(&c->msg.data_long, 0x1234, MESSAGES_TOPIC_CASSETTE, 0x00, 0, 123456789, 64, benchValue);
+    c++;
+    c->name = "fragment";
+    message_fragment_frame(&c->msg.fragment, 1024, 251, 64, benchValue);
+    c++;
+    c->name = "data_multi";
+    message_data_multi_frame(&c->msg.multi, 123456789, 40, benchValue);
+    c++;
+    c->name = "read";
+    message_read_frame(&c->msg.read, 0x1234, MESSAGES_TOPIC_CLOCK, 0x00);
+    c++;
+    c->name = "read_multi";
+    message_read_multi_frame(&c->msg.read_multi, 0x1234, 4, benchPairs);
+    c++;
+    c->name = "write";
+    message_write_frame(&c->msg.write, 0x1234, MESSAGES_TOPIC_MOTOR, 0x01, 1, benchValue);
+    c++;
+    c->name = "subscribe";
+    message_subscribe_period_frame(&c->msg.subscribe, 0x1234, MESSAGES_TOPIC_CLOCK, 0x00, 20);
+    c++;
+    c->name = "subscribe+";
+    message_subscribe_options_frame(&c->msg.subscribe, 0x1234, MESSAGES_TOPIC_MOTOR, 0xff, 20, 2, 10, 500);
+    c++;
+    c->name = "unsubscribe";
+    message_unsubscribe_frame(&c->msg.unsubscribe, 0x1234);
+    c++;
+    c->name = "batch";
+    message_subscribe_period_frame(&msg.subscribe, 0x1234, MESSAGES_TOPIC_CLOCK, 0x00, 20);
+    offset = message_batch_append(benchBatch, sizeof(benchBatch), offset, &msg);
+    message_subscribe_frame(&msg.subscribe, 0x1235, MESSAGES_TOPIC_MOTOR, 0xff);
+    offset = message_batch_append(benchBatch, sizeof(benchBatch), offset, &msg);
+    message_ping_timed_frame(&msg.ping, 7, 123456789);
+    offset = message_batch_append(benchBatch, sizeof(benchBatch), offset, &msg);
+    message_batch_frame(&c->msg.batch, (uint8_t)offset, benchBatch);
+}
+
+static SFPcontext benchSfp;
+static unsigned long benchSent;
+
+static int
+benchSfpWrite(uint8_t *octets, size_t len, size_t *outlen, void *userdata)
+{
+    (void)userdata;
+    benchSent += octets[len - 1];
+    if (outlen != NULL) {
+        *outlen = len;
+    }
+    return 0;
+}
+
+static double
+benchNow(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Serialize every case once and check that it decodes back to the same octets. */
+static int
+benchCheck(int verbose)
+{
+    benchCase_t *c;
+    message_any_t msg;
+    uint8_t buf[BENCH_FRAME];
+    size_t len;
+    size_t i;
+    int failed = 0;
+    for (c = benchCases; c < benchCases + BENCH_MESSAGES; c++) {
+        if (message_serialize(&c->msg, c->buf, sizeof(c->buf), &c->len) != 0 || c->len != message_getsizeof(&c->msg) ||
+            message_deserialize(&msg, c->buf, c->len) != 0 || message_serialize(&msg, buf, sizeof(buf), &len) != 0 ||
+            len != c->len || memcmp(buf, c->buf, len) != 0) {
+            fprintf(stderr, "%s: does not round trip\n", c->name);
+            failed = 1;
+            continue;
+        }
+        if (verbose) {
+            printf("%-13s", c->name);
+            for (i = 0; i < c->len; i++) {
+                printf(" %02x", c->buf[i]);
+            }
+            printf("\n");
+        }
+    }
+    return failed;
+}
+
+static unsigned long
+benchRun(long iterations)
+{
+    benchCase_t *c;
+    message_any_t msg;
+    uint8_t buf[BENCH_FRAME];
+    size_t len;
+    unsigned long sum = 0;
+    double start;
+    long n;
+    for (c = benchCases; c < benchCases + BENCH_MESSAGES; c++) {
+        start = benchNow();
+        for (n = 0; n < iterations; n++) {
+            (void)message_serialize(&c->msg, buf, sizeof(buf), &len);
+            sum += buf[len - 1];
+        }
+        c->encode = (benchNow() - start) / (double)iterations;
+        start = benchNow();
+        for (n = 0; n < iterations; n++) {
+            (void)message_deserialize(&msg, c->buf, c->len);
+            sum += msg.message.op;
+        }
+        c->decode = (benchNow() - start) / (double)iterations;
+    }
+    return sum;
+}
+
+/* A one motor publish through SFP, serialized into a buffer and copied in or serialized in place. */
+static void
+benchRunSfp(long iterations, double *copy, double *inplace)
+{
+    message_any_t msg;
+    uint8_t buf[SFP_CONFIG_MAX_PACKET_SIZE];
+    size_t len;
+    double start;
+    long n;
+    sfpInit(&benchSfp);
+    sfpSetWriteCallback(&benchSfp, benchSfpWrite, NULL);
+    message_data_frame(&msg.data, 0x1234, MESSAGES_TOPIC_MOTOR, 0x00, MESSAGES_DATA_FLAG_PUB, 123456789, 1, benchValue + 1);
+    start = benchNow();
+    for (n = 0; n < iterations; n++) {
+        (void)message_serialize(&msg, buf, sizeof(buf), &len);
+        (void)sfpWritePacket(&benchSfp, buf, len, NULL);
+    }
+    *copy = (benchNow() - start) / (double)iterations;
+    start = benchNow();
+    for (n = 0; n < iterations; n++) {
+        (void)message_serialize(&msg, sfpReservePacket(&benchSfp), SFP_CONFIG_MAX_PACKET_SIZE, &len);
+        (void)sfpCommitPacket(&benchSfp, len, NULL);
+    }
+    *inplace = (benchNow() - start) / (double)iterations;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-v] [-n iterations]\n", prog);
+    fprintf(stderr, "  -v  print the encoded form of every message\n");
+    fprintf(stderr, "  -n  encode and decode each message this many times\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    int verbose = 0;
+    long iterations = 10000000;
+    benchCase_t *c;
+    double encode = 0;
+    double decode = 0;
+    unsigned long sum;
+    double copy;
+    double inplace;
+
+    while ((opt = getopt(argc, argv, "vn:")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            iterations = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc || iterations < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    benchSetup();
+    if (benchCheck(verbose) != 0) {
+        return 1;
+    }
+    sum = benchRun(iterations);
+    benchRunSfp(iterations, &copy, &inplace);
+
+    printf("%-13s %6s %10s %10s (ns) %10s %10s (Mop/s)\n", "op", "octets", "encode", "decode", "encode", "decode");
+    for (c = benchCases; c < benchCases + BENCH_MESSAGES; c++) {
+        printf("%-13s %6lu %10.2f %10.2f      %10.2f %10.2f\n", c->name, (unsigned long)c->len, c->encode * 1e9, c->decode * 1e9,
+               1e-6 / c->encode, 1e-6 / c->decode);
+        encode += c->encode;
+        decode += c->decode;
+    }
+    printf("%-13s %6s %10.2f %10.2f (checksum %lu)\n", "mean", "", encode * 1e9 / BENCH_MESSAGES, decode * 1e9 / BENCH_MESSAGES,
+           sum);
+    printf("DATA through SFP (ns): %.2f copied in, %.2f serialized in place\n", copy * 1e9, inplace * 1e9);
+    return 0;
+}
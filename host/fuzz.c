@@ -0,0 +1,446 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*-----------------------------------------------------------------------------*/
+/** @file    fuzz.c                                                            */
+/** @brief   Coverage guided fuzzing of message_deserialize() and its walkers  */
+/*-----------------------------------------------------------------------------*/
+/*
+ * Every input is copied to a buffer of exactly its size, so that with the
+ * address sanitizer any read past the end of a frame is fatal, and then
+ * decoded.  What decodes has to serialize back to a prefix of the input
+ * (DATA_COMPACT, whose varints have more than one form, to something that
+ * decodes the same), and the records of a DATA_MULTI, the messages of a
+ * BATCH and a FRAGMENT's reassembly are walked too.  Anything else wrong
+ * aborts.
+ *
+ * LLVMFuzzerTestOneInput() is the whole target, so building with
+ * -DFUZZ_LIBFUZZER and clang's -fsanitize=fuzzer hands it to libFuzzer.
+ * Otherwise the driver below mutates a corpus seeded with one message of
+ * each op, keeping inputs that reach new edges of messages.c as reported by
+ * -fsanitize-coverage=trace-pc.
+ */
+
+#include "messages.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FUZZ_INPUT_MAX 1024
+#define FUZZ_CORPUS_MAX 4096
+#define FUZZ_MAP_SIZE 65536
+#define FUZZ_REASSEMBLY 512
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static uint8_t fuzzOut[2 * FUZZ_INPUT_MAX + 0x10000];
+static uint8_t fuzzAgain[sizeof(fuzzOut)];
+static uint8_t fuzzLong[FUZZ_REASSEMBLY];
+static message_reassembly_t fuzzReassembly;
+
+static void
+fuzzCheck(int ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "fuzz: %s\n", what);
+        abort();
+    }
+}
+
+/* Walk whatever a container op holds, every message in it has to size and serialize. */
+static void
+fuzzWalk(const message_any_t *msg)
+{
+    message_record_t record;
+    message_any_t inner;
+    size_t offset = 0;
+    size_t len;
+    int retval;
+    size_t sum = 0;
+    switch (msg->message.op) {
+    case MESSAGES_OP_DATA_MULTI:
+        while ((retval = message_record_next(&msg->multi, &offset, &record)) == 1) {
+            fuzzCheck(offset <= msg->multi.len, "record past the end of DATA_MULTI");
+            sum += record.len ? record.value[record.len - 1] : 0;
+        }
+        break;
+    case MESSAGES_OP_BATCH:
+        while ((retval = message_batch_next(&msg->batch, &offset, &inner)) != 0) {
+            fuzzCheck(offset <= msg->batch.len, "message past the end of BATCH");
+            if (retval == 1) {
+                fuzzCheck(message_serialize(&inner, fuzzAgain, sizeof(fuzzAgain), &len) == 0, "BATCH message does not serialize");
+                fuzzCheck(len == message_getsizeof(&inner), "BATCH message size");
+            }
+        }
+        break;
+    case MESSAGES_OP_FRAGMENT:
+        retval = message_reassemble(&fuzzReassembly, &msg->fragment);
+        fuzzCheck(fuzzReassembly.len <= fuzzReassembly.size, "reassembly past its buffer");
+        if (retval == 1) {
+            (void)message_deserialize(&inner, fuzzReassembly.buf, fuzzReassembly.len);
+        }
+        break;
+    default:
+        break;
+    }
+    (void)sum;
+}
+
+static void
+fuzzOne(const uint8_t *buf, size_t size)
+{
+    message_any_t msg;
+    message_any_t again;
+    size_t len;
+    size_t len2;
+    if (message_deserialize(&msg, buf, size) != 0) {
+        return;
+    }
+    fuzzWalk(&msg);
+    fuzzCheck(message_serialize(&msg, fuzzOut, sizeof(fuzzOut), &len) == 0, "decoded message does not serialize");
+    fuzzCheck(len == message_getsizeof(&msg), "serialized size is not message_getsizeof()");
+    if (msg.message.op == MESSAGES_OP_DATA_COMPACT) {
+        fuzzCheck(message_deserialize(&again, fuzzOut, len) == 0, "DATA_COMPACT does not decode again");
+        fuzzCheck(message_serialize(&again, fuzzAgain, sizeof(fuzzAgain), &len2) == 0 && len2 == len &&
+                      memcmp(fuzzAgain, fuzzOut, len) == 0,
+                  "DATA_COMPACT does not round trip");
+        return;
+    }
+    fuzzCheck(len <= size && memcmp(fuzzOut, buf, len) == 0, "serialized form is not a prefix of the input");
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    // exactly size octets, so the sanitizer sees any read past the frame
+    uint8_t *buf = malloc(size > 0 ? size : 1);
+    if (buf == NULL) {
+        return 0;
+    }
+    if (fuzzReassembly.buf == NULL) {
+        message_reassembly_init(&fuzzReassembly, fuzzLong, sizeof(fuzzLong));
+    }
+    (void)memcpy(buf, data, size);
+    fuzzOne(buf, size);
+    free(buf);
+    return 0;
+}
+
+#if !defined(FUZZ_LIBFUZZER)
+
+typedef struct fuzzInput_s {
+    size_t len;
+    uint8_t *data;
+} fuzzInput_t;
+
+static uint8_t fuzzMap[FUZZ_MAP_SIZE];
+static uint8_t fuzzSeen[FUZZ_MAP_SIZE];
+static size_t fuzzSeenLen;
+// the edges of this run, so that neither clearing nor scanning the map costs a pass over it
+static uint16_t fuzzTouched[FUZZ_MAP_SIZE];
+static size_t fuzzTouchedLen;
+static uintptr_t fuzzPrev;
+static fuzzInput_t fuzzCorpus[FUZZ_CORPUS_MAX];
+static size_t fuzzCorpusLen;
+static uint8_t fuzzInput[FUZZ_INPUT_MAX];
+static size_t fuzzInputLen;
+static unsigned long fuzzRng = 1;
+
+/* Called on every basic block of the code built with -fsanitize-coverage=trace-pc, edges hashed as AFL does. */
+void
+__sanitizer_cov_trace_pc(void)
+{
+    uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+    uint16_t edge = (uint16_t)((pc ^ fuzzPrev) & (FUZZ_MAP_SIZE - 1));
+    if (!fuzzMap[edge]) {
+        fuzzMap[edge] = 1;
+        fuzzTouched[fuzzTouchedLen++] = edge;
+    }
+    fuzzPrev = pc >> 1;
+}
+
+extern void __sanitizer_set_death_callback(void (*callback)(void)) __attribute__((weak));
+
+/* Keep the input that killed us, the sanitizer report says why. */
+static void
+fuzzSaveCrash(void)
+{
+    FILE *fp = fopen("crash-input", "wb");
+    if (fp != NULL) {
+        (void)fwrite(fuzzInput, 1, fuzzInputLen, fp);
+        (void)fclose(fp);
+        fprintf(stderr, "fuzz: input written to crash-input (%lu octets)\n", (unsigned long)fuzzInputLen);
+    }
+}
+
+static void
+fuzzAbort(int sig)
+{
+    (void)sig;
+    fuzzSaveCrash();
+    _exit(1);
+}
+
+static unsigned long
+fuzzRand(void)
+{
+    // xorshift, plenty for picking mutations
+    fuzzRng ^= fuzzRng << 13;
+    fuzzRng ^= fuzzRng >> 7;
+    fuzzRng ^= fuzzRng << 17;
+    return fuzzRng;
+}
+
+static double
+fuzzNow(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Run the current input, returns the number of edges it reached that nothing had before. */
+static size_t
+fuzzRun(void)
+{
+    size_t fresh = 0;
+    uint16_t edge;
+    fuzzPrev = 0;
+    (void)LLVMFuzzerTestOneInput(fuzzInput, fuzzInputLen);
+    while (fuzzTouchedLen > 0) {
+        edge = fuzzTouched[--fuzzTouchedLen];
+        fuzzMap[edge] = 0;
+        if (!fuzzSeen[edge]) {
+            fuzzSeen[edge] = 1;
+            fresh++;
+        }
+    }
+    fuzzSeenLen += fresh;
+    return fresh;
+}
+
+static void
+fuzzKeep(void)
+{
+    fuzzInput_t *input;
+    if (fuzzCorpusLen == FUZZ_CORPUS_MAX) {
+        return;
+    }
+    input = &fuzzCorpus[fuzzCorpusLen];
+    input->data = malloc(fuzzInputLen > 0 ? fuzzInputLen : 1);
+    if (input->data == NULL) {
+        return;
+    }
+    (void)memcpy(input->data, fuzzInput, fuzzInputLen);
+    input->len = fuzzInputLen;
+    fuzzCorpusLen++;
+}
+
+static void
+fuzzSeed(const message_any_t *msg)
+{
+    if (message_serialize(msg, fuzzInput, sizeof(fuzzInput), &fuzzInputLen) == 0) {
+        (void)fuzzRun();
+        fuzzKeep();
+    }
+}
+
+static void
+fuzzSeedAll(void)
+{
+    static uint8_t value[300];
+    static uint8_t records[64];
+    message_any_t msg;
+    message_any_t inner;
+    size_t offset = 0;
+    size_t i;
+    for (i = 0; i < sizeof(value); i++) {
+        value[i] = (uint8_t)i;
+    }
+    message_ping_frame(&msg.ping, 1);
+    fuzzSeed(&msg);
+    message_ping_timed_frame(&msg.ping, 1, 123456789);
+    fuzzSeed(&msg);
+    message_pong_timed_frame(&msg.pong, 1, 1, 2, 3);
+    fuzzSeed(&msg);
+    message_info_frame(&msg.info, MESSAGES_TOPIC_SESSION, MESSAGES_TOPIC_SESSION_SUBTOPIC_FEATURES, 1, value);
+    fuzzSeed(&msg);
+    message_data_frame(&msg.data, 0x1234, MESSAGES_TOPIC_MOTOR, 0xff, MESSAGES_DATA_FLAG_PUB, 123456789, 10, value);
+    fuzzSeed(&msg);
+    message_data_compact_frame(&msg.compact, 0x1234, MESSAGES_TOPIC_MOTOR, 0xff, MESSAGES_DATA_FLAG_PUB, 20, 10, value);
+    fuzzSeed(&msg);
+    offset = message_record_append(records, sizeof(records), offset, 1, MESSAGES_TOPIC_CLOCK, 0, 0, 8, value);
+    offset = message_record_append(records, sizeof(records), offset, 2, MESSAGES_TOPIC_MOTOR, 1, 0, 1, value);
+    message_data_multi_frame(&msg.multi, 123456789, (uint8_t)offset, records);
+    fuzzSeed(&msg);
+    message_read_frame(&msg.read, 0x1234, MESSAGES_TOPIC_CLOCK, 0x00);
+    fuzzSeed(&msg);
+    message_read_multi_frame(&msg.read_multi, 0x1234, 2, value);
+    fuzzSeed(&msg);
+    message_write_frame(&msg.write, 0x1234, MESSAGES_TOPIC_MOTOR, 0x01, 1, value);
+    fuzzSeed(&msg);
+    message_subscribe_options_frame(&msg.subscribe, 0x1234, MESSAGES_TOPIC_MOTOR, 0xff, 20, 2, 10, 500);
+    fuzzSeed(&msg);
+    message_unsubscribe_frame(&msg.unsubscribe, 0x1234);
+    fuzzSeed(&msg);
+    message_data_long_frame(&msg.data_long, 0x1234, MESSAGES_TOPIC_CASSETTE, 0, 0, 123456789, 300, value);
+    fuzzSeed(&msg);
+    message_write_long_frame(&msg.write_long, 0x1234, MESSAGES_TOPIC_CASSETTE, 0, 300, value);
+    fuzzSeed(&msg);
+    message_fragment_frame(&msg.fragment, 300, 0, 200, value);
+    fuzzSeed(&msg);
+    offset = 0;
+    message_read_frame(&inner.read, 1, MESSAGES_TOPIC_CLOCK, 0);
+    offset = message_batch_append(records, sizeof(records), offset, &inner);
+    message_ping_frame(&inner.ping, 2);
+    offset = message_batch_append(records, sizeof(records), offset, &inner);
+    message_batch_frame(&msg.batch, (uint8_t)offset, records);
+    fuzzSeed(&msg);
+}
+
+static void
+fuzzMutate(void)
+{
+    static const uint8_t interesting[] = {0x00, 0x01, 0x02, 0x05, 0x06, 0x7f, 0x80, 0xfe, 0xff};
+    const fuzzInput_t *other;
+    size_t pos;
+    size_t n;
+    int count = 1 + (int)(fuzzRand() % 4);
+    while (count-- > 0) {
+        pos = (fuzzInputLen > 0) ? fuzzRand() % fuzzInputLen : 0;
+        switch (fuzzRand() % 7) {
+        case 0:
+            if (fuzzInputLen > 0) {
+                fuzzInput[pos] ^= (uint8_t)(1 << (fuzzRand() % 8));
+            }
+            break;
+        case 1:
+            if (fuzzInputLen > 0) {
+                fuzzInput[pos] = interesting[fuzzRand() % sizeof(interesting)];
+            }
+            break;
+        case 2:
+            if (fuzzInputLen > 0) {
+                fuzzInput[pos] = (uint8_t)(fuzzInput[pos] + 1 - 2 * (fuzzRand() % 2));
+            }
+            break;
+        case 3:
+            // truncate, which is what most length checks are about
+            fuzzInputLen = pos;
+            break;
+        case 4:
+            if (fuzzInputLen < FUZZ_INPUT_MAX) {
+                (void)memmove(fuzzInput + pos + 1, fuzzInput + pos, fuzzInputLen - pos);
+                fuzzInput[pos] = (uint8_t)fuzzRand();
+                fuzzInputLen++;
+            }
+            break;
+        case 5:
+            if (fuzzInputLen > 0) {
+                (void)memmove(fuzzInput + pos, fuzzInput + pos + 1, fuzzInputLen - pos - 1);
+                fuzzInputLen--;
+            }
+            break;
+        default:
+            // splice the tail of another input in
+            other = &fuzzCorpus[fuzzRand() % fuzzCorpusLen];
+            n = (other->len > 0) ? fuzzRand() % other->len : 0;
+            if (pos + other->len - n <= FUZZ_INPUT_MAX) {
+                (void)memcpy(fuzzInput + pos, other->data + n, other->len - n);
+                fuzzInputLen = pos + other->len - n;
+            }
+            break;
+        }
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n runs] [-t seconds] [-s seed] [input...]\n", prog);
+    fprintf(stderr, "  -n  stop after this many runs\n");
+    fprintf(stderr, "  -t  stop after this many seconds (default 10)\n");
+    fprintf(stderr, "  -s  seed for the mutations\n");
+    fprintf(stderr, "  inputs are run once each instead of fuzzing, to replay a crash-input\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    const fuzzInput_t *input;
+    long runs = 0;
+    long limit = -1;
+    double seconds = 10;
+    double start;
+    double report;
+    double now;
+    FILE *fp;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            limit = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            seconds = strtod(optarg, NULL);
+            break;
+        case 's':
+            fuzzRng = strtoul(optarg, NULL, 10) | 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (__sanitizer_set_death_callback != NULL) {
+        __sanitizer_set_death_callback(fuzzSaveCrash);
+    }
+    (void)signal(SIGABRT, fuzzAbort);
+    (void)signal(SIGSEGV, fuzzAbort);
+
+    if (optind < argc) {
+        for (; optind < argc; optind++) {
+            fp = fopen(argv[optind], "rb");
+            if (fp == NULL) {
+                fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[optind]);
+                return 1;
+            }
+            fuzzInputLen = fread(fuzzInput, 1, sizeof(fuzzInput), fp);
+            (void)fclose(fp);
+            (void)fuzzRun();
+            printf("%s: ok\n", argv[optind]);
+        }
+        return 0;
+    }
+
+    fuzzSeedAll();
+    start = fuzzNow();
+    report = start;
+    do {
+        input = &fuzzCorpus[fuzzRand() % fuzzCorpusLen];
+        (void)memcpy(fuzzInput, input->data, input->len);
+        fuzzInputLen = input->len;
+        (void)fuzzMutate();
+        if (fuzzRun() > 0) {
+            fuzzKeep();
+        }
+        runs++;
+        if ((runs & 0xfff) == 0 && (now = fuzzNow()) - report >= 1) {
+            printf("runs %ld (%.0f/s) corpus %lu edges %lu\n", runs, (double)runs / (now - start), (unsigned long)fuzzCorpusLen,
+                   (unsigned long)fuzzSeenLen);
+            fflush(stdout);
+            report = now;
+        }
+    } while ((limit < 0 || runs < limit) && ((runs & 0xfff) != 0 || fuzzNow() - start < seconds));
+    now = fuzzNow();
+    printf("done: %ld runs in %.1f s (%.0f/s), corpus %lu, edges %lu, no failures\n", runs, now - start,
+           (double)runs / (now - start), (unsigned long)fuzzCorpusLen, (unsigned long)fuzzSeenLen);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,1106 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*-----------------------------------------------------------------------------*/
+/** @file    gateway.c                                                         */
+/** @brief   Multiplex many local clients onto the one SFP link to the robot   */
+/*-----------------------------------------------------------------------------*/
+/*
+ * The gateway owns the serial device and speaks SFP and messages.h to the
+ * robot.  Local clients connect to a unix stream socket and speak the same
+ * messages, each one prefixed by its length as a big endian uint16_t:
+ *
+ *     len (2) | message (len)
+ *
+ * Identical SUBSCRIBEs from different clients share one robot subscription.
+ * Publishes are fanned out with each client's own req_id, and the last value
+ * of every subscription is cached so a new subscriber gets it immediately.
+ * READ and WRITE requests are forwarded with a gateway-owned req_id and the
+ * replies are routed back.  PINGs are answered locally, INFO from the robot
+ * is broadcast, and robot subscriptions are re-issued after a reconnect the
+ * robot could not resume.
+ *
+ * Messages longer than one SFP packet, such as a client's WRITE_LONG, go to
+ * the robot as FRAGMENTs once it grants MESSAGES_FEATURE_LONG, and the
+ * robot's FRAGMENTs are put back together before they are routed.  Clients
+ * get DATA_LONG replies as they are.  A client's BATCH is taken apart and
+ * its messages handled in turn, going on to the robot as one BATCH again
+ * when the robot takes them, as do the subscriptions re-issued for a new
+ * session.
+ */
+
+#include "messages.h"
+#include "serial_framing_protocol.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GATEWAY_CLIENT_MAX 32
+#define GATEWAY_SUB_MAX 256
+#define GATEWAY_LINK_MAX 1024
+#define GATEWAY_PENDING_MAX 256
+#define GATEWAY_LONG_MAX 16384
+#define GATEWAY_CLIENT_BUF (2 + GATEWAY_LONG_MAX)
+#define GATEWAY_PING_INTERVAL 1000
+#define GATEWAY_CONNECT_INTERVAL 500
+#define GATEWAY_PENDING_TIMEOUT 10000
+
+typedef struct gatewayClient_s {
+    int fd;
+    size_t rxlen;
+    uint8_t rxbuf[GATEWAY_CLIENT_BUF];
+} gatewayClient_t;
+
+/* One subscription as the robot sees it, shared by every client link to it. */
+typedef struct gatewaySub_s {
+    bool active;
+    bool subscribed;
+    uint16_t req_id;
+    uint8_t topic;
+    uint8_t subtopic;
+    uint16_t period;
+    uint8_t options;
+    uint16_t deadband;
+    uint16_t minInterval;
+    uint16_t maxInterval;
+    uint16_t links;
+    bool cached;
+    uint8_t flag;
+    uint32_t timestamp;
+    uint8_t len;
+    uint8_t value[SFP_CONFIG_MAX_PACKET_SIZE];
+} gatewaySub_t;
+
+/* A client's subscription, under the client's own req_id. */
+typedef struct gatewayLink_s {
+    bool active;
+    int client;
+    uint16_t req_id;
+    int sub;
+} gatewayLink_t;
+
+/* A forwarded READ or WRITE waiting for its replies. */
+typedef struct gatewayPending_s {
+    bool active;
+    int client;
+    uint16_t client_req_id;
+    uint16_t req_id;
+    uint16_t ends;
+    uint64_t started;
+} gatewayPending_t;
+
+typedef struct gateway_s {
+    int serial;
+    int listener;
+    bool connected;
+    bool verbose;
+    bool micros;
+    uint64_t connecting;
+    uint64_t pinged;
+    uint8_t pingSeq;
+    uint16_t nextReqId;
+    uint32_t token;
+    uint32_t compactStamp;
+    uint8_t features;
+    bool resubscribe;
+    bool batching;
+    size_t batchLen;
+    int batchCount;
+    uint8_t batch[SFP_CONFIG_MAX_PACKET_SIZE - MESSAGES_BATCH_HEADER];
+    SFPcontext sfp;
+    uint8_t buf[GATEWAY_LONG_MAX];
+    message_reassembly_t reassembly;
+    uint8_t longbuf[GATEWAY_LONG_MAX];
+    gatewayClient_t clients[GATEWAY_CLIENT_MAX];
+    gatewaySub_t subs[GATEWAY_SUB_MAX];
+    gatewayLink_t links[GATEWAY_LINK_MAX];
+    gatewayPending_t pending[GATEWAY_PENDING_MAX];
+} gateway_t;
+
+static gateway_t gateway;
+static volatile sig_atomic_t gatewayStop = 0;
+
+static void gatewayRecvRobot(gateway_t *gw, const message_any_t *msg);
+static void gatewayRecvClient(gateway_t *gw, int client, const message_any_t *msg);
+static void gatewayClientClose(gateway_t *gw, int client);
+
+static void
+gatewayLog(gateway_t *gw, const char *fmt, ...)
+{
+    va_list ap;
+    if (!gw->verbose) {
+        return;
+    }
+    va_start(ap, fmt);
+    (void)vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    (void)fputc('\n', stderr);
+}
+
+static uint64_t
+gatewayMillis(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint32_t
+gatewayMicros(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000);
+}
+
+/*-----------------------------------------------------------------------------*/
+/* robot link                                                                  */
+/*-----------------------------------------------------------------------------*/
+
+static int
+gatewaySerialWrite(uint8_t *octets, size_t len, size_t *outlen, void *userdata)
+{
+    gateway_t *gw = (gateway_t *)userdata;
+    size_t wcnt = 0;
+    ssize_t wlen;
+    while (wcnt < len) {
+        wlen = write(gw->serial, octets + wcnt, len - wcnt);
+        if (wlen < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            break;
+        }
+        wcnt += (size_t)wlen;
+    }
+    if (outlen != NULL) {
+        *outlen = wcnt;
+    }
+    return (wcnt == len) ? 0 : -1;
+}
+
+static void
+gatewaySerialDeliver(uint8_t *buf, size_t len, void *userdata)
+{
+    gateway_t *gw = (gateway_t *)userdata;
+    message_any_t msg;
+    if (message_deserialize(&msg, buf, len) != 0) {
+        gatewayLog(gw, "robot: undecodable message (%zu octets)", len);
+        return;
+    }
+    gatewayRecvRobot(gw, &msg);
+}
+
+/* Send the messages collected since gatewayBatchBegin(), a lone one on its own. */
+static int
+gatewayBatchFlush(gateway_t *gw)
+{
+    message_any_t msg;
+    size_t outlen;
+    int retval = 0;
+    if (gw->batchCount == 1) {
+        retval = sfpWritePacket(&gw->sfp, gw->batch + 1, gw->batch[0], NULL);
+    } else if (gw->batchCount > 1) {
+        message_batch_frame(&msg.batch, (uint8_t)gw->batchLen, gw->batch);
+        retval = (message_serialize(&msg, gw->buf, sizeof(gw->buf), &outlen) == 0) ? sfpWritePacket(&gw->sfp, gw->buf, outlen, NULL)
+                                                                                     : -1;
+    }
+    gw->batchLen = 0;
+    gw->batchCount = 0;
+    return retval;
+}
+
+static int
+gatewaySendRobot(gateway_t *gw, const message_any_t *msg)
+{
+    message_any_t fragment;
+    size_t outlen;
+    size_t offset;
+    size_t flen;
+    size_t len;
+    if (gw->batching) {
+        offset = message_batch_append(gw->batch, sizeof(gw->batch), gw->batchLen, msg);
+        if (offset == 0 && gw->batchCount > 0) {
+            (void)gatewayBatchFlush(gw);
+            offset = message_batch_append(gw->batch, sizeof(gw->batch), gw->batchLen, msg);
+        }
+        if (offset != 0) {
+            gw->batchLen = offset;
+            gw->batchCount++;
+            return 0;
+        }
+        // too big to share a frame, send it on its own
+    }
+    if (message_serialize(msg, gw->buf, sizeof(gw->buf), &outlen) != 0) {
+        return -1;
+    }
+    if (outlen <= SFP_CONFIG_MAX_PACKET_SIZE) {
+        return sfpWritePacket(&gw->sfp, gw->buf, outlen, NULL);
+    }
+    if (!(gw->features & MESSAGES_FEATURE_LONG)) {
+        return -1;
+    }
+    for (offset = 0; offset < outlen; offset += len) {
+        len = outlen - offset;
+        if (len > SFP_CONFIG_MAX_PACKET_SIZE - MESSAGES_FRAGMENT_HEADER) {
+            len = SFP_CONFIG_MAX_PACKET_SIZE - MESSAGES_FRAGMENT_HEADER;
+        }
+        message_fragment_frame(&fragment.fragment, (uint16_t)outlen, (uint16_t)offset, (uint8_t)len, gw->buf + offset);
+        (void)message_serialize(&fragment, sfpReservePacket(&gw->sfp), SFP_CONFIG_MAX_PACKET_SIZE, &flen);
+        if (sfpCommitPacket(&gw->sfp, flen, NULL) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Collect what is sent to the robot into BATCHes, where the robot takes them, until gatewayBatchEnd(). */
+static void
+gatewayBatchBegin(gateway_t *gw)
+{
+    if (!(gw->features & MESSAGES_FEATURE_BATCH)) {
+        return;
+    }
+    gw->batching = true;
+    gw->batchLen = 0;
+    gw->batchCount = 0;
+}
+
+static void
+gatewayBatchEnd(gateway_t *gw)
+{
+    if (!gw->batching) {
+        return;
+    }
+    gw->batching = false;
+    (void)gatewayBatchFlush(gw);
+}
+
+static int
+gatewaySerialOpen(const char *path, speed_t speed)
+{
+    struct termios tio;
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        (void)cfsetispeed(&tio, speed);
+        (void)cfsetospeed(&tio, speed);
+        tio.c_cflag |= (CLOCAL | CREAD);
+        tio.c_cc[VMIN] = 0;
+        tio.c_cc[VTIME] = 0;
+        (void)tcsetattr(fd, TCSANOW, &tio);
+    }
+    return fd;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* clients                                                                     */
+/*-----------------------------------------------------------------------------*/
+
+static int
+gatewaySendClient(gateway_t *gw, int client, const message_any_t *msg)
+{
+    uint8_t buf[GATEWAY_CLIENT_BUF];
+    size_t outlen;
+    uint16_t len;
+    if (message_serialize(msg, buf + 2, sizeof(buf) - 2, &outlen) != 0) {
+        return -1;
+    }
+    len = htons((uint16_t)outlen);
+    (void)memcpy(buf, &len, 2);
+    // a client that cannot keep up with a local socket is dropped rather than stalling everyone
+    if (send(gw->clients[client].fd, buf, outlen + 2, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)(outlen + 2)) {
+        gatewayLog(gw, "client %d: write failed, closing", client);
+        gatewayClientClose(gw, client);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+gatewaySendClientData(gateway_t *gw, int client, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag,
+                      uint32_t timestamp, uint8_t len, uint8_t *value)
+{
+    message_any_t msg;
+    message_data_frame(&msg.data, req_id, topic, subtopic, flag, timestamp, len, value);
+    (void)gatewaySendClient(gw, client, &msg);
+}
+
+static void
+gatewayBroadcast(gateway_t *gw, const message_any_t *msg)
+{
+    int i;
+    for (i = 0; i < GATEWAY_CLIENT_MAX; i++) {
+        if (gw->clients[i].fd >= 0) {
+            (void)gatewaySendClient(gw, i, msg);
+        }
+    }
+}
+
+static uint16_t
+gatewayAllocReqId(gateway_t *gw)
+{
+    int i;
+    bool used;
+    uint16_t req_id;
+    do {
+        req_id = gw->nextReqId++;
+        used = (req_id == 0);
+        for (i = 0; !used && i < GATEWAY_SUB_MAX; i++) {
+            used = gw->subs[i].active && gw->subs[i].req_id == req_id;
+        }
+        for (i = 0; !used && i < GATEWAY_PENDING_MAX; i++) {
+            used = gw->pending[i].active && gw->pending[i].req_id == req_id;
+        }
+    } while (used);
+    return req_id;
+}
+
+static int
+gatewaySubFind(gateway_t *gw, uint16_t req_id)
+{
+    int i;
+    for (i = 0; i < GATEWAY_SUB_MAX; i++) {
+        if (gw->subs[i].active && gw->subs[i].req_id == req_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void
+gatewaySubRobotSubscribe(gateway_t *gw, gatewaySub_t *sub)
+{
+    message_any_t msg;
+    if (!gw->connected) {
+        return;
+    }
+    if (sub->options & MESSAGES_SUBSCRIBE_OPTIONS) {
+        message_subscribe_options_frame(&msg.subscribe, sub->req_id, sub->topic, sub->subtopic, sub->period, sub->deadband,
+                                        sub->minInterval, sub->maxInterval);
+    } else {
+        message_subscribe_period_frame(&msg.subscribe, sub->req_id, sub->topic, sub->subtopic, sub->period);
+    }
+    if (gatewaySendRobot(gw, &msg) == 0) {
+        sub->subscribed = true;
+    }
+}
+
+static bool
+gatewaySubMatches(const gatewaySub_t *sub, const message_subscribe_t *subscribe)
+{
+    if (sub->topic != subscribe->topic || sub->subtopic != subscribe->subtopic || sub->period != subscribe->period ||
+        sub->options != subscribe->options) {
+        return false;
+    }
+    if (!(sub->options & MESSAGES_SUBSCRIBE_OPTIONS)) {
+        return true;
+    }
+    return sub->deadband == subscribe->deadband && sub->minInterval == subscribe->min_interval &&
+           sub->maxInterval == subscribe->max_interval;
+}
+
+static int
+gatewaySubAcquire(gateway_t *gw, const message_subscribe_t *subscribe)
+{
+    int i;
+    int freeSub = -1;
+    gatewaySub_t *sub;
+    for (i = 0; i < GATEWAY_SUB_MAX; i++) {
+        if (gw->subs[i].active) {
+            if (gatewaySubMatches(&gw->subs[i], subscribe)) {
+                gw->subs[i].links++;
+                return i;
+            }
+        } else if (freeSub < 0) {
+            freeSub = i;
+        }
+    }
+    if (freeSub < 0) {
+        return -1;
+    }
+    sub = &gw->subs[freeSub];
+    (void)memset(sub, 0, sizeof(gatewaySub_t));
+    sub->active = true;
+    sub->req_id = gatewayAllocReqId(gw);
+    sub->topic = subscribe->topic;
+    sub->subtopic = subscribe->subtopic;
+    sub->period = subscribe->period;
+    sub->options = subscribe->options & MESSAGES_SUBSCRIBE_OPTIONS;
+    if (sub->options & MESSAGES_SUBSCRIBE_OPTIONS) {
+        sub->deadband = subscribe->deadband;
+        sub->minInterval = subscribe->min_interval;
+        sub->maxInterval = subscribe->max_interval;
+    }
+    sub->links = 1;
+    gatewayLog(gw, "robot: subscribe req_id=%u topic=%u subtopic=%u period=%u", sub->req_id, sub->topic, sub->subtopic,
+               sub->period);
+    gatewaySubRobotSubscribe(gw, sub);
+    return freeSub;
+}
+
+static void
+gatewaySubRelease(gateway_t *gw, int index)
+{
+    message_any_t msg;
+    gatewaySub_t *sub = &gw->subs[index];
+    if (sub->links > 0) {
+        sub->links--;
+    }
+    if (sub->links > 0) {
+        return;
+    }
+    if (sub->subscribed && gw->connected) {
+        gatewayLog(gw, "robot: unsubscribe req_id=%u", sub->req_id);
+        message_unsubscribe_frame(&msg.unsubscribe, sub->req_id);
+        (void)gatewaySendRobot(gw, &msg);
+    }
+    sub->active = false;
+}
+
+static void
+gatewayClientClose(gateway_t *gw, int client)
+{
+    int i;
+    if (gw->clients[client].fd < 0) {
+        return;
+    }
+    (void)close(gw->clients[client].fd);
+    gw->clients[client].fd = -1;
+    for (i = 0; i < GATEWAY_LINK_MAX; i++) {
+        if (gw->links[i].active && gw->links[i].client == client) {
+            gw->links[i].active = false;
+            gatewaySubRelease(gw, gw->links[i].sub);
+        }
+    }
+    for (i = 0; i < GATEWAY_PENDING_MAX; i++) {
+        if (gw->pending[i].active && gw->pending[i].client == client) {
+            gw->pending[i].active = false;
+        }
+    }
+    gatewayLog(gw, "client %d: closed", client);
+}
+
+static void
+gatewayClientRead(gateway_t *gw, int client)
+{
+    gatewayClient_t *c = &gw->clients[client];
+    message_any_t msg;
+    ssize_t rlen;
+    uint16_t len;
+    rlen = recv(c->fd, c->rxbuf + c->rxlen, sizeof(c->rxbuf) - c->rxlen, 0);
+    if (rlen <= 0) {
+        gatewayClientClose(gw, client);
+        return;
+    }
+    c->rxlen += (size_t)rlen;
+    while (c->fd >= 0 && c->rxlen >= 2) {
+        (void)memcpy(&len, c->rxbuf, 2);
+        len = ntohs(len);
+        if (len > GATEWAY_LONG_MAX) {
+            gatewayLog(gw, "client %d: oversized message, closing", client);
+            gatewayClientClose(gw, client);
+            return;
+        }
+        if (c->rxlen < (size_t)len + 2) {
+            break;
+        }
+        if (message_deserialize(&msg, c->rxbuf + 2, len) == 0) {
+            gatewayRecvClient(gw, client, &msg);
+        }
+        if (c->fd < 0) {
+            return;
+        }
+        c->rxlen -= (size_t)len + 2;
+        (void)memmove(c->rxbuf, c->rxbuf + len + 2, c->rxlen);
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/* message routing                                                             */
+/*-----------------------------------------------------------------------------*/
+
+static void
+gatewayRecvClientSubscribe(gateway_t *gw, int client, const message_subscribe_t *subscribe)
+{
+    int i;
+    int link = -1;
+    int sub;
+    uint8_t error;
+    for (i = 0; i < GATEWAY_LINK_MAX; i++) {
+        if (gw->links[i].active) {
+            if (gw->links[i].client == client && gw->links[i].req_id == subscribe->req_id) {
+                error = MESSAGES_ERROR_BAD_REQ_ID;
+                gatewaySendClientData(gw, client, subscribe->req_id, subscribe->topic, subscribe->subtopic,
+                                      MESSAGES_DATA_FLAG_PUB | MESSAGES_DATA_FLAG_ERROR | MESSAGES_DATA_FLAG_END, 0, 1, &error);
+                return;
+            }
+        } else if (link < 0) {
+            link = i;
+        }
+    }
+    sub = (link < 0) ? -1 : gatewaySubAcquire(gw, subscribe);
+    if (sub < 0) {
+        error = MESSAGES_ERROR_SUB_MAX;
+        gatewaySendClientData(gw, client, subscribe->req_id, subscribe->topic, subscribe->subtopic,
+                              MESSAGES_DATA_FLAG_PUB | MESSAGES_DATA_FLAG_ERROR | MESSAGES_DATA_FLAG_END, 0, 1, &error);
+        return;
+    }
+    gw->links[link].active = true;
+    gw->links[link].client = client;
+    gw->links[link].req_id = subscribe->req_id;
+    gw->links[link].sub = sub;
+    if (gw->subs[sub].cached) {
+        // snapshot so the new subscriber does not wait for the next change
+        gatewaySendClientData(gw, client, subscribe->req_id, gw->subs[sub].topic, gw->subs[sub].subtopic, gw->subs[sub].flag,
+                              gw->subs[sub].timestamp, gw->subs[sub].len, gw->subs[sub].value);
+    }
+}
+
+static void
+gatewayRecvClientUnsubscribe(gateway_t *gw, int client, const message_unsubscribe_t *unsubscribe)
+{
+    int i;
+    uint8_t error;
+    gatewaySub_t *sub;
+    for (i = 0; i < GATEWAY_LINK_MAX; i++) {
+        if (gw->links[i].active && gw->links[i].client == client && gw->links[i].req_id == unsubscribe->req_id) {
+            sub = &gw->subs[gw->links[i].sub];
+            gatewaySendClientData(gw, client, unsubscribe->req_id, sub->topic, sub->subtopic,
+                                  MESSAGES_DATA_FLAG_PUB | MESSAGES_DATA_FLAG_END, 0, 0, NULL);
+            gw->links[i].active = false;
+            gatewaySubRelease(gw, gw->links[i].sub);
+            return;
+        }
+    }
+    error = MESSAGES_ERROR_BAD_REQ_ID;
+    gatewaySendClientData(gw, client, unsubscribe->req_id, MESSAGES_TOPIC_ALL, MESSAGES_TOPIC_ALL_SUBTOPIC_ALL,
+                          MESSAGES_DATA_FLAG_PUB | MESSAGES_DATA_FLAG_ERROR | MESSAGES_DATA_FLAG_END, 0, 1, &error);
+}
+
+static void
+gatewayRecvClientRequest(gateway_t *gw, int client, message_any_t *msg)
+{
+    int i;
+    gatewayPending_t *pending = NULL;
+    for (i = 0; i < GATEWAY_PENDING_MAX; i++) {
+        if (!gw->pending[i].active) {
+            pending = &gw->pending[i];
+            break;
+        }
+    }
+    if (pending == NULL || !gw->connected) {
+        return;
+    }
+    pending->active = true;
+    pending->client = client;
+    pending->client_req_id = msg->req.req_id;
+    pending->req_id = gatewayAllocReqId(gw);
+    // a READ_MULTI is done once every pair in it has ended
+    pending->ends = (msg->message.op == MESSAGES_OP_READ_MULTI) ? msg->read_multi.count : 1;
+    pending->started = gatewayMillis();
+    // req_id sits at the same place in every request message
+    msg->req.req_id = pending->req_id;
+    if (gatewaySendRobot(gw, msg) != 0) {
+        pending->active = false;
+    }
+}
+
+static void
+gatewayRecvClient(gateway_t *gw, int client, const message_any_t *msg)
+{
+    message_any_t out;
+    size_t offset = 0;
+    int retval;
+    switch (msg->message.op) {
+    case MESSAGES_OP_PING:
+        if (msg->ping.timed) {
+            uint32_t now = gatewayMicros();
+            message_pong_timed_frame(&out.pong, msg->ping.seq_id, msg->ping.timestamp, now, now);
+        } else {
+            message_pong_frame(&out.pong, msg->ping.seq_id);
+        }
+        (void)gatewaySendClient(gw, client, &out);
+        break;
+    case MESSAGES_OP_INFO:
+        // the session and its features belong to the gateway
+        if (gw->connected && msg->info.topic != MESSAGES_TOPIC_SESSION) {
+            (void)gatewaySendRobot(gw, msg);
+        }
+        break;
+    case MESSAGES_OP_SUBSCRIBE:
+        gatewayRecvClientSubscribe(gw, client, &msg->subscribe);
+        break;
+    case MESSAGES_OP_UNSUBSCRIBE:
+        gatewayRecvClientUnsubscribe(gw, client, &msg->unsubscribe);
+        break;
+    case MESSAGES_OP_READ:
+    case MESSAGES_OP_READ_MULTI:
+    case MESSAGES_OP_WRITE:
+    case MESSAGES_OP_WRITE_LONG:
+        out = *msg;
+        gatewayRecvClientRequest(gw, client, &out);
+        break;
+    case MESSAGES_OP_BATCH:
+        if (gw->batching) {
+            break;
+        }
+        gatewayBatchBegin(gw);
+        while ((retval = message_batch_next(&msg->batch, &offset, &out)) != 0 && gw->clients[client].fd >= 0) {
+            if (retval == 1 && out.message.op != MESSAGES_OP_BATCH) {
+                gatewayRecvClient(gw, client, &out);
+            }
+        }
+        gatewayBatchEnd(gw);
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+gatewayRecvRobotPub(gateway_t *gw, const message_data_t *data)
+{
+    int i;
+    int index = gatewaySubFind(gw, data->req_id);
+    gatewaySub_t *sub;
+    if (index < 0) {
+        return;
+    }
+    sub = &gw->subs[index];
+    if (data->flag & (MESSAGES_DATA_FLAG_END | MESSAGES_DATA_FLAG_ERROR)) {
+        // the robot ended the subscription, pass that on and forget it
+        for (i = 0; i < GATEWAY_LINK_MAX; i++) {
+            if (gw->links[i].active && gw->links[i].sub == index) {
+                gatewaySendClientData(gw, gw->links[i].client, gw->links[i].req_id, data->topic, data->subtopic, data->flag,
+                                      data->timestamp, data->len, data->value);
+                gw->links[i].active = false;
+            }
+        }
+        sub->active = false;
+        return;
+    }
+    sub->cached = true;
+    sub->flag = data->flag;
+    sub->timestamp = data->timestamp;
+    sub->len = data->len;
+    (void)memcpy(sub->value, data->value, data->len);
+    for (i = 0; i < GATEWAY_LINK_MAX; i++) {
+        if (gw->links[i].active && gw->links[i].sub == index) {
+            gatewaySendClientData(gw, gw->links[i].client, gw->links[i].req_id, data->topic, data->subtopic, data->flag,
+                                  data->timestamp, data->len, data->value);
+        }
+    }
+}
+
+static void
+gatewayRecvRobotRep(gateway_t *gw, const message_data_t *data)
+{
+    int i;
+    for (i = 0; i < GATEWAY_PENDING_MAX; i++) {
+        if (gw->pending[i].active && gw->pending[i].req_id == data->req_id) {
+            gatewaySendClientData(gw, gw->pending[i].client, gw->pending[i].client_req_id, data->topic, data->subtopic, data->flag,
+                                  data->timestamp, data->len, data->value);
+            if ((data->flag & MESSAGES_DATA_FLAG_END) && --gw->pending[i].ends == 0) {
+                gw->pending[i].active = false;
+            }
+            return;
+        }
+    }
+}
+
+/* The robot only sends long values as replies, which pass through as they are. */
+static void
+gatewayRecvRobotLong(gateway_t *gw, const message_data_long_t *data)
+{
+    int i;
+    message_any_t out;
+    for (i = 0; i < GATEWAY_PENDING_MAX; i++) {
+        if (gw->pending[i].active && gw->pending[i].req_id == data->req_id) {
+            out.data_long = *data;
+            out.data_long.req_id = gw->pending[i].client_req_id;
+            (void)gatewaySendClient(gw, gw->pending[i].client, &out);
+            if ((data->flag & MESSAGES_DATA_FLAG_END) && --gw->pending[i].ends == 0) {
+                gw->pending[i].active = false;
+            }
+            return;
+        }
+    }
+}
+
+static void
+gatewayRecvRobotSession(gateway_t *gw, const message_info_t *info)
+{
+    int i;
+    uint32_t token;
+    uint8_t value[4];
+    message_any_t msg;
+    if (info->subtopic != MESSAGES_TOPIC_SESSION_SUBTOPIC_TOKEN || info->len < 5) {
+        return;
+    }
+    // features are negotiated per connection, ask again whenever the robot announces itself
+    value[0] = MESSAGES_FEATURE_DATA_MULTI | MESSAGES_FEATURE_DATA_COMPACT | MESSAGES_FEATURE_LONG | MESSAGES_FEATURE_BATCH;
+    if (gw->micros) {
+        // the robot syncs to our clock through the timed pings we answer
+        value[0] |= MESSAGES_FEATURE_MICROS;
+    }
+    message_info_frame(&msg.info, MESSAGES_TOPIC_SESSION, MESSAGES_TOPIC_SESSION_SUBTOPIC_FEATURES, 1, value);
+    (void)gatewaySendRobot(gw, &msg);
+    (void)memcpy(&token, info->value, 4);
+    token = ntohl(token);
+    switch (info->value[4]) {
+    case MESSAGES_SESSION_RESUMABLE:
+        if (token == gw->token) {
+            gatewayLog(gw, "robot: resuming session %08x", token);
+            (void)memcpy(value, info->value, 4);
+            message_info_frame(&msg.info, MESSAGES_TOPIC_SESSION, MESSAGES_TOPIC_SESSION_SUBTOPIC_RESUME, 4, value);
+            (void)gatewaySendRobot(gw, &msg);
+            return;
+        }
+        // a resumable session we did not create, let it lapse by starting our own
+        break;
+    case MESSAGES_SESSION_RESUMED:
+        gw->token = token;
+        return;
+    default:
+        break;
+    }
+    gatewayLog(gw, "robot: new session %08x", token);
+    gw->token = token;
+    for (i = 0; i < GATEWAY_SUB_MAX; i++) {
+        gw->subs[i].subscribed = false;
+    }
+    // once the features are granted, so the subscriptions can share BATCHes
+    gw->resubscribe = true;
+}
+
+static void
+gatewayRecvRobotFeatures(gateway_t *gw, const message_info_t *info)
+{
+    int i;
+    // the robot restarts its DATA_COMPACT timestamps from 0 with every grant
+    gw->compactStamp = 0;
+    gw->features = (info->len > 0) ? info->value[0] : 0;
+    if (!gw->resubscribe) {
+        return;
+    }
+    gw->resubscribe = false;
+    gatewayBatchBegin(gw);
+    for (i = 0; i < GATEWAY_SUB_MAX; i++) {
+        if (gw->subs[i].active) {
+            gatewaySubRobotSubscribe(gw, &gw->subs[i]);
+        }
+    }
+    gatewayBatchEnd(gw);
+}
+
+static void
+gatewayRecvRobotData(gateway_t *gw, const message_data_t *data)
+{
+    if (data->flag & MESSAGES_DATA_FLAG_PUB) {
+        gatewayRecvRobotPub(gw, data);
+    } else {
+        gatewayRecvRobotRep(gw, data);
+    }
+}
+
+static void
+gatewayRecvRobot(gateway_t *gw, const message_any_t *msg)
+{
+    message_any_t out;
+    message_record_t record;
+    size_t offset;
+    uint32_t now;
+    int reassembled;
+    switch (msg->message.op) {
+    case MESSAGES_OP_PING:
+        now = gatewayMicros();
+        if (msg->ping.timed) {
+            message_pong_timed_frame(&out.pong, msg->ping.seq_id, msg->ping.timestamp, now, now);
+        } else {
+            message_pong_frame(&out.pong, msg->ping.seq_id);
+        }
+        (void)gatewaySendRobot(gw, &out);
+        break;
+    case MESSAGES_OP_INFO:
+        if (msg->info.topic == MESSAGES_TOPIC_SESSION && msg->info.subtopic == MESSAGES_TOPIC_SESSION_SUBTOPIC_FEATURES) {
+            gatewayRecvRobotFeatures(gw, &msg->info);
+        } else if (msg->info.topic == MESSAGES_TOPIC_SESSION) {
+            gatewayRecvRobotSession(gw, &msg->info);
+        }
+        gatewayBroadcast(gw, msg);
+        break;
+    case MESSAGES_OP_DATA:
+        gatewayRecvRobotData(gw, &msg->data);
+        break;
+    case MESSAGES_OP_DATA_COMPACT:
+        gw->compactStamp += msg->compact.delta;
+        message_data_frame(&out.data, msg->compact.req_id, msg->compact.topic, msg->compact.subtopic, msg->compact.flag,
+                           gw->compactStamp, msg->compact.len, msg->compact.value);
+        gatewayRecvRobotData(gw, &out.data);
+        break;
+    case MESSAGES_OP_DATA_MULTI:
+        // clients always get plain DATA
+        offset = 0;
+        while (message_record_next(&msg->multi, &offset, &record) == 1) {
+            message_data_frame(&out.data, record.req_id, record.topic, record.subtopic, record.flag, msg->multi.timestamp, record.len,
+                               record.value);
+            gatewayRecvRobotData(gw, &out.data);
+        }
+        break;
+    case MESSAGES_OP_DATA_LONG:
+        gatewayRecvRobotLong(gw, &msg->data_long);
+        break;
+    case MESSAGES_OP_FRAGMENT:
+        reassembled = message_reassemble(&gw->reassembly, &msg->fragment);
+        if (reassembled < 0) {
+            gatewayLog(gw, "robot: fragment dropped (offset %u of %u)", msg->fragment.offset, msg->fragment.total);
+        } else if (reassembled == 1 && message_deserialize(&out, gw->reassembly.buf, gw->reassembly.len) == 0 &&
+                   out.message.op != MESSAGES_OP_FRAGMENT) {
+            gatewayRecvRobot(gw, &out);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/* main loop                                                                   */
+/*-----------------------------------------------------------------------------*/
+
+static int
+gatewayListen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    (void)memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    (void)strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    (void)unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+        (void)close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void
+gatewayAccept(gateway_t *gw)
+{
+    int i;
+    int fd = accept(gw->listener, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    for (i = 0; i < GATEWAY_CLIENT_MAX; i++) {
+        if (gw->clients[i].fd < 0) {
+            gw->clients[i].fd = fd;
+            gw->clients[i].rxlen = 0;
+            gatewayLog(gw, "client %d: connected", i);
+            return;
+        }
+    }
+    (void)close(fd);
+}
+
+static void
+gatewayTick(gateway_t *gw)
+{
+    int i;
+    uint64_t now = gatewayMillis();
+    message_any_t msg;
+    bool connected = sfpIsConnected(&gw->sfp);
+    if (connected != gw->connected) {
+        gw->connected = connected;
+        gatewayLog(gw, "robot: %s", connected ? "connected" : "disconnected");
+        if (!connected) {
+            for (i = 0; i < GATEWAY_SUB_MAX; i++) {
+                gw->subs[i].subscribed = false;
+            }
+            gw->features = 0;
+        }
+    }
+    if (!connected && now - gw->connecting >= GATEWAY_CONNECT_INTERVAL) {
+        sfpConnect(&gw->sfp);
+        gw->connecting = now;
+    }
+    if (connected && now - gw->pinged >= GATEWAY_PING_INTERVAL) {
+        // keeps the robot's heartbeat alive even when no client is talking
+        message_ping_timed_frame(&msg.ping, ++gw->pingSeq, gatewayMicros());
+        (void)gatewaySendRobot(gw, &msg);
+        gw->pinged = now;
+    }
+    for (i = 0; i < GATEWAY_PENDING_MAX; i++) {
+        if (gw->pending[i].active && now - gw->pending[i].started > GATEWAY_PENDING_TIMEOUT) {
+            gw->pending[i].active = false;
+        }
+    }
+}
+
+static void
+gatewayHandleSignal(int sig)
+{
+    (void)sig;
+    gatewayStop = 1;
+}
+
+static speed_t
+gatewaySpeed(long baud)
+{
+    switch (baud) {
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+    case 230400:
+        return B230400;
+    case 115200:
+    default:
+        return B115200;
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-uv] [-b baud] [-s socket] device\n", prog);
+    fprintf(stderr, "  -b  serial speed (default 115200)\n");
+    fprintf(stderr, "  -s  unix socket path for clients (default /tmp/robot.sock)\n");
+    fprintf(stderr, "  -u  timestamp DATA in CLOCK_MONOTONIC microseconds of this host\n");
+    fprintf(stderr, "  -v  log connections and subscriptions to stderr\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    gateway_t *gw = &gateway;
+    const char *socketPath = "/tmp/robot.sock";
+    long baud = 115200;
+    struct pollfd fds[2 + GATEWAY_CLIENT_MAX];
+    int clientOf[2 + GATEWAY_CLIENT_MAX];
+    uint8_t rbuf[256];
+    ssize_t rlen;
+    ssize_t i;
+    int nfds;
+    int opt;
+    int n;
+
+    while ((opt = getopt(argc, argv, "uvb:s:")) != -1) {
+        switch (opt) {
+        case 'u':
+            gw->micros = true;
+            break;
+        case 'v':
+            gw->verbose = true;
+            break;
+        case 'b':
+            baud = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            socketPath = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    gw->serial = gatewaySerialOpen(argv[optind], gatewaySpeed(baud));
+    if (gw->serial < 0) {
+        fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], argv[optind], strerror(errno));
+        return 1;
+    }
+    gw->listener = gatewayListen(socketPath);
+    if (gw->listener < 0) {
+        fprintf(stderr, "%s: cannot listen on %s: %s\n", argv[0], socketPath, strerror(errno));
+        return 1;
+    }
+    for (n = 0; n < GATEWAY_CLIENT_MAX; n++) {
+        gw->clients[n].fd = -1;
+    }
+    gw->nextReqId = 1;
+    message_reassembly_init(&gw->reassembly, gw->longbuf, sizeof(gw->longbuf));
+    sfpInit(&gw->sfp);
+    sfpSetDeliverCallback(&gw->sfp, gatewaySerialDeliver, (void *)gw);
+    sfpSetWriteCallback(&gw->sfp, gatewaySerialWrite, (void *)gw);
+
+    (void)signal(SIGINT, gatewayHandleSignal);
+    (void)signal(SIGTERM, gatewayHandleSignal);
+
+    while (!gatewayStop) {
+        gatewayTick(gw);
+        nfds = 0;
+        fds[nfds].fd = gw->serial;
+        fds[nfds].events = POLLIN;
+        clientOf[nfds++] = -1;
+        fds[nfds].fd = gw->listener;
+        fds[nfds].events = POLLIN;
+        clientOf[nfds++] = -1;
+        for (n = 0; n < GATEWAY_CLIENT_MAX; n++) {
+            if (gw->clients[n].fd >= 0) {
+                fds[nfds].fd = gw->clients[n].fd;
+                fds[nfds].events = POLLIN;
+                clientOf[nfds++] = n;
+            }
+        }
+        if (poll(fds, (nfds_t)nfds, 50) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            rlen = read(gw->serial, rbuf, sizeof(rbuf));
+            if (rlen < 0 && errno != EAGAIN && errno != EINTR) {
+                fprintf(stderr, "%s: read %s: %s\n", argv[0], argv[optind], strerror(errno));
+                break;
+            }
+            for (i = 0; i < rlen; i++) {
+                (void)sfpDeliverOctet(&gw->sfp, rbuf[i], NULL, 0, NULL);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            gatewayAccept(gw);
+        }
+        for (n = 2; n < nfds; n++) {
+            if ((fds[n].revents & (POLLIN | POLLHUP | POLLERR)) && gw->clients[clientOf[n]].fd == fds[n].fd) {
+                gatewayClientRead(gw, clientOf[n]);
+            }
+        }
+    }
+
+    for (n = 0; n < GATEWAY_CLIENT_MAX; n++) {
+        gatewayClientClose(gw, n);
+    }
+    (void)close(gw->listener);
+    (void)unlink(socketPath);
+    (void)close(gw->serial);
+    return 0;
+}
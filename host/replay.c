@@ -0,0 +1,280 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*-----------------------------------------------------------------------------*/
+/** @file    replay.c                                                          */
+/** @brief   Replay a server UART capture through the host build of SFP and    */
+/**          the message codec, reporting decode throughput and errors         */
+/*-----------------------------------------------------------------------------*/
+
+#include "messages.h"
+#include "serial_framing_protocol.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// must match pros/include/capture.h
+#define CAPTURE_HEADER_SIZE 6
+#define CAPTURE_DIR_RX 0x00
+#define CAPTURE_DIR_TX 0x01
+
+typedef struct replayDir_s {
+    const char *name;
+    SFPcontext sfp;
+    int escaping;
+    int haveHeader;
+    SFPheader header;
+    unsigned long octets;
+    unsigned long frames[4];
+    unsigned long delivered;
+    unsigned long badFrames;
+    unsigned long badMessages;
+    unsigned long ops[256];
+} replayDir_t;
+
+static const char *replayFrameNames[4] = {"USR", "RTX", "NAK", "SYN"};
+
+static replayDir_t replayDirs[2];
+
+static int
+replayWrite(uint8_t *octets, size_t len, size_t *outlen, void *userdata)
+{
+    // the replayer only listens, anything the receiver wants to send is dropped
+    (void)octets;
+    (void)userdata;
+    if (outlen != NULL) {
+        *outlen = len;
+    }
+    return 0;
+}
+
+static void
+replayDeliver(uint8_t *buf, size_t len, void *userdata)
+{
+    replayDir_t *dir = (replayDir_t *)userdata;
+    message_any_t msg;
+    dir->delivered++;
+    if (message_deserialize(&msg, buf, len) != 0) {
+        dir->badMessages++;
+        return;
+    }
+    dir->ops[msg.message.op]++;
+}
+
+static void
+replayDirInit(replayDir_t *dir, const char *name)
+{
+    (void)memset(dir, 0, sizeof(replayDir_t));
+    dir->name = name;
+    sfpInit(&dir->sfp);
+    sfpSetDeliverCallback(&dir->sfp, replayDeliver, (void *)dir);
+    sfpSetWriteCallback(&dir->sfp, replayWrite, (void *)dir);
+}
+
+static void
+replayOctet(replayDir_t *dir, uint8_t octet)
+{
+    SFPframetype type;
+    unsigned long delivered = dir->delivered;
+    dir->octets++;
+    if (octet == SFP_FLAG) {
+        if (dir->haveHeader) {
+            type = (SFPframetype)((dir->header >> SFP_FIRST_CONTROL_BIT) & ((1 << SFP_NUM_CONTROL_BITS) - 1));
+            dir->frames[type]++;
+            if (type == SFP_FRAME_USR || type == SFP_FRAME_RTX) {
+                // a capture can start mid-session, accept whatever sequence the sender is on
+                dir->sfp.connectState = SFP_CONNECT_STATE_CONNECTED;
+                dir->sfp.rx.seq = (SFPseq)((dir->header >> SFP_FIRST_SEQ_BIT) & ((1 << SFP_NUM_SEQ_BITS) - 1));
+            }
+            (void)sfpDeliverOctet(&dir->sfp, octet, NULL, 0, NULL);
+            if ((type == SFP_FRAME_USR || type == SFP_FRAME_RTX) && dir->delivered == delivered) {
+                dir->badFrames++;
+            }
+        } else {
+            (void)sfpDeliverOctet(&dir->sfp, octet, NULL, 0, NULL);
+        }
+        dir->haveHeader = 0;
+        dir->escaping = 0;
+        return;
+    }
+    if (octet == SFP_ESC) {
+        dir->escaping = 1;
+    } else {
+        if (!dir->haveHeader) {
+            dir->header = dir->escaping ? (octet ^ SFP_ESC_FLIP_BIT) : octet;
+            dir->haveHeader = 1;
+        }
+        dir->escaping = 0;
+    }
+    (void)sfpDeliverOctet(&dir->sfp, octet, NULL, 0, NULL);
+}
+
+/* Read a whole capture, either raw or as printed by the 'capture dump' shell command. */
+static uint8_t *
+replayLoad(const char *path, int hex, size_t *outlen)
+{
+    FILE *fp;
+    uint8_t *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int c;
+    int nibble = -1;
+    fp = (strcmp(path, "-") == 0) ? stdin : fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    while ((c = fgetc(fp)) != EOF) {
+        if (hex) {
+            if (!isxdigit(c)) {
+                continue;
+            }
+            c = isdigit(c) ? (c - '0') : (tolower(c) - 'a' + 10);
+            if (nibble < 0) {
+                nibble = c;
+                continue;
+            }
+            c = (nibble << 4) | c;
+            nibble = -1;
+        }
+        if (len == cap) {
+            cap = (cap == 0) ? 4096 : cap * 2;
+            buf = realloc(buf, cap);
+            if (buf == NULL) {
+                break;
+            }
+        }
+        buf[len++] = (uint8_t)c;
+    }
+    if (fp != stdin) {
+        (void)fclose(fp);
+    }
+    *outlen = len;
+    return buf;
+}
+
+static double
+replayNow(void)
+{
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void
+replayReport(const replayDir_t *dir, double elapsed)
+{
+    unsigned long frames = 0;
+    int i;
+    for (i = 0; i < 4; i++) {
+        frames += dir->frames[i];
+    }
+    printf("%s: %lu octets, %lu frames (", dir->name, dir->octets, frames);
+    for (i = 0; i < 4; i++) {
+        printf("%s%s %lu", (i == 0) ? "" : ", ", replayFrameNames[i], dir->frames[i]);
+    }
+    printf(")\n");
+    printf("    %lu delivered, %lu bad frames, %lu undecodable messages\n", dir->delivered, dir->badFrames, dir->badMessages);
+    if (elapsed > 0) {
+        printf("    %.0f octets/s, %.0f frames/s\n", dir->octets / elapsed, frames / elapsed);
+    }
+    for (i = 0; i < 256; i++) {
+        if (dir->ops[i] != 0) {
+            printf("    op 0x%02x: %lu\n", i, dir->ops[i]);
+        }
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-x] [-r] [-n repeat] capture\n", prog);
+    fprintf(stderr, "  -x  the capture is a hex dump from the 'capture dump' shell command\n");
+    fprintf(stderr, "  -r  replay at the original speed instead of as fast as possible\n");
+    fprintf(stderr, "  -n  replay the capture this many times\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+    int hex = 0;
+    int realtime = 0;
+    long repeat = 1;
+    long r;
+    uint8_t *buf;
+    size_t len;
+    size_t pos;
+    size_t i;
+    uint8_t rlen;
+    uint32_t stamp;
+    uint32_t last = 0;
+    int first;
+    unsigned long records = 0;
+    unsigned long truncated = 0;
+    double start;
+    double elapsed;
+
+    while ((opt = getopt(argc, argv, "xrn:")) != -1) {
+        switch (opt) {
+        case 'x':
+            hex = 1;
+            break;
+        case 'r':
+            realtime = 1;
+            break;
+        case 'n':
+            repeat = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1 || repeat < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    buf = replayLoad(argv[optind], hex, &len);
+    if (buf == NULL) {
+        fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[optind]);
+        return 1;
+    }
+
+    replayDirInit(&replayDirs[CAPTURE_DIR_RX], "host->robot");
+    replayDirInit(&replayDirs[CAPTURE_DIR_TX], "robot->host");
+
+    start = replayNow();
+    for (r = 0; r < repeat; r++) {
+        first = 1;
+        pos = 0;
+        while (pos + CAPTURE_HEADER_SIZE <= len) {
+            rlen = buf[pos + 1];
+            stamp = ((uint32_t)buf[pos + 2] << 24) | ((uint32_t)buf[pos + 3] << 16) | ((uint32_t)buf[pos + 4] << 8) | buf[pos + 5];
+            if (buf[pos] > CAPTURE_DIR_TX || pos + CAPTURE_HEADER_SIZE + rlen > len) {
+                truncated++;
+                break;
+            }
+            if (realtime && !first && (uint32_t)(stamp - last) < 10000000UL) {
+                (void)usleep((useconds_t)(stamp - last));
+            }
+            first = 0;
+            last = stamp;
+            for (i = 0; i < rlen; i++) {
+                replayOctet(&replayDirs[buf[pos]], buf[pos + CAPTURE_HEADER_SIZE + i]);
+            }
+            records++;
+            pos += CAPTURE_HEADER_SIZE + rlen;
+        }
+    }
+    elapsed = replayNow() - start;
+
+    printf("%lu records in %.6f s%s\n", records, elapsed, truncated ? " (capture truncated)" : "");
+    replayReport(&replayDirs[CAPTURE_DIR_RX], elapsed);
+    replayReport(&replayDirs[CAPTURE_DIR_TX], elapsed);
+
+    free(buf);
+    return 0;
+}
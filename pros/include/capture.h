@@ -0,0 +1,52 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*
+ * capture.h
+ */
+
+#ifndef CAPTURE_H_
+
+#define CAPTURE_H_
+
+#include <API.h>
+
+// size of the RAM ring, must be a power of two
+#if !defined(CAPTURE_SIZE)
+#define CAPTURE_SIZE 4096
+#endif
+
+/* Every record in the ring is a header followed by len raw octets:
+ *
+ * dir (1) | len (1) | micros (4, big endian) | octets (len)
+ *
+ * The same layout is used for dumps and cassette files, so a capture can be
+ * replayed on the host with host/replay. */
+#define CAPTURE_HEADER_SIZE 6
+#define CAPTURE_DIR_RX 0x00
+#define CAPTURE_DIR_TX 0x01
+
+typedef struct captureStats_s {
+    bool enabled;
+    uint32_t records;
+    uint32_t overwritten;
+    uint16_t used;
+    uint16_t size;
+} captureStats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern void captureInit(void);
+extern void captureEnable(bool enabled);
+extern void captureClear(void);
+extern void captureOctets(uint8_t dir, const uint8_t *buf, size_t len);
+extern captureStats_t captureGetStats(void);
+extern void captureDump(PROS_FILE *chp);
+extern int captureSave(uint8_t index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
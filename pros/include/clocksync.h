@@ -0,0 +1,61 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*
+ * clocksync.h
+ */
+
+#ifndef CLOCKSYNC_H_
+
+#define CLOCKSYNC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Tracks a remote microsecond clock from NTP style exchanges: our send time,
+ * the remote's receive and transmit times and our arrival time.  Of the last
+ * CLOCKSYNC_SAMPLES exchanges only the one with the shortest round trip is
+ * trusted, as queueing only ever adds delay.  The offset is corrected a quarter
+ * of the way to each trusted sample, and the drift between the clocks is learned
+ * from samples at least CLOCKSYNC_DRIFT_SPAN apart.  An error beyond
+ * CLOCKSYNC_STEP means the remote clock jumped, and starts over. */
+#define CLOCKSYNC_SAMPLES 8
+#define CLOCKSYNC_DRIFT_SPAN 16000000
+#define CLOCKSYNC_STEP 100000
+
+/* Offsets are remote less local modulo 2^32, the clocks having nothing in common. */
+typedef struct clocksyncSample_s {
+    uint32_t stamp;
+    uint32_t offset;
+    uint32_t delay;
+} clocksyncSample_t;
+
+typedef struct clocksync_s {
+    bool synced;
+    // the offset at stamp, changing by drift / 2^32 per microsecond
+    uint32_t stamp;
+    uint32_t offset;
+    int32_t drift;
+    uint32_t delay;
+    bool drifted;
+    uint32_t anchorStamp;
+    uint32_t anchorOffset;
+    uint8_t next;
+    uint8_t count;
+    clocksyncSample_t samples[CLOCKSYNC_SAMPLES];
+} clocksync_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern void clocksyncReset(clocksync_t *c);
+extern void clocksyncSample(clocksync_t *c, uint32_t origin, uint32_t receive, uint32_t transmit, uint32_t arrival);
+extern uint32_t clocksyncOffset(const clocksync_t *c, uint32_t local);
+extern uint32_t clocksyncRemote(const clocksync_t *c, uint32_t local);
+extern int32_t clocksyncDriftPpb(const clocksync_t *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,48 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*
+ * histogram.h
+ */
+
+#ifndef HISTOGRAM_H_
+
+#define HISTOGRAM_H_
+
+#include <stdint.h>
+
+/* Log-bucketed histogram: every power of two is split into 2^HISTOGRAM_SUB_BITS
+ * linear buckets, so the relative error of a percentile is at most 25%.
+ * Values at or above 2^HISTOGRAM_MAX_BITS land in the last bucket. */
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_MAX_BITS 24
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef struct histogram_s {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint16_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef struct histogramSummary_s {
+    uint32_t count;
+    uint32_t min;
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t max;
+} histogramSummary_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern void histogramReset(histogram_t *h);
+extern void histogramRecord(histogram_t *h, uint32_t value);
+extern uint32_t histogramPercentile(const histogram_t *h, uint8_t percent);
+extern void histogramSummarize(const histogram_t *h, histogramSummary_t *summary);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,6 +19,13 @@
 #define MESSAGES_OP_WRITE 0x06
 #define MESSAGES_OP_SUBSCRIBE 0x07
 #define MESSAGES_OP_UNSUBSCRIBE 0x08
+#define MESSAGES_OP_DATA_MULTI 0x09
+#define MESSAGES_OP_READ_MULTI 0x0a
+#define MESSAGES_OP_DATA_LONG 0x0b
+#define MESSAGES_OP_WRITE_LONG 0x0c
+#define MESSAGES_OP_FRAGMENT 0x0d
+#define MESSAGES_OP_BATCH 0x0e
+#define MESSAGES_OP_DATA_COMPACT 0x10
 
 #define MESSAGES_DATA_FLAG_END 0x01
 #define MESSAGES_DATA_FLAG_PUB 0x02
@@ -28,6 +35,32 @@
 #define MESSAGES_ERROR_BAD_TOPIC 0x02
 #define MESSAGES_ERROR_BAD_SUBTOPIC 0x03
 #define MESSAGES_ERROR_SUB_MAX 0x04
+#define MESSAGES_ERROR_BUSY 0x05
+#define MESSAGES_ERROR_BAD_OFFSET 0x06
+#define MESSAGES_ERROR_STORAGE 0x07
+#define MESSAGES_ERROR_BAD_VALUE 0x08
+
+#define MESSAGES_SESSION_NEW 0x00
+#define MESSAGES_SESSION_RESUMABLE 0x01
+#define MESSAGES_SESSION_RESUMED 0x02
+
+#define MESSAGES_FEATURE_DATA_MULTI 0x01
+#define MESSAGES_FEATURE_DATA_COMPACT 0x02
+#define MESSAGES_FEATURE_LONG 0x04
+#define MESSAGES_FEATURE_BATCH 0x08
+#define MESSAGES_FEATURE_MICROS 0x10
+
+#define MESSAGES_SUBSCRIBE_OPTIONS 0x01
+
+#define MESSAGES_REFLEX_LT 0x00
+#define MESSAGES_REFLEX_LE 0x01
+#define MESSAGES_REFLEX_GT 0x02
+#define MESSAGES_REFLEX_GE 0x03
+#define MESSAGES_REFLEX_EQ 0x04
+#define MESSAGES_REFLEX_NE 0x05
+#define MESSAGES_REFLEX_FLAG_HOLD 0x01
+#define MESSAGES_REFLEX_FLAG_ONCE 0x02
+#define MESSAGES_TRAJECTORY_FLAG_END 0x01
 
 #define MESSAGES_TOPIC_PUBSUB 0x00
 #define MESSAGES_TOPIC_PUBSUB_SUBTOPIC_COUNT 0xfb
@@ -37,6 +70,7 @@
 #define MESSAGES_TOPIC_PUBSUB_SUBTOPIC_ALL 0xff
 #define MESSAGES_TOPIC_CLOCK 0x01
 #define MESSAGES_TOPIC_CLOCK_SUBTOPIC_NOW 0x00
+#define MESSAGES_TOPIC_CLOCK_SUBTOPIC_SYNC 0x01
 #define MESSAGES_TOPIC_MOTOR 0x02
 #define MESSAGES_TOPIC_MOTOR_SUBTOPIC_ALL 0xff
 #define MESSAGES_TOPIC_SMARTMOTOR 0x03
@@ -46,12 +80,38 @@
 #define MESSAGES_TOPIC_ROBOT 0x05
 #define MESSAGES_TOPIC_ROBOT_SUBTOPIC_SPI 0x00
 #define MESSAGES_TOPIC_CASSETTE 0x06
+#define MESSAGES_TOPIC_CASSETTE_SUBTOPIC_READ 0xf7
 #define MESSAGES_TOPIC_CASSETTE_SUBTOPIC_WRITE 0xf8
 #define MESSAGES_TOPIC_CASSETTE_SUBTOPIC_CLOSE 0xf9
 #define MESSAGES_TOPIC_CASSETTE_SUBTOPIC_OPEN 0xfa
 #define MESSAGES_TOPIC_CASSETTE_SUBTOPIC_COUNT 0xfb
 #define MESSAGES_TOPIC_CASSETTE_SUBTOPIC_FREE 0xfc
 #define MESSAGES_TOPIC_CASSETTE_SUBTOPIC_MAX 0xfd
+#define MESSAGES_TOPIC_SESSION 0x07
+#define MESSAGES_TOPIC_SESSION_SUBTOPIC_TOKEN 0x00
+#define MESSAGES_TOPIC_SESSION_SUBTOPIC_RESUME 0x01
+#define MESSAGES_TOPIC_SESSION_SUBTOPIC_FEATURES 0x02
+#define MESSAGES_TOPIC_LATENCY 0x08
+#define MESSAGES_TOPIC_LATENCY_SUBTOPIC_RTT 0x00
+#define MESSAGES_TOPIC_LATENCY_SUBTOPIC_REPLY 0x01
+#define MESSAGES_TOPIC_LATENCY_SUBTOPIC_RESET 0xfe
+#define MESSAGES_TOPIC_LATENCY_SUBTOPIC_ALL 0xff
+#define MESSAGES_TOPIC_ANALOG 0x0a
+#define MESSAGES_TOPIC_ANALOG_SUBTOPIC_ALL 0xff
+#define MESSAGES_TOPIC_DIGITAL 0x0b
+#define MESSAGES_TOPIC_DIGITAL_SUBTOPIC_ALL 0xff
+#define MESSAGES_TOPIC_ENCODER 0x0c
+#define MESSAGES_TOPIC_ENCODER_SUBTOPIC_ALL 0xff
+#define MESSAGES_TOPIC_GYRO 0x0d
+#define MESSAGES_TOPIC_GYRO_SUBTOPIC_ALL 0xff
+#define MESSAGES_TOPIC_IME 0x0e
+#define MESSAGES_TOPIC_IME_SUBTOPIC_ALL 0xff
+#define MESSAGES_TOPIC_ULTRASONIC 0x0f
+#define MESSAGES_TOPIC_ULTRASONIC_SUBTOPIC_ALL 0xff
+#define MESSAGES_TOPIC_REFLEX 0x10
+#define MESSAGES_TOPIC_REFLEX_SUBTOPIC_ALL 0xff
+#define MESSAGES_TOPIC_TRAJECTORY 0x11
+#define MESSAGES_TOPIC_TRAJECTORY_SUBTOPIC_SETPOINTS 0x00
 #define MESSAGES_TOPIC_ALL 0xff
 #define MESSAGES_TOPIC_ALL_SUBTOPIC_ALL 0xff
 
@@ -59,79 +119,241 @@ typedef struct message_s {
     uint8_t op;
 } message_t;
 
-typedef struct message_ping_s {
-    uint8_t op;
-    uint8_t seq_id;
-} message_ping_t;
-
-typedef struct message_pong_s {
-    uint8_t op;
-    uint8_t seq_id;
-} message_pong_t;
-
-typedef struct message_info_s {
-    uint8_t op;
-    uint8_t topic;
-    uint8_t subtopic;
-    uint8_t len;
-    uint8_t *value;
-} message_info_t;
-
 typedef struct message_req_s {
     uint8_t op;
     uint16_t req_id;
 } message_req_t;
 
-typedef struct message_data_s {
-    uint8_t op;
+/*
+ * Wire schema.  Each op lists its fields in wire order after the op octet,
+ * multi-octet fields are big-endian:
+ *
+ *     F(type, name)                 always present
+ *     O(type, name, present, last)  sent when present is true, decoded when
+ *                                   the frame reaches the end of last
+ *     P(name, value, last)          not sent, value when last was decoded
+ *     B(name, count)                trailing octets, count of them
+ *     R(len, name)                  trailing octets up to the end of the frame
+ *
+ * present and count are expressions of the message m.  The message structs
+ * below and the codec in messages.c are generated from these lists, so a
+ * field is only ever described here.
+ */
+#define MESSAGES_SCHEMA_PING(F, O, P, B, R)                                                                                        \
+    F(uint8_t, seq_id)                                                                                                             \
+    P(timed, 1, timestamp)                                                                                                         \
+    O(uint32_t, timestamp, m->timed, timestamp)
+
+#define MESSAGES_SCHEMA_PONG(F, O, P, B, R)                                                                                        \
+    F(uint8_t, seq_id)                                                                                                             \
+    P(timed, 1, transmit)                                                                                                          \
+    O(uint32_t, origin, m->timed, transmit)                                                                                        \
+    O(uint32_t, receive, m->timed, transmit)                                                                                       \
+    O(uint32_t, transmit, m->timed, transmit)
+
+#define MESSAGES_SCHEMA_INFO(F, O, P, B, R)                                                                                        \
+    F(uint8_t, topic)                                                                                                              \
+    F(uint8_t, subtopic)                                                                                                           \
+    F(uint8_t, len)                                                                                                                \
+    B(value, m->len)
+
+#define MESSAGES_SCHEMA_DATA(F, O, P, B, R)                                                                                        \
+    F(uint16_t, req_id)                                                                                                            \
+    F(uint8_t, topic)                                                                                                              \
+    F(uint8_t, subtopic)                                                                                                           \
+    F(uint8_t, flag)                                                                                                               \
+    F(uint32_t, timestamp)                                                                                                         \
+    F(uint8_t, len)                                                                                                                \
+    B(value, m->len)
+
+/*
+ * DATA_MULTI carries several DATA records under one timestamp:
+ *
+ *     op | timestamp (4) | record...
+ *     record = req_id (2) | topic | subtopic | flag | len | value (len)
+ */
+#define MESSAGES_DATA_MULTI_HEADER 5
+#define MESSAGES_DATA_MULTI_RECORD 6
+
+#define MESSAGES_SCHEMA_DATA_MULTI(F, O, P, B, R)                                                                                  \
+    F(uint32_t, timestamp)                                                                                                         \
+    R(len, value)
+
+#define MESSAGES_SCHEMA_READ(F, O, P, B, R)                                                                                        \
+    F(uint16_t, req_id)                                                                                                            \
+    F(uint8_t, topic)                                                                                                              \
+    F(uint8_t, subtopic)
+
+/*
+ * READ_MULTI asks for several (topic, subtopic) pairs under one req_id:
+ *
+ *     op | req_id (2) | count | topic | subtopic | ...
+ *
+ * Each pair is answered as if it were its own READ, ending with its own END.
+ */
+#define MESSAGES_READ_MULTI_HEADER 4
+
+#define MESSAGES_SCHEMA_READ_MULTI(F, O, P, B, R)                                                                                  \
+    F(uint16_t, req_id)                                                                                                            \
+    F(uint8_t, count)                                                                                                              \
+    B(pairs, 2 * (size_t)m->count)
+
+#define MESSAGES_SCHEMA_WRITE(F, O, P, B, R)                                                                                       \
+    F(uint16_t, req_id)                                                                                                            \
+    F(uint8_t, topic)                                                                                                              \
+    F(uint8_t, subtopic)                                                                                                           \
+    F(uint8_t, len)                                                                                                                \
+    B(value, m->len)
+
+/*
+ * DATA_LONG and WRITE_LONG are DATA and WRITE with a 16-bit len, for values
+ * that do not fit one SFP packet.  Once MESSAGES_FEATURE_LONG is granted, a
+ * message too long for one packet is sent as a run of FRAGMENTs:
+ *
+ *     op | total (2) | offset (2) | octets
+ *
+ * total is the length of the whole serialized message and offset where these
+ * octets go in it.  SFP keeps them in order and a sender never interleaves
+ * two messages' fragments, so offset 0 starts a message and any gap drops it.
+ */
+#define MESSAGES_FRAGMENT_HEADER 5
+
+#define MESSAGES_SCHEMA_DATA_LONG(F, O, P, B, R)                                                                                   \
+    F(uint16_t, req_id)                                                                                                            \
+    F(uint8_t, topic)                                                                                                              \
+    F(uint8_t, subtopic)                                                                                                           \
+    F(uint8_t, flag)                                                                                                               \
+    F(uint32_t, timestamp)                                                                                                         \
+    F(uint16_t, len)                                                                                                               \
+    B(value, m->len)
+
+#define MESSAGES_SCHEMA_WRITE_LONG(F, O, P, B, R)                                                                                  \
+    F(uint16_t, req_id)                                                                                                            \
+    F(uint8_t, topic)                                                                                                              \
+    F(uint8_t, subtopic)                                                                                                           \
+    F(uint16_t, len)                                                                                                               \
+    B(value, m->len)
+
+#define MESSAGES_SCHEMA_FRAGMENT(F, O, P, B, R)                                                                                    \
+    F(uint16_t, total)                                                                                                             \
+    F(uint16_t, offset)                                                                                                            \
+    R(len, value)
+
+/*
+ * SUBSCRIBE grows optional trailing fields, each form implying the previous:
+ *
+ *     op | req_id (2) | topic | subtopic
+ *     ... | period (2)
+ *     ... | period (2) | deadband (2) | min_interval (2) | max_interval (2)
+ *
+ * The last form is sent when options has MESSAGES_SUBSCRIBE_OPTIONS set, a
+ * zero period then keeps the robot's default.
+ */
+#define MESSAGES_SCHEMA_SUBSCRIBE(F, O, P, B, R)                                                                                   \
+    F(uint16_t, req_id)                                                                                                            \
+    F(uint8_t, topic)                                                                                                              \
+    F(uint8_t, subtopic)                                                                                                           \
+    O(uint16_t, period, m->period != 0 || (m->options & MESSAGES_SUBSCRIBE_OPTIONS), period)                                       \
+    P(options, MESSAGES_SUBSCRIBE_OPTIONS, max_interval)                                                                           \
+    O(uint16_t, deadband, m->options & MESSAGES_SUBSCRIBE_OPTIONS, max_interval)                                                   \
+    O(uint16_t, min_interval, m->options & MESSAGES_SUBSCRIBE_OPTIONS, max_interval)                                               \
+    O(uint16_t, max_interval, m->options & MESSAGES_SUBSCRIBE_OPTIONS, max_interval)
+
+#define MESSAGES_SCHEMA_UNSUBSCRIBE(F, O, P, B, R) F(uint16_t, req_id)
+
+/*
+ * BATCH carries several whole messages in one frame, each after its length:
+ *
+ *     op | len | message (len) | len | message (len) | ...
+ *
+ * The receiver handles them in order as if each had come on its own.  Sent
+ * once MESSAGES_FEATURE_BATCH is granted, and never nested.
+ */
+#define MESSAGES_BATCH_HEADER 1
+
+#define MESSAGES_SCHEMA_BATCH(F, O, P, B, R) R(len, value)
+
+/* X(OP, member, name) for MESSAGES_OP_OP, message_any_t.member and message_name_t */
+#define MESSAGES_SCHEMA(X)                                                                                                         \
+    X(PING, ping, ping)                                                                                                            \
+    X(PONG, pong, pong)                                                                                                            \
+    X(INFO, info, info)                                                                                                            \
+    X(DATA, data, data)                                                                                                            \
+    X(DATA_MULTI, multi, data_multi)                                                                                               \
+    X(READ, read, read)                                                                                                            \
+    X(READ_MULTI, read_multi, read_multi)                                                                                          \
+    X(WRITE, write, write)                                                                                                         \
+    X(SUBSCRIBE, subscribe, subscribe)                                                                                             \
+    X(UNSUBSCRIBE, unsubscribe, unsubscribe)                                                                                       \
+    X(DATA_LONG, data_long, data_long)                                                                                             \
+    X(WRITE_LONG, write_long, write_long)                                                                                          \
+    X(FRAGMENT, fragment, fragment)                                                                                                \
+    X(BATCH, batch, batch)
+
+#define MESSAGES_STRUCT_F(type, name) type name;
+#define MESSAGES_STRUCT_O(type, name, present, last) type name;
+#define MESSAGES_STRUCT_P(name, value, last) uint8_t name;
+#define MESSAGES_STRUCT_B(name, count) uint8_t *name;
+#define MESSAGES_STRUCT_R(len, name)                                                                                               \
+    uint8_t len;                                                                                                                   \
+    uint8_t *name;
+#define MESSAGES_STRUCT(OP, member, name)                                                                                          \
+    typedef struct message_##name##_s {                                                                                            \
+        uint8_t op;                                                                                                                \
+        MESSAGES_SCHEMA_##OP(MESSAGES_STRUCT_F, MESSAGES_STRUCT_O, MESSAGES_STRUCT_P, MESSAGES_STRUCT_B, MESSAGES_STRUCT_R)        \
+    } message_##name##_t;
+
+MESSAGES_SCHEMA(MESSAGES_STRUCT)
+
+typedef struct message_record_s {
     uint16_t req_id;
     uint8_t topic;
     uint8_t subtopic;
     uint8_t flag;
-    uint32_t timestamp;
     uint8_t len;
     uint8_t *value;
-} message_data_t;
+} message_record_t;
 
-typedef struct message_read_s {
-    uint8_t op;
-    uint16_t req_id;
-    uint8_t topic;
-    uint8_t subtopic;
-} message_read_t;
+/*
+ * With MESSAGES_FEATURE_DATA_COMPACT granted, DATA may be sent instead as
+ *
+ *     op | flag | req_id (varint) | topic | subtopic | delta (varint) | len (varint) | value (len)
+ *
+ * with the DATA flag in the low bits of the op (0x10 to 0x17).  A varint is
+ * little-endian groups of 7 bits, the high bit set on every octet but the
+ * last.  delta is the timestamp less that of the previous DATA_COMPACT modulo
+ * 2^32, the chain starting from 0 whenever the feature is granted.  Varints do
+ * not have fixed offsets, so this op is coded by hand rather than in the schema.
+ */
+#define MESSAGES_DATA_COMPACT_FLAGS 0x07
+#define MESSAGES_DATA_COMPACT_HEADER_MAX 13
 
-typedef struct message_write_s {
+typedef struct message_data_compact_s {
     uint8_t op;
+    uint8_t flag;
     uint16_t req_id;
     uint8_t topic;
     uint8_t subtopic;
+    uint32_t delta;
     uint8_t len;
     uint8_t *value;
-} message_write_t;
+} message_data_compact_t;
 
-typedef struct message_subscribe_s {
-    uint8_t op;
-    uint16_t req_id;
-    uint8_t topic;
-    uint8_t subtopic;
-} message_subscribe_t;
+/* A message being put back together from its FRAGMENTs in buf, at most size octets long. */
+typedef struct message_reassembly_s {
+    uint8_t *buf;
+    size_t size;
+    size_t total;
+    size_t len;
+} message_reassembly_t;
 
-typedef struct message_unsubscribe_s {
-    uint8_t op;
-    uint16_t req_id;
-} message_unsubscribe_t;
+#define MESSAGES_UNION(OP, member, name) message_##name##_t member;
 
 typedef union message_any_t {
     message_t message;
-    message_ping_t ping;
-    message_pong_t pong;
-    message_info_t info;
     message_req_t req;
-    message_data_t data;
-    message_read_t read;
-    message_write_t write;
-    message_subscribe_t subscribe;
-    message_unsubscribe_t unsubscribe;
+    MESSAGES_SCHEMA(MESSAGES_UNION)
+    message_data_compact_t compact;
 } message_any_t;
 
 #ifdef __cplusplus
@@ -140,17 +362,42 @@ extern "C" {
 
 extern void message_ping_frame(message_ping_t *message, uint8_t seq_id);
 extern void message_pong_frame(message_pong_t *message, uint8_t seq_id);
+extern void message_ping_timed_frame(message_ping_t *message, uint8_t seq_id, uint32_t timestamp);
+extern void message_pong_timed_frame(message_pong_t *message, uint8_t seq_id, uint32_t origin, uint32_t receive,
+                                     uint32_t transmit);
 extern void message_info_frame(message_info_t *message, uint8_t topic, uint8_t subtopic, uint8_t len, uint8_t *value);
 extern void message_data_frame(message_data_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag,
                                uint32_t timestamp, uint8_t len, uint8_t *value);
+extern void message_data_compact_frame(message_data_compact_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic,
+                                       uint8_t flag, uint32_t delta, uint8_t len, uint8_t *value);
+extern void message_data_multi_frame(message_data_multi_t *message, uint32_t timestamp, uint8_t len, uint8_t *value);
 extern void message_read_frame(message_read_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic);
+extern void message_read_multi_frame(message_read_multi_t *message, uint16_t req_id, uint8_t count, uint8_t *pairs);
 extern void message_write_frame(message_write_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t len,
                                 uint8_t *value);
 extern void message_subscribe_frame(message_subscribe_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic);
+extern void message_subscribe_period_frame(message_subscribe_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic,
+                                          uint16_t period);
+extern void message_subscribe_options_frame(message_subscribe_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic,
+                                           uint16_t period, uint16_t deadband, uint16_t min_interval, uint16_t max_interval);
 extern void message_unsubscribe_frame(message_unsubscribe_t *message, uint16_t req_id);
+extern void message_data_long_frame(message_data_long_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag,
+                                    uint32_t timestamp, uint16_t len, uint8_t *value);
+extern void message_write_long_frame(message_write_long_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint16_t len,
+                                     uint8_t *value);
+extern void message_fragment_frame(message_fragment_t *message, uint16_t total, uint16_t offset, uint8_t len, uint8_t *value);
 extern size_t message_getsizeof(const message_any_t *m);
 extern int message_serialize(const message_any_t *m, uint8_t *buf, size_t len, size_t *outlen);
 extern int message_deserialize(message_any_t *m, const uint8_t *buf, size_t len);
+extern int message_serialize_head(const message_any_t *m, uint8_t *buf, size_t len, size_t *outlen);
+extern void message_reassembly_init(message_reassembly_t *r, uint8_t *buf, size_t size);
+extern int message_reassemble(message_reassembly_t *r, const message_fragment_t *fragment);
+extern size_t message_record_append(uint8_t *buf, size_t len, size_t offset, uint16_t req_id, uint8_t topic, uint8_t subtopic,
+                                    uint8_t flag, uint8_t vlen, const uint8_t *value);
+extern int message_record_next(const message_data_multi_t *multi, size_t *offset, message_record_t *record);
+extern void message_batch_frame(message_batch_t *message, uint8_t len, uint8_t *value);
+extern size_t message_batch_append(uint8_t *buf, size_t len, size_t offset, const message_any_t *m);
+extern int message_batch_next(const message_batch_t *batch, size_t *offset, message_any_t *m);
 
 #ifdef __cplusplus
 }
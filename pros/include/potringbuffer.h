@@ -57,6 +57,10 @@ extern SFPpacket *potRingbufferFront(PotRingbuffer *p);
 extern SFPpacket *potRingbufferBack(PotRingbuffer *p);
 /* Append an element to the back. */
 extern void potRingbufferPushBack(PotRingbuffer *p, const SFPpacket *elem);
+/* Make room at the back and return the element there, to be filled in place. */
+extern SFPpacket *potRingbufferReserveBack(PotRingbuffer *p);
+/* Append the element returned by potRingbufferReserveBack(). */
+extern void potRingbufferCommitBack(PotRingbuffer *p);
 /* Prepend an element to the front. */
 extern void potRingbufferPushFront(PotRingbuffer *p, const SFPpacket *elem);
 /* Remove the first element. */
@@ -0,0 +1,43 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*
+ * reflex.h
+ */
+
+#ifndef REFLEX_H_
+
+#define REFLEX_H_
+
+#include <API.h>
+
+#if !defined(REFLEX_MAX)
+#define REFLEX_MAX 8
+#endif
+
+// evaluation period of the reflex task in milliseconds
+#if !defined(REFLEX_PERIOD)
+#define REFLEX_PERIOD 2
+#endif
+
+/* A rule on the wire:
+ *
+ *     topic | subtopic | comparator | flags | threshold (4) | motor | speed
+ *
+ * When sensor `topic`/`subtopic` compared with `threshold` becomes true, motor
+ * port `motor` (1-10) is set to `speed` straight away.  With HOLD the speed is
+ * set again every period while the comparison stays true, with ONCE the rule
+ * disarms after firing until it is written again. */
+#define REFLEX_RULE_SIZE 10
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern void reflexInit(void);
+extern void reflexStart(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,14 +10,68 @@
 
 #include <API.h>
 
+#include "clocksync.h"
+#include "histogram.h"
 #include "messages.h"
 #include "serial_framing_protocol.h"
 
-#define RPC_SUB_MAX 10
+#if !defined(RPC_SUB_MAX)
+#define RPC_SUB_MAX 64
+#endif
+#if !defined(RPC_SUB_HASH)
+#define RPC_SUB_HASH 32
+#endif
+#if !defined(RPC_SUB_VALUES)
+#define RPC_SUB_VALUES 12
+#endif
+#if RPC_SUB_MAX > 250
+#error "RPC_SUB_MAX must leave room for the named PUBSUB subtopics"
+#endif
+#if (RPC_SUB_HASH & (RPC_SUB_HASH - 1)) != 0
+#error "RPC_SUB_HASH must be a power of two"
+#endif
 #define RPC_PUB_TIMEOUT 25
+#define RPC_PUB_PERIOD_MIN 5
+#define RPC_PUB_PERIOD_MAX 1000
+#define RPC_DUE_NONE 0xff
+#define RPC_SUB_NONE 0xff
+#define RPC_DATA_HEADER 11
+#define RPC_DATA_MAX (SFP_CONFIG_MAX_PACKET_SIZE - RPC_DATA_HEADER)
+#define RPC_BATCH_MAX (SFP_CONFIG_MAX_PACKET_SIZE - MESSAGES_DATA_MULTI_HEADER)
+#define RPC_FRAGMENT_MAX (SFP_CONFIG_MAX_PACKET_SIZE - MESSAGES_FRAGMENT_HEADER)
+#define RPC_FEATURES                                                                                                               \
+    (MESSAGES_FEATURE_DATA_MULTI | MESSAGES_FEATURE_DATA_COMPACT | MESSAGES_FEATURE_LONG | MESSAGES_FEATURE_BATCH |                 \
+     MESSAGES_FEATURE_MICROS)
+#define RPC_TOPIC_MAX 32
+#define RPC_TOPIC_FLAG_ALL 0x01
+#define RPC_TOPIC_FLAG_CHANGES 0x02
+#define RPC_SUB_FLAG_DEADBAND 0x01
+#define RPC_SUB_FLAG_FORCE 0x02
+#define RPC_SUB_FLAG_SENT 0x04
 #define RPC_INFO_TIMEOUT 1000
+#define RPC_SESSION_GRACE 10000
+#define RPC_PING_TIMEOUT 250
+#define RPC_DOWNLOAD_MIN 32
+#if !defined(RPC_UPLOAD_BLOCK)
+// one flash page on the Cortex
+#define RPC_UPLOAD_BLOCK 2048
+#endif
+#if !defined(RPC_DOWNLOAD_BLOCK)
+// cassette octets per DATA_LONG when the host takes long messages
+#define RPC_DOWNLOAD_BLOCK RPC_UPLOAD_BLOCK
+#endif
+#if !defined(RPC_LONG_MAX)
+// longest message reassembled from FRAGMENTs
+#define RPC_LONG_MAX 1024
+#endif
+
+// octets a message of len takes on the wire, with SFP escaping every octet
+#define RPC_WIRE_SIZE(len) (2 * ((len) + 1 + sizeof(SFPcrc)) + 2)
 
 typedef int (*rpcWritePacket_t)(const uint8_t *octets, size_t len, size_t *outlen, void *userdata);
+typedef size_t (*rpcWriteSpace_t)(void *userdata);
+typedef uint8_t *(*rpcWriteReserve_t)(void *userdata);
+typedef int (*rpcWriteCommit_t)(size_t len, size_t *outlen, void *userdata);
 
 typedef struct rpcBuffer_s {
     uint8_t buf[SFP_CONFIG_MAX_PACKET_SIZE];
@@ -29,32 +83,135 @@ typedef struct rpcSubscription_s {
     uint16_t req_id;
     uint8_t topic;
     uint8_t subtopic;
+    uint8_t link;
+    uint8_t due;
+    uint16_t period;
+    uint32_t next;
+    uint8_t flags;
+    uint8_t base;
+    uint16_t deadband;
+    uint16_t minInterval;
+    uint16_t maxInterval;
+    uint32_t published;
+    int32_t last[RPC_SUB_VALUES];
 } rpcSubscription_t;
 
+/* A cassette being streamed to the host a chunk at a time by rpcLoop(). */
+typedef struct rpcDownload_s {
+    PROS_FILE *fp;
+    uint16_t req_id;
+    uint8_t cassette;
+    uint32_t offset;
+    // the DATA_LONG being sent as FRAGMENTs, done when sent reaches total
+    uint16_t total;
+    uint16_t sent;
+} rpcDownload_t;
+
+/* Cassette octets taken from the host but not yet written to flash. */
+typedef struct rpcUpload_s {
+    uint32_t offset;
+    uint16_t len;
+    uint8_t buf[RPC_UPLOAD_BLOCK];
+} rpcUpload_t;
+
+typedef enum rpcSessionState_t {
+    rpcSessionStateNone = 0,
+    rpcSessionStateActive,
+    rpcSessionStateDetached,
+    rpcSessionStatePending
+} rpcSessionState_t;
+
 typedef struct rpc_s {
     uint8_t seq_id;
     uint8_t ipv4[4];
-    int8_t motor[10];
     uint8_t cassette;
     PROS_FILE *fp;
+    rpcUpload_t upload;
+    rpcDownload_t download;
     uint8_t tmp[SFP_CONFIG_MAX_PACKET_SIZE];
     rpcBuffer_t in;
     rpcBuffer_t out;
+    message_reassembly_t reassembly;
+    uint8_t longbuf[RPC_LONG_MAX];
     uint32_t timestamp;
     uint32_t heartbeat;
-    uint32_t published;
     uint32_t sendstats;
+    uint32_t token;
+    uint32_t detached;
+    rpcSessionState_t session;
+    uint8_t pingSeq;
+    bool pingTimed;
+    uint32_t pinged;
+    uint32_t rxstamp;
+    // the host's microsecond clock, from timed PONGs to our PINGs
+    clocksync_t clock;
+    uint8_t features;
+    uint32_t compactStamp;
+    bool batching;
+    uint8_t batchLen;
+    uint32_t batchStamp;
+    uint8_t batch[RPC_BATCH_MAX];
+    histogram_t rtt;
+    histogram_t reply;
     rpcWritePacket_t writePacket;
+    rpcWriteSpace_t writeSpace;
+    // optional, to serialize in place: commit sends len octets of the reserved buffer, 0 gives it back
+    rpcWriteReserve_t writeReserve;
+    rpcWriteCommit_t writeCommit;
     rpcSubscription_t subs[RPC_SUB_MAX];
+    uint8_t subHash[RPC_SUB_HASH];
+    uint8_t subFree;
+    uint8_t subCount;
+    uint8_t due[RPC_SUB_MAX];
+    uint8_t dueCount;
 } rpc_t;
 
+typedef int (*rpcTopicRead_t)(rpc_t *rpc, const message_read_t *read);
+typedef int (*rpcTopicWrite_t)(rpc_t *rpc, const message_write_t *write);
+typedef int (*rpcTopicPublish_t)(rpc_t *rpc, rpcSubscription_t *sub);
+typedef int (*rpcTopicSubscribe_t)(rpc_t *rpc, const message_subscribe_t *subscribe);
+
+/*
+ * Handlers for one topic, looked up by topic ID.  Each returns 0 once it has
+ * replied or published, or a MESSAGES_ERROR_* code for rpc to send back.
+ * Without a subscribe handler, subtopics 0..count-1 and the `all` subtopic
+ * may be subscribed to when the topic can publish.
+ *
+ * A publish handler asks rpcSubChanged() whether each value is worth sending
+ * and records what it sent with rpcSubRemember().  Unless the subscriber set
+ * a deadband, topics flagged RPC_TOPIC_FLAG_CHANGES publish on any change and
+ * the rest publish every period.
+ */
+typedef struct rpcTopic_s {
+    uint8_t topic;
+    uint8_t flags;
+    uint8_t count;
+    uint8_t all;
+    rpcTopicRead_t read;
+    rpcTopicWrite_t write;
+    rpcTopicPublish_t publish;
+    rpcTopicSubscribe_t subscribe;
+} rpcTopic_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+extern int rpcTopicRegister(const rpcTopic_t *topic);
+extern const rpcTopic_t *rpcTopicFind(uint8_t topic);
+extern void rpcInit(rpc_t *rpc);
 extern void rpcLoop(rpc_t *rpc);
 extern void rpcRecv(rpc_t *rpc, const message_any_t *message);
 extern int rpcSend(rpc_t *rpc, const message_any_t *message);
+extern int rpcSendData(rpc_t *rpc, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag, uint8_t len, uint8_t *value);
+extern int rpcSendPub(rpc_t *rpc, rpcSubscription_t *sub, uint8_t len, uint8_t *value);
+extern int rpcSendRep(rpc_t *rpc, const message_read_t *read, uint8_t len, uint8_t *value);
+extern int rpcSendRepError(rpc_t *rpc, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t error);
+extern bool rpcSubChanged(const rpcSubscription_t *sub, uint8_t index, int32_t value);
+extern void rpcSubRemember(rpcSubscription_t *sub, uint8_t index, int32_t value);
+extern void rpcSessionAttach(rpc_t *rpc);
+extern void rpcSessionDetach(rpc_t *rpc);
+extern uint32_t rpcTimestamp(rpc_t *rpc);
 
 #ifdef __cplusplus
 }
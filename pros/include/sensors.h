@@ -0,0 +1,59 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*
+ * sensors.h
+ */
+
+#ifndef SENSORS_H_
+
+#define SENSORS_H_
+
+#include <API.h>
+
+// sampling period of the sensor task in milliseconds, reflex rules see nothing fresher
+#if !defined(SENSORS_PERIOD)
+#define SENSORS_PERIOD 2
+#endif
+
+#define SENSORS_ANALOG_MAX 8
+#define SENSORS_DIGITAL_MAX 12
+#define SENSORS_ENCODER_MAX 6
+#define SENSORS_GYRO_MAX 4
+#define SENSORS_IME_MAX 8
+#define SENSORS_ULTRASONIC_MAX 4
+
+/* Everything the sensor task read in one pass.  Subtopic n of a sensor topic
+ * is entry n here: the port for analog and digital, otherwise the order in
+ * which the sensor was added. */
+typedef struct sensorsSnapshot_s {
+    uint32_t stamp;
+    uint16_t digital;
+    uint16_t analog[SENSORS_ANALOG_MAX];
+    int32_t encoder[SENSORS_ENCODER_MAX];
+    int16_t gyro[SENSORS_GYRO_MAX];
+    int32_t ime[SENSORS_IME_MAX];
+    int16_t ultrasonic[SENSORS_ULTRASONIC_MAX];
+    uint8_t encoders;
+    uint8_t gyros;
+    uint8_t imes;
+    uint8_t ultrasonics;
+} sensorsSnapshot_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern void sensorsInit(void);
+extern void sensorsStart(void);
+extern int sensorsAddEncoder(Encoder encoder);
+extern int sensorsAddGyro(Gyro gyro);
+extern int sensorsAddUltrasonic(Ultrasonic ultrasonic);
+extern void sensorsSetImeCount(unsigned int count);
+extern void sensorsSnapshot(sensorsSnapshot_t *snapshot);
+extern bool sensorsValue(const sensorsSnapshot_t *snapshot, uint8_t topic, uint8_t index, int32_t *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
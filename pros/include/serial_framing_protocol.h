@@ -111,6 +111,11 @@ extern "C" {
 /* Return 1 on packet available, 0 on unavailable, -1 on error. */
 extern int sfpDeliverOctet(SFPcontext *ctx, uint8_t octet, uint8_t *buf, size_t len, size_t *outlen);
 extern int sfpWritePacket(SFPcontext *ctx, const uint8_t *buf, size_t len, size_t *outlen);
+/* Return SFP_CONFIG_MAX_PACKET_SIZE octets of history to build the next packet in, sent by sfpCommitPacket().  A
+ * reservation that is never committed is simply taken again by the next one, but a full history gives up its oldest
+ * packet to make it. */
+extern uint8_t *sfpReservePacket(SFPcontext *ctx);
+extern int sfpCommitPacket(SFPcontext *ctx, size_t len, size_t *outlen);
 extern void sfpConnect(SFPcontext *ctx);
 extern int sfpIsConnected(SFPcontext *ctx);
 
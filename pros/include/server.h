@@ -10,12 +10,36 @@
 
 #include <API.h>
 
+#include "histogram.h"
+
 #define SERVER_WAIT_MILLISECONDS 2
 
+// queue sizes must be powers of two
+#if !defined(SERVER_RX_QUEUE_SIZE)
+#define SERVER_RX_QUEUE_SIZE 1024
+#endif
+
+#if !defined(SERVER_TX_QUEUE_SIZE)
+#define SERVER_TX_QUEUE_SIZE 1024
+#endif
+
+#define SERVER_UART_CHUNK 64
+
 typedef struct serverIpv4_s {
     uint8_t v[4];
 } serverIpv4_t;
 
+typedef struct serverQueueStats_s {
+    uint16_t rxCount;
+    uint16_t rxPeak;
+    uint16_t rxSize;
+    uint16_t txCount;
+    uint16_t txPeak;
+    uint16_t txSize;
+    uint32_t rxStalls;
+    uint32_t txStalls;
+} serverQueueStats_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -26,6 +50,9 @@ extern void serverStart(void);
 extern void serverStop(void);
 extern int serverIsConnected(void);
 extern serverIpv4_t serverGetIpv4(void);
+extern serverQueueStats_t serverGetQueueStats(void);
+extern void serverGetLatency(histogramSummary_t *rtt, histogramSummary_t *reply);
+extern void serverResetLatency(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,52 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*
+ * spscring.h
+ */
+
+#ifndef SPSCRING_H_
+
+#define SPSCRING_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Lock-free byte ring for exactly one producer task and one consumer task.
+ * The producer only ever moves head, the consumer only ever moves tail. The
+ * size of the backing storage must be a power of two. */
+typedef struct spscRing_s {
+    volatile size_t head;
+    volatile size_t tail;
+    size_t size;
+    size_t peak;
+    uint32_t stalls;
+    uint8_t *buf;
+} spscRing_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Initialize the ring on top of size bytes of storage. */
+extern void spscRingInit(spscRing_t *r, uint8_t *buf, size_t size);
+/* Number of bytes waiting to be consumed. */
+extern size_t spscRingCount(const spscRing_t *r);
+/* Number of bytes that can be produced without blocking. */
+extern size_t spscRingFree(const spscRing_t *r);
+/* Producer: copy up to len bytes in, returns the number of bytes written. */
+extern size_t spscRingWrite(spscRing_t *r, const uint8_t *buf, size_t len);
+/* Consumer: copy exactly len bytes out at offset without consuming them. */
+extern bool spscRingPeek(const spscRing_t *r, size_t offset, uint8_t *buf, size_t len);
+/* Consumer: copy up to len bytes out, returns the number of bytes read. */
+extern size_t spscRingRead(spscRing_t *r, uint8_t *buf, size_t len);
+/* Consumer: drop len bytes without copying them. */
+extern void spscRingSkip(spscRing_t *r, size_t len);
+/* Consumer: drop everything currently queued. */
+extern void spscRingClear(spscRing_t *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,61 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*
+ * trajectory.h
+ */
+
+#ifndef TRAJECTORY_H_
+
+#define TRAJECTORY_H_
+
+#include <API.h>
+
+// steps queued at most, 320 ms of four motors at 100 Hz
+#if !defined(TRAJECTORY_MAX)
+#define TRAJECTORY_MAX 32
+#endif
+
+// period of the trajectory task in milliseconds, steps are applied on its boundaries
+#if !defined(TRAJECTORY_PERIOD)
+#define TRAJECTORY_PERIOD 1
+#endif
+
+// furthest ahead in milliseconds a batch may start, anything later is a confused clock
+#if !defined(TRAJECTORY_AHEAD)
+#define TRAJECTORY_AHEAD 10000
+#endif
+
+/* A batch of setpoints on the wire:
+ *
+ *     at (4) | interval (2) | ports (2) | flags (1) | speeds
+ *
+ * `ports` has bit n-1 set for each motor port n (1-10) it drives and `speeds`
+ * holds a speed for each of them, lowest port first, for every step.  Step k
+ * is due `at` + k * `interval` milliseconds, `at` being in the clock of DATA
+ * timestamps, so microseconds of the host's clock once it has negotiated
+ * MICROS.  Queued steps due at or after `at` are replaced, so the host can
+ * re-plan what it already sent.  Running out of steps an interval after the
+ * last one is an underrun and stops the motors, unless that step came with
+ * END.  Writing nothing stops the motors and clears the queue. */
+#define TRAJECTORY_BATCH_HEADER 9
+
+/* The status, read or published on an underrun:
+ *
+ *     running | queued | applied (4) | late (4) | underruns (4)
+ *
+ * `late` counts steps applied a period or more after they were due, or
+ * skipped for a later one that was also due. */
+#define TRAJECTORY_STATUS_SIZE 14
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern void trajectoryInit(void);
+extern void trajectoryStart(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,187 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*-----------------------------------------------------------------------------*/
+/** @file    capture.c                                                         */
+/** @brief   Timestamped capture of the raw octets crossing the server UART    */
+/*-----------------------------------------------------------------------------*/
+
+#include "capture.h"
+#include "cassette.h"
+
+#include <string.h>
+
+typedef struct capture_s {
+    bool enabled;
+    Mutex lock;
+    size_t head;
+    size_t tail;
+    uint32_t records;
+    uint32_t overwritten;
+    uint8_t buf[CAPTURE_SIZE];
+} capture_t;
+
+static capture_t capture;
+
+static void capturePut(const uint8_t *buf, size_t len);
+static void captureGet(size_t offset, uint8_t *buf, size_t len);
+static void captureDropOldest(void);
+
+void
+captureInit(void)
+{
+    capture.lock = mutexCreate();
+    capture.enabled = false;
+    capture.head = capture.tail = 0;
+    capture.records = capture.overwritten = 0;
+}
+
+void
+captureEnable(bool enabled)
+{
+    capture.enabled = enabled;
+}
+
+void
+captureClear(void)
+{
+    (void)mutexTake(capture.lock, -1);
+    capture.head = capture.tail = 0;
+    capture.records = capture.overwritten = 0;
+    (void)mutexGive(capture.lock);
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Tap called by the server with every chunk read or written.     */
+/** @param[in]  dir CAPTURE_DIR_RX or CAPTURE_DIR_TX                           */
+/** @param[in]  buf The raw octets                                             */
+/** @param[in]  len The number of octets                                       */
+/*-----------------------------------------------------------------------------*/
+void
+captureOctets(uint8_t dir, const uint8_t *buf, size_t len)
+{
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    uint32_t now;
+    size_t chunk;
+    if (!capture.enabled || len == 0) {
+        return;
+    }
+    now = (uint32_t)micros();
+    header[0] = dir;
+    header[2] = (uint8_t)(now >> 24);
+    header[3] = (uint8_t)(now >> 16);
+    header[4] = (uint8_t)(now >> 8);
+    header[5] = (uint8_t)(now);
+    (void)mutexTake(capture.lock, -1);
+    while (len > 0) {
+        chunk = (len > 255) ? 255 : len;
+        header[1] = (uint8_t)chunk;
+        // keep the most recent traffic, whole records at a time
+        while (CAPTURE_SIZE - (capture.head - capture.tail) < CAPTURE_HEADER_SIZE + chunk) {
+            (void)captureDropOldest();
+        }
+        (void)capturePut(header, CAPTURE_HEADER_SIZE);
+        (void)capturePut(buf, chunk);
+        capture.records++;
+        buf += chunk;
+        len -= chunk;
+    }
+    (void)mutexGive(capture.lock);
+}
+
+captureStats_t
+captureGetStats(void)
+{
+    captureStats_t stats;
+    stats.enabled = capture.enabled;
+    stats.records = capture.records;
+    stats.overwritten = capture.overwritten;
+    stats.used = (uint16_t)(capture.head - capture.tail);
+    stats.size = CAPTURE_SIZE;
+    return stats;
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Print the ring as hex, 32 octets per line.                     */
+/** @param[in]  chp The channel to print on                                   */
+/*-----------------------------------------------------------------------------*/
+void
+captureDump(PROS_FILE *chp)
+{
+    size_t offset;
+    size_t used;
+    uint8_t c;
+    bool enabled = capture.enabled;
+    capture.enabled = false;
+    (void)mutexTake(capture.lock, -1);
+    used = capture.head - capture.tail;
+    for (offset = 0; offset < used; offset++) {
+        (void)captureGet(offset, &c, 1);
+        fprintf(chp, "%02x", c);
+        if ((offset & 31) == 31) {
+            fprint("\r\n", chp);
+        }
+    }
+    if ((offset & 31) != 0) {
+        fprint("\r\n", chp);
+    }
+    (void)mutexGive(capture.lock);
+    capture.enabled = enabled;
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Write the ring to a cassette file.                             */
+/** @param[in]  index The cassette to overwrite                               */
+/** @returns    The number of octets written or -1 on error                    */
+/*-----------------------------------------------------------------------------*/
+int
+captureSave(uint8_t index)
+{
+    PROS_FILE *fp;
+    size_t offset;
+    size_t used;
+    uint8_t c;
+    bool enabled = capture.enabled;
+    fp = cassetteOpenWrite(index);
+    if (fp == NULL) {
+        return -1;
+    }
+    capture.enabled = false;
+    (void)mutexTake(capture.lock, -1);
+    used = capture.head - capture.tail;
+    for (offset = 0; offset < used; offset++) {
+        (void)captureGet(offset, &c, 1);
+        (void)fputc((int)c, fp);
+    }
+    (void)mutexGive(capture.lock);
+    (void)fflush(fp);
+    (void)fclose(fp);
+    capture.enabled = enabled;
+    return (int)used;
+}
+
+static void
+capturePut(const uint8_t *buf, size_t len)
+{
+    while (len-- > 0) {
+        capture.buf[capture.head++ & (CAPTURE_SIZE - 1)] = *buf++;
+    }
+}
+
+static void
+captureGet(size_t offset, uint8_t *buf, size_t len)
+{
+    size_t pos = capture.tail + offset;
+    while (len-- > 0) {
+        *buf++ = capture.buf[pos++ & (CAPTURE_SIZE - 1)];
+    }
+}
+
+static void
+captureDropOldest(void)
+{
+    uint8_t len;
+    (void)captureGet(1, &len, 1);
+    capture.tail += CAPTURE_HEADER_SIZE + len;
+    capture.records--;
+    capture.overwritten++;
+}
@@ -0,0 +1,107 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+
+#include "clocksync.h"
+
+#include <string.h>
+
+void
+clocksyncReset(clocksync_t *c)
+{
+    (void)memset(c, 0, sizeof(clocksync_t));
+}
+
+/* Remote less local at local time, from the last correction and the drift since. */
+uint32_t
+clocksyncOffset(const clocksync_t *c, uint32_t local)
+{
+    int32_t elapsed = (int32_t)(local - c->stamp);
+    return c->offset + (uint32_t)(int32_t)(((int64_t)c->drift * elapsed) >> 32);
+}
+
+/* The remote clock at local time, local itself until the first sample. */
+uint32_t
+clocksyncRemote(const clocksync_t *c, uint32_t local)
+{
+    return c->synced ? local + clocksyncOffset(c, local) : local;
+}
+
+int32_t
+clocksyncDriftPpb(const clocksync_t *c)
+{
+    return (int32_t)(((int64_t)c->drift * 1000000000) >> 32);
+}
+
+static void
+clocksyncStart(clocksync_t *c, const clocksyncSample_t *sample)
+{
+    c->synced = true;
+    c->stamp = sample->stamp;
+    c->offset = sample->offset;
+    c->drift = 0;
+    c->delay = sample->delay;
+    c->drifted = false;
+    c->anchorStamp = sample->stamp;
+    c->anchorOffset = sample->offset;
+}
+
+void
+clocksyncSample(clocksync_t *c, uint32_t origin, uint32_t receive, uint32_t transmit, uint32_t arrival)
+{
+    uint32_t elapsed = arrival - origin;
+    uint32_t held = transmit - receive;
+    clocksyncSample_t *sample;
+    clocksyncSample_t *best;
+    uint32_t predicted;
+    uint32_t span;
+    int32_t measured;
+    int32_t error;
+    uint8_t i;
+    if (held > elapsed) {
+        return;
+    }
+    sample = &c->samples[c->next];
+    c->next = (uint8_t)((c->next + 1) % CLOCKSYNC_SAMPLES);
+    if (c->count < CLOCKSYNC_SAMPLES) {
+        c->count++;
+    }
+    sample->stamp = arrival;
+    sample->delay = elapsed - held;
+    // the remote received it half a round trip after we sent it
+    sample->offset = receive - origin - sample->delay / 2;
+    best = &c->samples[0];
+    for (i = 1; i < c->count; i++) {
+        if (c->samples[i].delay < best->delay) {
+            best = &c->samples[i];
+        }
+    }
+    if (!c->synced) {
+        (void)clocksyncStart(c, best);
+        return;
+    }
+    if ((int32_t)(best->stamp - c->stamp) <= 0) {
+        // already corrected for, wait for a better one or for it to leave the window
+        return;
+    }
+    predicted = clocksyncOffset(c, best->stamp);
+    error = (int32_t)(best->offset - predicted);
+    if (error > CLOCKSYNC_STEP || error < -CLOCKSYNC_STEP) {
+        // the remote clock jumped, nothing before this sample is any use
+        c->samples[0] = *sample;
+        c->next = 1 % CLOCKSYNC_SAMPLES;
+        c->count = 1;
+        (void)clocksyncStart(c, &c->samples[0]);
+        return;
+    }
+    c->stamp = best->stamp;
+    c->offset = predicted + (uint32_t)(error / 4);
+    c->delay = best->delay;
+    span = best->stamp - c->anchorStamp;
+    if (span >= CLOCKSYNC_DRIFT_SPAN) {
+        measured = (int32_t)(((int64_t)(int32_t)(best->offset - c->anchorOffset) << 32) / (int64_t)span);
+        c->drift = c->drifted ? c->drift + (measured - c->drift) / 4 : measured;
+        c->drifted = true;
+        c->anchorStamp = best->stamp;
+        c->anchorOffset = best->offset;
+    }
+}
@@ -0,0 +1,108 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+
+#include "histogram.h"
+
+#include <string.h>
+
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+
+static uint16_t
+histogramIndex(uint32_t value)
+{
+    uint8_t msb;
+    uint8_t shift;
+    if (value < HISTOGRAM_SUB) {
+        return (uint16_t)value;
+    }
+    msb = (uint8_t)(31 - __builtin_clz(value));
+    if (msb >= HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    shift = msb - HISTOGRAM_SUB_BITS;
+    return (uint16_t)(((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) & (HISTOGRAM_SUB - 1)));
+}
+
+/* Largest value that falls into the bucket at index. */
+static uint32_t
+histogramUpper(uint16_t index)
+{
+    uint8_t shift;
+    uint32_t mantissa;
+    if (index < HISTOGRAM_SUB) {
+        return index;
+    }
+    shift = (uint8_t)((index >> HISTOGRAM_SUB_BITS) - 1);
+    mantissa = (index & (HISTOGRAM_SUB - 1)) | HISTOGRAM_SUB;
+    return (mantissa << shift) + ((1UL << shift) - 1);
+}
+
+void
+histogramReset(histogram_t *h)
+{
+    (void)memset(h, 0, sizeof(histogram_t));
+    h->min = UINT32_MAX;
+}
+
+void
+histogramRecord(histogram_t *h, uint32_t value)
+{
+    uint16_t index = histogramIndex(value);
+    int i;
+    if (h->buckets[index] == UINT16_MAX) {
+        // halve everything so old samples decay instead of the counters wrapping
+        h->count = 0;
+        for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            h->buckets[i] >>= 1;
+            h->count += h->buckets[i];
+        }
+    }
+    h->buckets[index]++;
+    h->count++;
+    if (value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+uint32_t
+histogramPercentile(const histogram_t *h, uint8_t percent)
+{
+    uint32_t rank;
+    uint32_t seen = 0;
+    uint32_t value;
+    int i;
+    if (h->count == 0) {
+        return 0;
+    }
+    rank = (uint32_t)(((uint64_t)h->count * percent + 99) / 100);
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    value = histogramUpper((uint16_t)i);
+    if (value > h->max) {
+        value = h->max;
+    }
+    if (value < h->min) {
+        value = h->min;
+    }
+    return value;
+}
+
+void
+histogramSummarize(const histogram_t *h, histogramSummary_t *summary)
+{
+    summary->count = h->count;
+    summary->min = (h->count == 0) ? 0 : h->min;
+    summary->p50 = histogramPercentile(h, 50);
+    summary->p99 = histogramPercentile(h, 99);
+    summary->max = h->max;
+}
@@ -1,99 +1,177 @@
-// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
-// vim: ts=4 sw=4 ft=c++ et
-/** @file init.c
- * @brief File for initialization code
- *
- * This file should contain the user initialize() function and any functions related to it.
- *
- * Any copyright is dedicated to the Public Domain.
- * http://creativecommons.org/publicdomain/zero/1.0/
- *
- * PROS contains FreeRTOS (http://www.freertos.org) whose source code may be
- * obtained from http://sourceforge.net/projects/freertos/files/ or on request.
- */
-
-#include "main.h"
-
-#include "mtrmgr.h"
-#include "server.h"
-#include "shell.h"
-
-#include "apollo.h"
-
-// static const ShellCommand commands[] = {{"adc", vexAdcDebug},
-//                                         {"spi", vexSpiDebug},
-//                                         {"motor", vexMotorDebug},
-//                                         {"lcd", vexLcdDebug},
-//                                         {"enc", vexEncoderDebug},
-//                                         {"son", vexSonarDebug},
-//                                         {"ime", vexIMEDebug},
-//                                         {"test", vexTestDebug},
-//                                         {"sm", cmd_sm},
-//                                         {"apollo", cmd_apollo},
-//                                         {NULL, NULL}};
-
-static void
-cmd_apollo(PROS_FILE *chp, int argc, char *argv[])
-{
-    (void)argc;
-    (void)argv;
-
-    apolloInit();
-
-    // run until any key press
-    while (fcount(chp) == 0) {
-        apolloUpdate();
-    }
-
-    apolloDeinit();
-}
-
-// configuration for the shell
-static const shellCommand_t shellCommands[] = {{"apollo", cmd_apollo}, {NULL, NULL}};
-static const shellConfig_t shellConfig = {stdout, shellCommands};
-
-/*
- * Runs pre-initialization code. This function will be started in kernel mode one time while the
- * VEX Cortex is starting up. As the scheduler is still paused, most API functions will fail.
- *
- * The purpose of this function is solely to set the default pin modes (pinMode()) and port
- * states (digitalWrite()) of limit switches, push buttons, and solenoids. It can also safely
- * configure a UART port (usartOpen()) but cannot set up an LCD (lcdInit()).
- */
-void
-initializeIO()
-{
-    (void)standaloneModeEnable();
-    (void)watchdogInit();
-    (void)setTeamName("TopSecret");
-    (void)motorManagerInit();
-    (void)serverSetup(uart2);
-    (void)serverInit();
-    (void)shellInit();
-    return;
-}
-
-/*
- * Runs user initialization code. This function will be started in its own task with the default
- * priority and stack size once when the robot is starting up. It is possible that the VEXnet
- * communication link may not be fully established at this time, so reading from the VEX
- * Joystick may fail.
- *
- * This function should initialize most sensors (gyro, encoders, ultrasonics), LCDs, global
- * variables, and IMEs.
- *
- * This function must exit relatively promptly, or the operatorControl() and autonomous() tasks
- * will not start. An autonomous mode selection menu like the pre_auton() in other environments
- * can be implemented in this task if desired.
- */
-void
-initialize()
-{
-    (void)lcdInit(uart1);
-    (void)lcdSetBacklight(uart1, true);
-    (void)lcdSetText(uart1, 1, "PROS V2.12.0    ");
-    (void)lcdSetText(uart1, 2, "VEX CORTEX LCD1 ");
-    (void)serverStart();
-    (void)shellStart(&shellConfig);
-    return;
-}
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/** @file init.c
+ * @brief File for initialization code
+ *
+ * This file should contain the user initialize() function and any functions related to it.
+ *
+ * Any copyright is dedicated to the Public Domain.
+ * http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * PROS contains FreeRTOS (http://www.freertos.org) whose source code may be
+ * obtained from http://sourceforge.net/projects/freertos/files/ or on request.
+ */
+
+#include "main.h"
+
+#include "capture.h"
+#include "mtrmgr.h"
+#include "reflex.h"
+#include "sensors.h"
+#include "server.h"
+#include "shell.h"
+#include "trajectory.h"
+
+#include "apollo.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// static const ShellCommand commands[] = {{"adc", vexAdcDebug},
+//                                         {"spi", vexSpiDebug},
+//                                         {"motor", vexMotorDebug},
+//                                         {"lcd", vexLcdDebug},
+//                                         {"enc", vexEncoderDebug},
+//                                         {"son", vexSonarDebug},
+//                                         {"ime", vexIMEDebug},
+//                                         {"test", vexTestDebug},
+//                                         {"sm", cmd_sm},
+//                                         {"apollo", cmd_apollo},
+//                                         {NULL, NULL}};
+
+static void
+cmd_apollo(PROS_FILE *chp, int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    apolloInit();
+
+    // run until any key press
+    while (fcount(chp) == 0) {
+        apolloUpdate();
+    }
+
+    apolloDeinit();
+}
+
+static void
+cmd_queues(PROS_FILE *chp, int argc, char *argv[])
+{
+    (void)argv;
+    if (argc > 0) {
+        fprint("Usage: queues\r\n", chp);
+        return;
+    }
+    serverQueueStats_t stats = serverGetQueueStats();
+    fprintf(chp, "rx %u/%u peak %u stalls %lu\r\n", stats.rxCount, stats.rxSize, stats.rxPeak, (unsigned long)stats.rxStalls);
+    fprintf(chp, "tx %u/%u peak %u stalls %lu\r\n", stats.txCount, stats.txSize, stats.txPeak, (unsigned long)stats.txStalls);
+}
+
+static void
+cmd_capture(PROS_FILE *chp, int argc, char *argv[])
+{
+    captureStats_t stats;
+    int saved;
+    if (argc == 1 && strcasecmp(argv[0], "on") == 0) {
+        captureEnable(true);
+    } else if (argc == 1 && strcasecmp(argv[0], "off") == 0) {
+        captureEnable(false);
+    } else if (argc == 1 && strcasecmp(argv[0], "clear") == 0) {
+        captureClear();
+    } else if (argc == 1 && strcasecmp(argv[0], "dump") == 0) {
+        captureDump(chp);
+    } else if (argc == 2 && strcasecmp(argv[0], "save") == 0) {
+        saved = captureSave((uint8_t)atoi(argv[1]));
+        if (saved < 0) {
+            fprint("cannot open cassette\r\n", chp);
+        } else {
+            fprintf(chp, "saved %d octets\r\n", saved);
+        }
+    } else if (argc == 0) {
+        stats = captureGetStats();
+        fprintf(chp, "%s, %lu records, %u/%u octets, %lu overwritten\r\n", stats.enabled ? "on" : "off",
+                (unsigned long)stats.records, stats.used, stats.size, (unsigned long)stats.overwritten);
+    } else {
+        fprint("Usage: capture [on|off|clear|dump|save n]\r\n", chp);
+    }
+}
+
+static void
+cmd_latency(PROS_FILE *chp, int argc, char *argv[])
+{
+    histogramSummary_t rtt;
+    histogramSummary_t reply;
+    if (argc == 1 && strcasecmp(argv[0], "reset") == 0) {
+        serverResetLatency();
+        return;
+    }
+    if (argc > 0) {
+        fprint("Usage: latency [reset]\r\n", chp);
+        return;
+    }
+    serverGetLatency(&rtt, &reply);
+    fprint("          count      min      p50      p99      max (us)\r\n", chp);
+    fprintf(chp, "rtt   %9lu %8lu %8lu %8lu %8lu\r\n", (unsigned long)rtt.count, (unsigned long)rtt.min, (unsigned long)rtt.p50,
+            (unsigned long)rtt.p99, (unsigned long)rtt.max);
+    fprintf(chp, "reply %9lu %8lu %8lu %8lu %8lu\r\n", (unsigned long)reply.count, (unsigned long)reply.min,
+            (unsigned long)reply.p50, (unsigned long)reply.p99, (unsigned long)reply.max);
+}
+
+// configuration for the shell
+static const shellCommand_t shellCommands[] = {
+    {"apollo", cmd_apollo}, {"capture", cmd_capture}, {"latency", cmd_latency}, {"queues", cmd_queues}, {NULL, NULL}};
+static const shellConfig_t shellConfig = {stdout, shellCommands};
+
+/*
+ * Runs pre-initialization code. This function will be started in kernel mode one time while the
+ * VEX Cortex is starting up. As the scheduler is still paused, most API functions will fail.
+ *
+ * The purpose of this function is solely to set the default pin modes (pinMode()) and port
+ * states (digitalWrite()) of limit switches, push buttons, and solenoids. It can also safely
+ * configure a UART port (usartOpen()) but cannot set up an LCD (lcdInit()).
+ */
+void
+initializeIO()
+{
+    (void)standaloneModeEnable();
+    (void)watchdogInit();
+    (void)setTeamName("TopSecret");
+    (void)motorManagerInit();
+    (void)captureInit();
+    (void)serverSetup(uart2);
+    (void)serverInit();
+    (void)sensorsInit();
+    (void)reflexInit();
+    (void)trajectoryInit();
+    (void)shellInit();
+    return;
+}
+
+/*
+ * Runs user initialization code. This function will be started in its own task with the default
+ * priority and stack size once when the robot is starting up. It is possible that the VEXnet
+ * communication link may not be fully established at this time, so reading from the VEX
+ * Joystick may fail.
+ *
+ * This function should initialize most sensors (gyro, encoders, ultrasonics), LCDs, global
+ * variables, and IMEs.
+ *
+ * This function must exit relatively promptly, or the operatorControl() and autonomous() tasks
+ * will not start. An autonomous mode selection menu like the pre_auton() in other environments
+ * can be implemented in this task if desired.
+ */
+void
+initialize()
+{
+    (void)lcdInit(uart1);
+    (void)lcdSetBacklight(uart1, true);
+    (void)lcdSetText(uart1, 1, "PROS V2.12.0    ");
+    (void)lcdSetText(uart1, 2, "VEX CORTEX LCD1 ");
+    (void)sensorsStart();
+    (void)reflexStart();
+    (void)trajectoryStart();
+    (void)serverStart();
+    (void)shellStart(&shellConfig);
+    return;
+}
@@ -4,11 +4,15 @@
 #include "messages.h"
 #include "portable_endian.h"
 
+#include <stddef.h>
+
 void
 message_ping_frame(message_ping_t *message, uint8_t seq_id)
 {
     message->op = MESSAGES_OP_PING;
     message->seq_id = seq_id;
+    message->timed = 0;
+    message->timestamp = 0;
 }
 
 void
@@ -16,6 +20,30 @@ message_pong_frame(message_pong_t *message, uint8_t seq_id)
 {
     message->op = MESSAGES_OP_PONG;
     message->seq_id = seq_id;
+    message->timed = 0;
+    message->origin = 0;
+    message->receive = 0;
+    message->transmit = 0;
+}
+
+void
+message_ping_timed_frame(message_ping_t *message, uint8_t seq_id, uint32_t timestamp)
+{
+    message->op = MESSAGES_OP_PING;
+    message->seq_id = seq_id;
+    message->timed = 1;
+    message->timestamp = timestamp;
+}
+
+void
+message_pong_timed_frame(message_pong_t *message, uint8_t seq_id, uint32_t origin, uint32_t receive, uint32_t transmit)
+{
+    message->op = MESSAGES_OP_PONG;
+    message->seq_id = seq_id;
+    message->timed = 1;
+    message->origin = origin;
+    message->receive = receive;
+    message->transmit = transmit;
 }
 
 void
@@ -42,6 +70,29 @@ message_data_frame(message_data_t *message, uint16_t req_id, uint8_t topic, uint
     message->value = value;
 }
 
+void
+message_data_compact_frame(message_data_compact_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag,
+                           uint32_t delta, uint8_t len, uint8_t *value)
+{
+    message->op = MESSAGES_OP_DATA_COMPACT;
+    message->flag = flag & MESSAGES_DATA_COMPACT_FLAGS;
+    message->req_id = req_id;
+    message->topic = topic;
+    message->subtopic = subtopic;
+    message->delta = delta;
+    message->len = len;
+    message->value = value;
+}
+
+void
+message_data_multi_frame(message_data_multi_t *message, uint32_t timestamp, uint8_t len, uint8_t *value)
+{
+    message->op = MESSAGES_OP_DATA_MULTI;
+    message->timestamp = timestamp;
+    message->len = len;
+    message->value = value;
+}
+
 void
 message_read_frame(message_read_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic)
 {
@@ -51,6 +102,15 @@ message_read_frame(message_read_t *message, uint16_t req_id, uint8_t topic, uint
     message->subtopic = subtopic;
 }
 
+void
+message_read_multi_frame(message_read_multi_t *message, uint16_t req_id, uint8_t count, uint8_t *pairs)
+{
+    message->op = MESSAGES_OP_READ_MULTI;
+    message->req_id = req_id;
+    message->count = count;
+    message->pairs = pairs;
+}
+
 void
 message_write_frame(message_write_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t len, uint8_t *value)
 {
@@ -69,6 +129,40 @@ message_subscribe_frame(message_subscribe_t *message, uint16_t req_id, uint8_t t
     message->req_id = req_id;
     message->topic = topic;
     message->subtopic = subtopic;
+    message->period = 0;
+    message->options = 0;
+    message->deadband = 0;
+    message->min_interval = 0;
+    message->max_interval = 0;
+}
+
+void
+message_subscribe_period_frame(message_subscribe_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint16_t period)
+{
+    message->op = MESSAGES_OP_SUBSCRIBE;
+    message->req_id = req_id;
+    message->topic = topic;
+    message->subtopic = subtopic;
+    message->period = period;
+    message->options = 0;
+    message->deadband = 0;
+    message->min_interval = 0;
+    message->max_interval = 0;
+}
+
+void
+message_subscribe_options_frame(message_subscribe_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint16_t period,
+                                uint16_t deadband, uint16_t min_interval, uint16_t max_interval)
+{
+    message->op = MESSAGES_OP_SUBSCRIBE;
+    message->req_id = req_id;
+    message->topic = topic;
+    message->subtopic = subtopic;
+    message->period = period;
+    message->options = MESSAGES_SUBSCRIBE_OPTIONS;
+    message->deadband = deadband;
+    message->min_interval = min_interval;
+    message->max_interval = max_interval;
 }
 
 void
@@ -78,122 +172,323 @@ message_unsubscribe_frame(message_unsubscribe_t *message, uint16_t req_id)
     message->req_id = req_id;
 }
 
+void
+message_data_long_frame(message_data_long_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag,
+                        uint32_t timestamp, uint16_t len, uint8_t *value)
+{
+    message->op = MESSAGES_OP_DATA_LONG;
+    message->req_id = req_id;
+    message->topic = topic;
+    message->subtopic = subtopic;
+    message->flag = flag;
+    message->timestamp = timestamp;
+    message->len = len;
+    message->value = value;
+}
+
+void
+message_write_long_frame(message_write_long_t *message, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint16_t len,
+                         uint8_t *value)
+{
+    message->op = MESSAGES_OP_WRITE_LONG;
+    message->req_id = req_id;
+    message->topic = topic;
+    message->subtopic = subtopic;
+    message->len = len;
+    message->value = value;
+}
+
+void
+message_fragment_frame(message_fragment_t *message, uint16_t total, uint16_t offset, uint8_t len, uint8_t *value)
+{
+    message->op = MESSAGES_OP_FRAGMENT;
+    message->total = total;
+    message->offset = offset;
+    message->len = len;
+    message->value = value;
+}
+
+void
+message_batch_frame(message_batch_t *message, uint8_t len, uint8_t *value)
+{
+    message->op = MESSAGES_OP_BATCH;
+    message->len = len;
+    message->value = value;
+}
+
+/* Big-endian field access, named after the field type for the schema. */
+static inline void
+message_put_uint8_t(uint8_t *buf, uint8_t value)
+{
+    buf[0] = value;
+}
+
+static inline void
+message_put_uint16_t(uint8_t *buf, uint16_t value)
+{
+    value = (uint16_t)(htons(value));
+    (void)memcpy(buf, &value, 2);
+}
+
+static inline void
+message_put_uint32_t(uint8_t *buf, uint32_t value)
+{
+    value = (uint32_t)(htonl(value));
+    (void)memcpy(buf, &value, 4);
+}
+
+static inline uint8_t
+message_get_uint8_t(const uint8_t *buf)
+{
+    return buf[0];
+}
+
+static inline uint16_t
+message_get_uint16_t(const uint8_t *buf)
+{
+    uint16_t value;
+    (void)memcpy(&value, buf, 2);
+    return (uint16_t)(ntohs(value));
+}
+
+static inline uint32_t
+message_get_uint32_t(const uint8_t *buf)
+{
+    uint32_t value;
+    (void)memcpy(&value, buf, 4);
+    return (uint32_t)(ntohl(value));
+}
+
+/* The wire layout of an op as octet arrays, so that offsetof() gives every offset at compile time.  The head holds the
+ * fields that are always present and the wire every field, trailing octets start at the end of either. */
+#define MESSAGES_WIRE_F(type, name) uint8_t name[sizeof(type)];
+#define MESSAGES_WIRE_O(type, name, present, last) uint8_t name[sizeof(type)];
+#define MESSAGES_WIRE_NONE(...)
+#define MESSAGES_WIRE(OP, member, name)                                                                                            \
+    struct message_##name##_head_s {                                                                                               \
+        uint8_t op[1];                                                                                                             \
+        MESSAGES_SCHEMA_##OP(MESSAGES_WIRE_F, MESSAGES_WIRE_NONE, MESSAGES_WIRE_NONE, MESSAGES_WIRE_NONE, MESSAGES_WIRE_NONE)      \
+    };                                                                                                                             \
+    struct message_##name##_wire_s {                                                                                               \
+        uint8_t op[1];                                                                                                             \
+        MESSAGES_SCHEMA_##OP(MESSAGES_WIRE_F, MESSAGES_WIRE_O, MESSAGES_WIRE_NONE, MESSAGES_WIRE_NONE, MESSAGES_WIRE_NONE)         \
+    };
+
+MESSAGES_SCHEMA(MESSAGES_WIRE)
+
+#define MESSAGES_AT(name) offsetof(wire_t, name)
+#define MESSAGES_END(name) (offsetof(wire_t, name) + sizeof(((wire_t *)0)->name))
+
+#define MESSAGES_SIZEOF_O(type, name, present, last)                                                                               \
+    if (present) {                                                                                                                 \
+        mlen = MESSAGES_END(last);                                                                                                 \
+    }
+#define MESSAGES_SIZEOF_B(name, count) mlen += (count);
+#define MESSAGES_SIZEOF_R(len, name) mlen += m->len;
+
+#define MESSAGES_ENCODE_F(type, name) message_put_##type(buf + MESSAGES_AT(name), m->name);
+#define MESSAGES_ENCODE_O(type, name, present, last)                                                                               \
+    if (present) {                                                                                                                 \
+        message_put_##type(buf + MESSAGES_AT(name), m->name);                                                                      \
+    }
+#define MESSAGES_ENCODE_B(name, count) (void)memcpy(buf + sizeof(wire_t), m->name, (count));
+#define MESSAGES_ENCODE_R(len, name) (void)memcpy(buf + sizeof(wire_t), m->name, m->len);
+
+#define MESSAGES_TRAIL_B(name, count) trail = (count);
+#define MESSAGES_TRAIL_R(len, name) trail = m->len;
+
+#define MESSAGES_DECODE_F(type, name) m->name = message_get_##type(buf + MESSAGES_AT(name));
+#define MESSAGES_DECODE_O(type, name, present, last)                                                                               \
+    m->name = (len >= MESSAGES_END(last)) ? message_get_##type(buf + MESSAGES_AT(name)) : 0;
+#define MESSAGES_DECODE_P(name, value, last) m->name = (len >= MESSAGES_END(last)) ? (value) : 0;
+#define MESSAGES_DECODE_B(name, count)                                                                                             \
+    if (len - sizeof(wire_t) < (count)) {                                                                                          \
+        return -1;                                                                                                                 \
+    }                                                                                                                              \
+    m->name = (uint8_t *)(buf + sizeof(wire_t));
+#define MESSAGES_DECODE_R(len_, name)                                                                                              \
+    if (len - sizeof(wire_t) > 0xff) {                                                                                             \
+        return -1;                                                                                                                 \
+    }                                                                                                                              \
+    m->len_ = (uint8_t)(len - sizeof(wire_t));                                                                                     \
+    m->name = (uint8_t *)(buf + sizeof(wire_t));
+
+/* One sizeof, encode and decode per op, each straight-line code over constant offsets. */
+#define MESSAGES_CODEC(OP, member, name)                                                                                           \
+    static inline size_t message_##name##_sizeof(const message_##name##_t *m)                                                      \
+    {                                                                                                                              \
+        typedef struct message_##name##_wire_s wire_t;                                                                             \
+        size_t mlen = sizeof(struct message_##name##_head_s);                                                                      \
+        (void)m;                                                                                                                   \
+        (void)sizeof(wire_t);                                                                                                      \
+        MESSAGES_SCHEMA_##OP(MESSAGES_WIRE_NONE, MESSAGES_SIZEOF_O, MESSAGES_WIRE_NONE, MESSAGES_SIZEOF_B, MESSAGES_SIZEOF_R)      \
+        return mlen;                                                                                                               \
+    }                                                                                                                              \
+    static inline void message_##name##_encode(const message_##name##_t *m, uint8_t *buf)                                          \
+    {                                                                                                                              \
+        typedef struct message_##name##_wire_s wire_t;                                                                             \
+        buf[0] = m->op;                                                                                                            \
+        MESSAGES_SCHEMA_##OP(MESSAGES_ENCODE_F, MESSAGES_ENCODE_O, MESSAGES_WIRE_NONE, MESSAGES_ENCODE_B, MESSAGES_ENCODE_R)       \
+    }                                                                                                                              \
+    static inline int message_##name##_decode(message_##name##_t *m, const uint8_t *buf, size_t len)                               \
+    {                                                                                                                              \
+        typedef struct message_##name##_wire_s wire_t;                                                                             \
+        if (len < sizeof(struct message_##name##_head_s)) {                                                                        \
+            return -1;                                                                                                             \
+        }                                                                                                                          \
+        m->op = buf[0];                                                                                                            \
+        MESSAGES_SCHEMA_##OP(MESSAGES_DECODE_F, MESSAGES_DECODE_O, MESSAGES_DECODE_P, MESSAGES_DECODE_B, MESSAGES_DECODE_R)        \
+        return 0;                                                                                                                  \
+    }                                                                                                                              \
+    /* everything but the trailing octets, returns where they would start */                                                       \
+    static inline size_t message_##name##_encode_head(const message_##name##_t *m, uint8_t *buf)                                   \
+    {                                                                                                                              \
+        typedef struct message_##name##_wire_s wire_t;                                                                             \
+        size_t trail = 0;                                                                                                          \
+        (void)sizeof(wire_t);                                                                                                      \
+        buf[0] = m->op;                                                                                                            \
+        MESSAGES_SCHEMA_##OP(MESSAGES_ENCODE_F, MESSAGES_ENCODE_O, MESSAGES_WIRE_NONE, MESSAGES_TRAIL_B, MESSAGES_TRAIL_R)         \
+        return message_##name##_sizeof(m) - trail;                                                                                 \
+    }
+
+MESSAGES_SCHEMA(MESSAGES_CODEC)
+
+static inline size_t
+message_varint_sizeof(uint32_t value)
+{
+    size_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline size_t
+message_put_varint(uint8_t *buf, uint32_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (uint8_t)value;
+    return n;
+}
+
+/* Returns the octets taken, or 0 if the varint is truncated or does not fit in max. */
+static inline size_t
+message_get_varint(const uint8_t *buf, size_t len, uint32_t max, uint32_t *value)
+{
+    uint32_t v = 0;
+    size_t n;
+    for (n = 0; n < len && n < 5; n++) {
+        v |= (uint32_t)(buf[n] & 0x7f) << (7 * n);
+        if (!(buf[n] & 0x80)) {
+            if (v > max || (n == 4 && buf[n] > 0x0f)) {
+                return 0;
+            }
+            *value = v;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static inline size_t
+message_data_compact_sizeof(const message_data_compact_t *m)
+{
+    return 3 + message_varint_sizeof(m->req_id) + message_varint_sizeof(m->delta) + message_varint_sizeof(m->len) + m->len;
+}
+
+static inline void
+message_data_compact_encode(const message_data_compact_t *m, uint8_t *buf)
+{
+    size_t n = 0;
+    buf[n++] = (uint8_t)(m->op | (m->flag & MESSAGES_DATA_COMPACT_FLAGS));
+    n += message_put_varint(buf + n, m->req_id);
+    buf[n++] = m->topic;
+    buf[n++] = m->subtopic;
+    n += message_put_varint(buf + n, m->delta);
+    n += message_put_varint(buf + n, m->len);
+    (void)memcpy(buf + n, m->value, m->len);
+}
+
+static inline int
+message_data_compact_decode(message_data_compact_t *m, const uint8_t *buf, size_t len)
+{
+    size_t n = 1;
+    size_t vn;
+    uint32_t value;
+    m->op = (uint8_t)(buf[0] & ~MESSAGES_DATA_COMPACT_FLAGS);
+    m->flag = (uint8_t)(buf[0] & MESSAGES_DATA_COMPACT_FLAGS);
+    if ((vn = message_get_varint(buf + n, len - n, 0xffff, &value)) == 0) {
+        return -1;
+    }
+    m->req_id = (uint16_t)value;
+    n += vn;
+    if (len - n < 2) {
+        return -1;
+    }
+    m->topic = buf[n++];
+    m->subtopic = buf[n++];
+    if ((vn = message_get_varint(buf + n, len - n, 0xffffffff, &m->delta)) == 0) {
+        return -1;
+    }
+    n += vn;
+    if ((vn = message_get_varint(buf + n, len - n, 0xff, &value)) == 0) {
+        return -1;
+    }
+    n += vn;
+    if (len - n < value) {
+        return -1;
+    }
+    m->len = (uint8_t)value;
+    m->value = (uint8_t *)(buf + n);
+    return 0;
+}
+
+#define MESSAGES_CASE_SIZEOF(OP, member, name)                                                                                     \
+    case MESSAGES_OP_##OP:                                                                                                         \
+        return message_##name##_sizeof(&m->member);
+#define MESSAGES_CASE_ENCODE(OP, member, name)                                                                                     \
+    case MESSAGES_OP_##OP:                                                                                                         \
+        message_##name##_encode(&m->member, buf);                                                                                  \
+        break;
+#define MESSAGES_CASE_ENCODE_HEAD(OP, member, name)                                                                                \
+    case MESSAGES_OP_##OP:                                                                                                         \
+        if (len < sizeof(struct message_##name##_wire_s)) {                                                                        \
+            return -1;                                                                                                             \
+        }                                                                                                                          \
+        mlen = message_##name##_encode_head(&m->member, buf);                                                                      \
+        break;
+#define MESSAGES_CASE_DECODE(OP, member, name)                                                                                     \
+    case MESSAGES_OP_##OP:                                                                                                         \
+        return message_##name##_decode(&m->member, buf, len);
+
 size_t
 message_getsizeof(const message_any_t *m)
 {
-    size_t mlen = 1; // message_t.op
     switch (m->message.op) {
-    case MESSAGES_OP_PING:
-        mlen += 1; // message_ping_t.seq_id
-        break;
-    case MESSAGES_OP_PONG:
-        mlen += 1; // message_pong_t.seq_id
-        break;
-    case MESSAGES_OP_INFO:
-        mlen += 1; // message_info_t.topic
-        mlen += 1; // message_info_t.subtopic
-        mlen += 1; // message_info_t.len
-        mlen += m->info.len;
-        break;
-    case MESSAGES_OP_DATA:
-        mlen += 2; // message_req_t.req_id
-        mlen += 1; // message_data_t.topic
-        mlen += 1; // message_data_t.subtopic
-        mlen += 1; // message_data_t.flag
-        mlen += 4; // message_data_t.timestamp
-        mlen += 1; // message_data_t.len
-        mlen += m->data.len;
-        break;
-    case MESSAGES_OP_READ:
-        mlen += 2; // message_req_t.req_id
-        mlen += 1; // message_read_t.topic
-        mlen += 1; // message_read_t.subtopic
-        break;
-    case MESSAGES_OP_WRITE:
-        mlen += 2; // message_req_t.req_id
-        mlen += 1; // message_write_t.topic
-        mlen += 1; // message_write_t.subtopic
-        mlen += 1; // message_write_t.len
-        mlen += m->write.len;
-        break;
-    case MESSAGES_OP_SUBSCRIBE:
-        mlen += 2; // message_req_t.req_id
-        mlen += 1; // message_subscribe_t.topic
-        mlen += 1; // message_subscribe_t.subtopic
-        break;
-    case MESSAGES_OP_UNSUBSCRIBE:
-        mlen += 2; // message_req_t.req_id
-        break;
+        MESSAGES_SCHEMA(MESSAGES_CASE_SIZEOF)
+    case MESSAGES_OP_DATA_COMPACT:
+        return message_data_compact_sizeof(&m->compact);
     default:
         return 0;
     }
-    return mlen;
 }
 
 int
 message_serialize(const message_any_t *m, uint8_t *buf, size_t len, size_t *outlen)
 {
     size_t mlen = message_getsizeof(m);
-    uint16_t req_id;
-    uint32_t timestamp;
     if (mlen == 0 || mlen > len) {
         return -1;
     }
     switch (m->message.op) {
-    case MESSAGES_OP_PING:
-        buf[0] = m->ping.op;
-        buf[1] = m->ping.seq_id;
-        break;
-    case MESSAGES_OP_PONG:
-        buf[0] = m->pong.op;
-        buf[1] = m->pong.seq_id;
-        break;
-    case MESSAGES_OP_INFO:
-        buf[0] = m->info.op;
-        buf[1] = m->info.topic;
-        buf[2] = m->info.subtopic;
-        buf[3] = m->info.len;
-        (void)memcpy(buf + 4, m->info.value, m->info.len);
-        break;
-    case MESSAGES_OP_DATA:
-        buf[0] = m->data.op;
-        req_id = (uint16_t)(htons(m->data.req_id));
-        (void)memcpy(buf + 1, &req_id, 2);
-        buf[3] = m->data.topic;
-        buf[4] = m->data.subtopic;
-        buf[5] = m->data.flag;
-        timestamp = (uint32_t)(htonl(m->data.timestamp));
-        (void)memcpy(buf + 6, &timestamp, 4);
-        buf[10] = m->data.len;
-        (void)memcpy(buf + 11, m->data.value, m->data.len);
-        break;
-    case MESSAGES_OP_READ:
-        buf[0] = m->read.op;
-        req_id = (uint16_t)(htons(m->read.req_id));
-        (void)memcpy(buf + 1, &req_id, 2);
-        buf[3] = m->read.topic;
-        buf[4] = m->read.subtopic;
-        break;
-    case MESSAGES_OP_WRITE:
-        buf[0] = m->write.op;
-        req_id = (uint16_t)(htons(m->write.req_id));
-        (void)memcpy(buf + 1, &req_id, 2);
-        buf[3] = m->write.topic;
-        buf[4] = m->write.subtopic;
-        buf[5] = m->write.len;
-        (void)memcpy(buf + 6, m->write.value, m->write.len);
-        break;
-    case MESSAGES_OP_SUBSCRIBE:
-        buf[0] = m->subscribe.op;
-        req_id = (uint16_t)(htons(m->subscribe.req_id));
-        (void)memcpy(buf + 1, &req_id, 2);
-        buf[3] = m->subscribe.topic;
-        buf[4] = m->subscribe.subtopic;
-        break;
-    case MESSAGES_OP_UNSUBSCRIBE:
-        buf[0] = m->unsubscribe.op;
-        req_id = (uint16_t)(htons(m->unsubscribe.req_id));
-        (void)memcpy(buf + 1, &req_id, 2);
+        MESSAGES_SCHEMA(MESSAGES_CASE_ENCODE)
+    case MESSAGES_OP_DATA_COMPACT:
+        message_data_compact_encode(&m->compact, buf);
         break;
     default:
         return -1;
@@ -207,103 +502,140 @@ message_serialize(const message_any_t *m, uint8_t *buf, size_t len, size_t *outl
 int
 message_deserialize(message_any_t *m, const uint8_t *buf, size_t len)
 {
-    uint16_t req_id;
-    uint32_t timestamp;
-    uint8_t vlen;
     if (len < 2) {
         return -1;
     }
+    if ((buf[0] & ~MESSAGES_DATA_COMPACT_FLAGS) == MESSAGES_OP_DATA_COMPACT) {
+        return message_data_compact_decode(&m->compact, buf, len);
+    }
     switch (buf[0]) {
-    case MESSAGES_OP_PING:
-        m->ping.op = buf[0];
-        m->ping.seq_id = buf[1];
-        break;
-    case MESSAGES_OP_PONG:
-        m->pong.op = buf[0];
-        m->pong.seq_id = buf[1];
-        break;
-    case MESSAGES_OP_INFO:
-        if (len < 4) {
-            return -1;
-        }
-        vlen = buf[3];
-        vlen += 4;
-        if (len < vlen) {
-            return -1;
-        }
-        m->info.op = buf[0];
-        m->info.topic = buf[1];
-        m->info.subtopic = buf[2];
-        m->info.len = buf[3];
-        m->info.value = (uint8_t *)(buf + 4);
-        break;
-    case MESSAGES_OP_DATA:
-        if (len < 11) {
-            return -1;
-        }
-        vlen = buf[10];
-        vlen += 11;
-        if (len < vlen) {
-            return -1;
-        }
-        m->data.op = buf[0];
-        (void)memcpy(&req_id, buf + 1, 2);
-        m->data.req_id = (uint16_t)(ntohs(req_id));
-        m->data.topic = buf[3];
-        m->data.subtopic = buf[4];
-        m->data.flag = buf[5];
-        (void)memcpy(&timestamp, buf + 6, 4);
-        m->data.timestamp = (uint32_t)(ntohl(timestamp));
-        m->data.len = buf[10];
-        m->data.value = (uint8_t *)(buf + 11);
-        break;
-    case MESSAGES_OP_READ:
-        if (len < 5) {
-            return -1;
-        }
-        m->read.op = buf[0];
-        (void)memcpy(&req_id, buf + 1, 2);
-        m->read.req_id = (uint16_t)(ntohs(req_id));
-        m->read.topic = buf[3];
-        m->read.subtopic = buf[4];
-        break;
-    case MESSAGES_OP_WRITE:
-        if (len < 6) {
-            return -1;
-        }
-        vlen = buf[5];
-        vlen += 6;
-        if (len < vlen) {
-            return -1;
-        }
-        m->write.op = buf[0];
-        (void)memcpy(&req_id, buf + 1, 2);
-        m->write.req_id = (uint16_t)(ntohs(req_id));
-        m->write.topic = buf[3];
-        m->write.subtopic = buf[4];
-        m->write.len = buf[5];
-        m->write.value = (uint8_t *)(buf + 6);
-        break;
-    case MESSAGES_OP_SUBSCRIBE:
-        if (len < 5) {
-            return -1;
-        }
-        m->subscribe.op = buf[0];
-        (void)memcpy(&req_id, buf + 1, 2);
-        m->subscribe.req_id = (uint16_t)(ntohs(req_id));
-        m->subscribe.topic = buf[3];
-        m->subscribe.subtopic = buf[4];
-        break;
-    case MESSAGES_OP_UNSUBSCRIBE:
-        if (len < 3) {
-            return -1;
-        }
-        m->unsubscribe.op = buf[0];
-        (void)memcpy(&req_id, buf + 1, 2);
-        m->unsubscribe.req_id = (uint16_t)(ntohs(req_id));
-        break;
+        MESSAGES_SCHEMA(MESSAGES_CASE_DECODE)
+    default:
+        return -1;
+    }
+}
+
+/* Append one record to the records of a DATA_MULTI, returns the new offset or 0 if it does not fit. */
+size_t
+message_record_append(uint8_t *buf, size_t len, size_t offset, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag,
+                      uint8_t vlen, const uint8_t *value)
+{
+    if (offset + MESSAGES_DATA_MULTI_RECORD + vlen > len) {
+        return 0;
+    }
+    req_id = (uint16_t)(htons(req_id));
+    (void)memcpy(buf + offset, &req_id, 2);
+    buf[offset + 2] = topic;
+    buf[offset + 3] = subtopic;
+    buf[offset + 4] = flag;
+    buf[offset + 5] = vlen;
+    (void)memcpy(buf + offset + MESSAGES_DATA_MULTI_RECORD, value, vlen);
+    return offset + MESSAGES_DATA_MULTI_RECORD + vlen;
+}
+
+/* Decode the record at *offset in place and advance past it, returns 1 for a record, 0 at the end, -1 if truncated. */
+int
+message_record_next(const message_data_multi_t *multi, size_t *offset, message_record_t *record)
+{
+    const uint8_t *buf = multi->value + *offset;
+    size_t remaining = (size_t)multi->len - *offset;
+    uint16_t req_id;
+    if (*offset >= multi->len) {
+        return 0;
+    }
+    if (remaining < MESSAGES_DATA_MULTI_RECORD || remaining - MESSAGES_DATA_MULTI_RECORD < buf[5]) {
+        return -1;
+    }
+    (void)memcpy(&req_id, buf, 2);
+    record->req_id = (uint16_t)(ntohs(req_id));
+    record->topic = buf[2];
+    record->subtopic = buf[3];
+    record->flag = buf[4];
+    record->len = buf[5];
+    record->value = (uint8_t *)(buf + MESSAGES_DATA_MULTI_RECORD);
+    *offset += MESSAGES_DATA_MULTI_RECORD + record->len;
+    return 1;
+}
+
+/* Serialize all of m but its trailing octets, so that a sender can follow the head with octets it has not read yet.  *outlen
+ * is where the trailing octets start, buf only has to hold the head. */
+int
+message_serialize_head(const message_any_t *m, uint8_t *buf, size_t len, size_t *outlen)
+{
+    size_t mlen;
+    switch (m->message.op) {
+        MESSAGES_SCHEMA(MESSAGES_CASE_ENCODE_HEAD)
     default:
         return -1;
     }
+    if (outlen) {
+        *outlen = mlen;
+    }
     return 0;
 }
+
+/* Start putting messages back together in buf, size octets long. */
+void
+message_reassembly_init(message_reassembly_t *r, uint8_t *buf, size_t size)
+{
+    r->buf = buf;
+    r->size = size;
+    r->total = 0;
+    r->len = 0;
+}
+
+/* Take one FRAGMENT, returns 1 once the message in r->buf is complete (r->len octets), 0 while it is not and -1 if the
+ * fragment was dropped as out of order or too long for buf. */
+int
+message_reassemble(message_reassembly_t *r, const message_fragment_t *fragment)
+{
+    if (fragment->offset == 0) {
+        r->total = fragment->total;
+        r->len = 0;
+    } else if (r->total == 0 || fragment->total != r->total || fragment->offset != r->len) {
+        r->total = 0;
+        return -1;
+    }
+    if (r->total == 0 || r->total > r->size || fragment->len > r->total - r->len) {
+        r->total = 0;
+        return -1;
+    }
+    (void)memcpy(r->buf + r->len, fragment->value, fragment->len);
+    r->len += fragment->len;
+    if (r->len < r->total) {
+        return 0;
+    }
+    // the next fragment has to start another message
+    r->total = 0;
+    return 1;
+}
+
+/* Append m to the messages of a BATCH, returns the new offset or 0 if it does not fit. */
+size_t
+message_batch_append(uint8_t *buf, size_t len, size_t offset, const message_any_t *m)
+{
+    size_t mlen;
+    if (offset + 1 >= len || message_serialize(m, buf + offset + 1, len - offset - 1, &mlen) != 0 || mlen > 0xff) {
+        return 0;
+    }
+    buf[offset] = (uint8_t)mlen;
+    return offset + 1 + mlen;
+}
+
+/* Decode the message at *offset in place and advance past it, returns 1 for a message, 0 at the end and -1 for one that
+ * does not decode, which is skipped.  A truncated BATCH ends at the truncation. */
+int
+message_batch_next(const message_batch_t *batch, size_t *offset, message_any_t *m)
+{
+    size_t mlen;
+    if (*offset >= batch->len) {
+        return 0;
+    }
+    mlen = batch->value[*offset];
+    if (mlen > (size_t)batch->len - *offset - 1) {
+        *offset = batch->len;
+        return -1;
+    }
+    *offset += 1 + mlen;
+    return (message_deserialize(m, batch->value + *offset - mlen, mlen) == 0) ? 1 : -1;
+}
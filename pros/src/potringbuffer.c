@@ -85,12 +85,28 @@ potRingbufferBack(PotRingbuffer *p)
 /* Append an element to the back. */
 void
 potRingbufferPushBack(PotRingbuffer *p, const SFPpacket *elem)
+{
+    SFPpacket *back = potRingbufferReserveBack(p);
+    memcpy(back->buf, elem->buf, elem->len);
+    back->len = elem->len;
+    potRingbufferCommitBack(p);
+}
+
+/* Make room at the back and return the element there, to be filled in place. */
+SFPpacket *
+potRingbufferReserveBack(PotRingbuffer *p)
 {
     if (potRingbufferFull(p)) {
         potRingbufferIncr(p, &(p->mBegin));
     }
+    return potRingbufferWrappedAccess(p, p->mEnd);
+}
+
+/* Append the element returned by potRingbufferReserveBack(). */
+void
+potRingbufferCommitBack(PotRingbuffer *p)
+{
     potRingbufferIncr(p, &(p->mEnd));
-    memcpy(potRingbufferBack(p), elem, sizeof(SFPpacket));
 }
 
 /* Prepend an element to the front. */
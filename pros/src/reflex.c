@@ -0,0 +1,280 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*-----------------------------------------------------------------------------*/
+/** @file    reflex.c                                                          */
+/** @brief   Sensor to motor rules evaluated on the robot, set up over rpc     */
+/*-----------------------------------------------------------------------------*/
+
+#include "reflex.h"
+#include "mtrmgr.h"
+#include "portable_endian.h"
+#include "rpc.h"
+#include "sensors.h"
+
+#include <string.h>
+
+typedef struct reflexRule_s {
+    bool active;
+    bool armed;
+    bool met;
+    uint8_t topic;
+    uint8_t subtopic;
+    uint8_t comparator;
+    uint8_t flags;
+    uint8_t motor;
+    int8_t speed;
+    int32_t threshold;
+    uint32_t fired;
+    uint32_t stamp;
+    int32_t value;
+} reflexRule_t;
+
+typedef struct reflex_s {
+    TaskHandle task;
+    Mutex lock;
+    reflexRule_t rules[REFLEX_MAX];
+} reflex_t;
+
+static reflex_t reflex;
+
+static int reflexRead(rpc_t *rpc, const message_read_t *read);
+static int reflexWrite(rpc_t *rpc, const message_write_t *write);
+static int reflexPublish(rpc_t *rpc, rpcSubscription_t *sub);
+
+static const rpcTopic_t reflexTopic = {
+    .topic = MESSAGES_TOPIC_REFLEX,
+    .flags = RPC_TOPIC_FLAG_CHANGES,
+    .count = REFLEX_MAX,
+    .all = MESSAGES_TOPIC_REFLEX_SUBTOPIC_ALL,
+    .read = reflexRead,
+    .write = reflexWrite,
+    .publish = reflexPublish,
+};
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Register the reflex topic with rpc.                            */
+/*-----------------------------------------------------------------------------*/
+void
+reflexInit(void)
+{
+    reflex.lock = mutexCreate();
+    (void)rpcTopicRegister(&reflexTopic);
+}
+
+static bool
+reflexCompare(uint8_t comparator, int32_t value, int32_t threshold)
+{
+    switch (comparator) {
+    case MESSAGES_REFLEX_LT:
+        return value < threshold;
+    case MESSAGES_REFLEX_LE:
+        return value <= threshold;
+    case MESSAGES_REFLEX_GT:
+        return value > threshold;
+    case MESSAGES_REFLEX_GE:
+        return value >= threshold;
+    case MESSAGES_REFLEX_EQ:
+        return value == threshold;
+    case MESSAGES_REFLEX_NE:
+        return value != threshold;
+    default:
+        return false;
+    }
+}
+
+/* Returns true if the rule's motor should be set this period. */
+static bool
+reflexEvaluate(reflexRule_t *rule, const sensorsSnapshot_t *snapshot)
+{
+    int32_t value;
+    bool met;
+    bool act;
+    if (!rule->active || !rule->armed || !sensorsValue(snapshot, rule->topic, rule->subtopic, &value)) {
+        return false;
+    }
+    met = reflexCompare(rule->comparator, value, rule->threshold);
+    act = met && (!rule->met || (rule->flags & MESSAGES_REFLEX_FLAG_HOLD));
+    if (met && !rule->met) {
+        rule->fired++;
+        rule->stamp = snapshot->stamp;
+        rule->value = value;
+        if (rule->flags & MESSAGES_REFLEX_FLAG_ONCE) {
+            rule->armed = false;
+        }
+    }
+    rule->met = met;
+    return act;
+}
+
+static void
+reflexTask(void *ignore)
+{
+    (void)ignore;
+    unsigned long wake = millis();
+    sensorsSnapshot_t snapshot;
+    uint8_t motor[REFLEX_MAX];
+    int8_t speed[REFLEX_MAX];
+    uint8_t n;
+    uint8_t i;
+    for (;;) {
+        (void)sensorsSnapshot(&snapshot);
+        n = 0;
+        (void)mutexTake(reflex.lock, -1);
+        for (i = 0; i < REFLEX_MAX; i++) {
+            if (reflexEvaluate(&reflex.rules[i], &snapshot)) {
+                motor[n] = reflex.rules[i].motor;
+                speed[n] = reflex.rules[i].speed;
+                n++;
+            }
+        }
+        (void)mutexGive(reflex.lock);
+        // outside the lock, the motor manager may make us wait for its mutex
+        for (i = 0; i < n; i++) {
+            (void)blrsMotorSet(motor[i], speed[i], true);
+        }
+        (void)taskDelayUntil(&wake, REFLEX_PERIOD);
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Start evaluating rules, call after sensorsStart().             */
+/*-----------------------------------------------------------------------------*/
+void
+reflexStart(void)
+{
+    if (reflex.task != NULL) {
+        return;
+    }
+    reflex.task = taskCreate(reflexTask, TASK_DEFAULT_STACK_SIZE, NULL, TASK_PRIORITY_HIGHEST - 1);
+}
+
+static uint8_t
+reflexEncodeRule(const reflexRule_t *rule, uint8_t *buf)
+{
+    uint32_t value32;
+    buf[0] = rule->topic;
+    buf[1] = rule->subtopic;
+    buf[2] = rule->comparator;
+    buf[3] = rule->flags;
+    value32 = (uint32_t)(htonl((uint32_t)rule->threshold));
+    (void)memcpy(buf + 4, &value32, 4);
+    buf[8] = rule->motor;
+    buf[9] = (uint8_t)rule->speed;
+    return REFLEX_RULE_SIZE;
+}
+
+/* fired (4) | stamp (4) | value (4), the latest firing */
+static uint8_t
+reflexEncodeFiring(const reflexRule_t *rule, uint8_t *buf)
+{
+    uint32_t value32;
+    value32 = (uint32_t)(htonl(rule->fired));
+    (void)memcpy(buf, &value32, 4);
+    value32 = (uint32_t)(htonl(rule->stamp));
+    (void)memcpy(buf + 4, &value32, 4);
+    value32 = (uint32_t)(htonl((uint32_t)rule->value));
+    (void)memcpy(buf + 8, &value32, 4);
+    return 12;
+}
+
+/* A single rule reads as the rule followed by its latest firing, ALL as
+ * index | rule | firing for every active rule. */
+static int
+reflexRead(rpc_t *rpc, const message_read_t *read)
+{
+    uint8_t *tbuf = (void *)rpc->tmp;
+    uint8_t tlen = 0;
+    uint8_t i;
+    if (read->subtopic >= REFLEX_MAX && read->subtopic != MESSAGES_TOPIC_REFLEX_SUBTOPIC_ALL) {
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
+    }
+    (void)mutexTake(reflex.lock, -1);
+    for (i = 0; i < REFLEX_MAX; i++) {
+        if (!reflex.rules[i].active || (read->subtopic != MESSAGES_TOPIC_REFLEX_SUBTOPIC_ALL && read->subtopic != i)) {
+            continue;
+        }
+        if (read->subtopic == MESSAGES_TOPIC_REFLEX_SUBTOPIC_ALL) {
+            tbuf[tlen++] = i;
+        }
+        tlen += reflexEncodeRule(&reflex.rules[i], tbuf + tlen);
+        tlen += reflexEncodeFiring(&reflex.rules[i], tbuf + tlen);
+    }
+    (void)mutexGive(reflex.lock);
+    (void)rpcSendRep(rpc, read, tlen, (void *)rpc->tmp);
+    return 0;
+}
+
+/* Writing a rule installs and arms it, writing nothing removes it. */
+static int
+reflexWrite(rpc_t *rpc, const message_write_t *write)
+{
+    reflexRule_t rule;
+    uint32_t value32;
+    uint8_t i;
+    (void)rpc;
+    if (write->subtopic == MESSAGES_TOPIC_REFLEX_SUBTOPIC_ALL && write->len == 0) {
+        (void)mutexTake(reflex.lock, -1);
+        for (i = 0; i < REFLEX_MAX; i++) {
+            reflex.rules[i].active = false;
+        }
+        (void)mutexGive(reflex.lock);
+        return 0;
+    }
+    if (write->subtopic >= REFLEX_MAX) {
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
+    }
+    (void)memset(&rule, 0, sizeof(rule));
+    if (write->len != 0) {
+        if (write->len != REFLEX_RULE_SIZE) {
+            return MESSAGES_ERROR_BAD_VALUE;
+        }
+        rule.topic = write->value[0];
+        rule.subtopic = write->value[1];
+        rule.comparator = write->value[2];
+        rule.flags = write->value[3];
+        (void)memcpy(&value32, write->value + 4, 4);
+        rule.threshold = (int32_t)(ntohl(value32));
+        rule.motor = write->value[8];
+        rule.speed = (int8_t)write->value[9];
+        if (rule.topic < MESSAGES_TOPIC_ANALOG || rule.topic > MESSAGES_TOPIC_ULTRASONIC ||
+            rule.comparator > MESSAGES_REFLEX_NE || rule.motor < 1 || rule.motor > 10) {
+            return MESSAGES_ERROR_BAD_VALUE;
+        }
+        rule.active = true;
+        rule.armed = true;
+    }
+    (void)mutexTake(reflex.lock, -1);
+    reflex.rules[write->subtopic] = rule;
+    (void)mutexGive(reflex.lock);
+    return 0;
+}
+
+/* Publishes when a rule fires, ALL as index | firing for each rule that did. */
+static int
+reflexPublish(rpc_t *rpc, rpcSubscription_t *sub)
+{
+    uint8_t *tbuf = (void *)rpc->tmp;
+    uint8_t tlen = 0;
+    uint8_t i;
+    uint8_t slot;
+    (void)mutexTake(reflex.lock, -1);
+    for (i = 0; i < REFLEX_MAX; i++) {
+        if (sub->subtopic != MESSAGES_TOPIC_REFLEX_SUBTOPIC_ALL && sub->subtopic != i) {
+            continue;
+        }
+        slot = (sub->subtopic == MESSAGES_TOPIC_REFLEX_SUBTOPIC_ALL) ? i : 0;
+        if (!rpcSubChanged(sub, slot, (int32_t)reflex.rules[i].fired)) {
+            continue;
+        }
+        (void)rpcSubRemember(sub, slot, (int32_t)reflex.rules[i].fired);
+        if (sub->subtopic == MESSAGES_TOPIC_REFLEX_SUBTOPIC_ALL) {
+            tbuf[tlen++] = i;
+        }
+        tlen += reflexEncodeFiring(&reflex.rules[i], tbuf + tlen);
+    }
+    (void)mutexGive(reflex.lock);
+    if (tlen > 0) {
+        (void)rpcSendPub(rpc, sub, tlen, (void *)rpc->tmp);
+    }
+    return 0;
+}
@@ -41,46 +41,183 @@ vexSpiGetBackupBattery(void)
 }
 
 static void rpcPublish(rpc_t *rpc, rpcSubscription_t *sub);
-static void rpcPublishClock(rpc_t *rpc, rpcSubscription_t *sub);
-static void rpcPublishMotor(rpc_t *rpc, rpcSubscription_t *sub);
-static void rpcPublishAll(rpc_t *rpc, rpcSubscription_t *sub);
+static int rpcPublishClock(rpc_t *rpc, rpcSubscription_t *sub);
+static int rpcPublishMotor(rpc_t *rpc, rpcSubscription_t *sub);
+static int rpcPublishAll(rpc_t *rpc, rpcSubscription_t *sub);
 static void rpcRecvPing(rpc_t *rpc, const message_ping_t *ping);
+static void rpcRecvPong(rpc_t *rpc, const message_pong_t *pong);
 static void rpcRecvInfo(rpc_t *rpc, const message_info_t *info);
 static void rpcRecvInfoNetwork(rpc_t *rpc, const message_info_t *info);
+static void rpcRecvInfoSession(rpc_t *rpc, const message_info_t *info);
 static void rpcRecvRead(rpc_t *rpc, const message_read_t *read);
-static void rpcRecvReadPubsub(rpc_t *rpc, const message_read_t *read);
-static void rpcRecvReadClock(rpc_t *rpc, const message_read_t *read);
-static void rpcRecvReadMotor(rpc_t *rpc, const message_read_t *read);
-static void rpcRecvReadCassette(rpc_t *rpc, const message_read_t *read);
+static void rpcRecvReadMulti(rpc_t *rpc, const message_read_multi_t *multi);
+static int rpcRecvReadPubsub(rpc_t *rpc, const message_read_t *read);
+static int rpcRecvReadClock(rpc_t *rpc, const message_read_t *read);
+static int rpcRecvReadMotor(rpc_t *rpc, const message_read_t *read);
+static int rpcRecvReadCassette(rpc_t *rpc, const message_read_t *read);
+static int rpcRecvReadLatency(rpc_t *rpc, const message_read_t *read);
 static void rpcRecvWrite(rpc_t *rpc, const message_write_t *write);
-static void rpcRecvWriteMotor(rpc_t *rpc, const message_write_t *write);
-static void rpcRecvWriteCassette(rpc_t *rpc, const message_write_t *write);
+static void rpcRecvWriteLong(rpc_t *rpc, const message_write_long_t *write);
+static void rpcRecvFragment(rpc_t *rpc, const message_fragment_t *fragment);
+static void rpcRecvBatch(rpc_t *rpc, const message_batch_t *batch);
+static int rpcRecvWriteMotor(rpc_t *rpc, const message_write_t *write);
+static int rpcRecvWriteCassette(rpc_t *rpc, const message_write_t *write);
+static int rpcCassetteWrite(rpc_t *rpc, const uint8_t *wbuf, size_t len);
+static int rpcRecvWriteLatency(rpc_t *rpc, const message_write_t *write);
 static void rpcRecvSubscribe(rpc_t *rpc, const message_subscribe_t *subscribe);
 static void rpcRecvUnsubscribe(rpc_t *rpc, const message_unsubscribe_t *unsubscribe);
-static int rpcSendData(rpc_t *rpc, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag, uint8_t len, uint8_t *value);
-static int rpcSendPub(rpc_t *rpc, rpcSubscription_t *sub, uint8_t len, uint8_t *value);
 static int rpcSendPubError(rpc_t *rpc, rpcSubscription_t *sub, uint8_t error);
-static int rpcSendRep(rpc_t *rpc, const message_read_t *read, uint8_t len, uint8_t *value);
-static int rpcSendRepError(rpc_t *rpc, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t error);
 static int rpcSubFind(rpc_t *rpc, uint16_t req_id, rpcSubscription_t **subp);
-static int rpcSubFree(rpc_t *rpc, rpcSubscription_t **subp);
-static void rpcSubReset(rpcSubscription_t *sub);
+static rpcSubscription_t *rpcSubAlloc(rpc_t *rpc, uint16_t req_id);
+static void rpcSubInit(rpc_t *rpc);
+static void rpcSubReset(rpc_t *rpc, rpcSubscription_t *sub);
+static void rpcDuePush(rpc_t *rpc, rpcSubscription_t *sub);
+static void rpcDueRemove(rpc_t *rpc, rpcSubscription_t *sub);
+static void rpcSessionAnnounce(rpc_t *rpc, uint8_t state);
+static void rpcSessionReset(rpc_t *rpc);
+static void rpcSessionBegin(rpc_t *rpc);
+static void rpcBatchBegin(rpc_t *rpc);
+static void rpcBatchEnd(rpc_t *rpc);
+static int rpcSendDataFrame(rpc_t *rpc, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag, uint32_t timestamp,
+                            uint8_t len, uint8_t *value);
+static int rpcDownloadStart(rpc_t *rpc, uint16_t req_id, uint8_t cassette, uint32_t offset, bool resume);
+static void rpcDownloadStep(rpc_t *rpc);
+static size_t rpcDownloadFragment(rpc_t *rpc, size_t avail, size_t space);
+static void rpcDownloadStop(rpc_t *rpc);
+static int rpcUploadAppend(rpc_t *rpc, const uint8_t *buf, size_t len);
+static bool rpcUploadFlush(rpc_t *rpc);
+static void rpcUploadAbort(rpc_t *rpc);
+static int rpcSubValidate(rpc_t *rpc, const message_subscribe_t *subscribe);
+
+static const rpcTopic_t *rpcTopics[RPC_TOPIC_MAX];
+
+static const rpcTopic_t rpcTopicPubsub = {
+    .topic = MESSAGES_TOPIC_PUBSUB,
+    .read = rpcRecvReadPubsub,
+};
+
+static const rpcTopic_t rpcTopicClock = {
+    .topic = MESSAGES_TOPIC_CLOCK,
+    .flags = RPC_TOPIC_FLAG_ALL,
+    .count = 1,
+    .all = MESSAGES_TOPIC_CLOCK_SUBTOPIC_NOW,
+    .read = rpcRecvReadClock,
+    .publish = rpcPublishClock,
+};
+
+static const rpcTopic_t rpcTopicMotor = {
+    .topic = MESSAGES_TOPIC_MOTOR,
+    .flags = RPC_TOPIC_FLAG_ALL | RPC_TOPIC_FLAG_CHANGES,
+    .count = kVexMotorNum,
+    .all = MESSAGES_TOPIC_MOTOR_SUBTOPIC_ALL,
+    .read = rpcRecvReadMotor,
+    .write = rpcRecvWriteMotor,
+    .publish = rpcPublishMotor,
+};
+
+static const rpcTopic_t rpcTopicCassette = {
+    .topic = MESSAGES_TOPIC_CASSETTE,
+    .read = rpcRecvReadCassette,
+    .write = rpcRecvWriteCassette,
+};
+
+static const rpcTopic_t rpcTopicLatency = {
+    .topic = MESSAGES_TOPIC_LATENCY,
+    .read = rpcRecvReadLatency,
+    .write = rpcRecvWriteLatency,
+};
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Register the handlers for a topic.                             */
+/** @param[in]  topic The topic descriptor, which must outlive the registry    */
+/** @returns    0 on success, -1 if the topic is out of range or taken         */
+/*-----------------------------------------------------------------------------*/
+int
+rpcTopicRegister(const rpcTopic_t *topic)
+{
+    if (topic->topic >= RPC_TOPIC_MAX) {
+        return -1;
+    }
+    if (rpcTopics[topic->topic] != NULL && rpcTopics[topic->topic] != topic) {
+        return -1;
+    }
+    rpcTopics[topic->topic] = topic;
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Look up the handlers registered for a topic.                   */
+/** @param[in]  topic The topic ID                                             */
+/** @returns    The topic descriptor or NULL                                   */
+/*-----------------------------------------------------------------------------*/
+const rpcTopic_t *
+rpcTopicFind(uint8_t topic)
+{
+    return (topic < RPC_TOPIC_MAX) ? rpcTopics[topic] : NULL;
+}
+
+void
+rpcInit(rpc_t *rpc)
+{
+    (void)rpcSubInit(rpc);
+    (void)rpcTopicRegister(&rpcTopicPubsub);
+    (void)rpcTopicRegister(&rpcTopicClock);
+    (void)rpcTopicRegister(&rpcTopicMotor);
+    (void)rpcTopicRegister(&rpcTopicCassette);
+    (void)rpcTopicRegister(&rpcTopicLatency);
+    rpc->cassette = 0xff;
+    rpc->fp = NULL;
+    rpc->download.fp = NULL;
+    (void)message_reassembly_init(&rpc->reassembly, rpc->longbuf, sizeof(rpc->longbuf));
+    (void)histogramReset(&rpc->rtt);
+    (void)histogramReset(&rpc->reply);
+    (void)clocksyncReset(&rpc->clock);
+    return;
+}
 
 void
 rpcLoop(rpc_t *rpc)
 {
-    int i;
+    uint32_t now;
     uint32_t value32;
     uint16_t value16;
     uint8_t *tbuf = (void *)rpc->tmp;
     uint8_t tlen = 0;
-    if (chTimeElapsedSince(rpc->published) >= RPC_PUB_TIMEOUT) {
-        for (i = 0; i < RPC_SUB_MAX; i++) {
-            if (rpc->subs[i].active) {
-                (void)rpcPublish(rpc, &rpc->subs[i]);
+    rpcSubscription_t *sub;
+    if (rpc->session == rpcSessionStatePending && chTimeElapsedSince(rpc->detached) > RPC_SESSION_GRACE) {
+        (void)rpcSessionReset(rpc);
+    }
+    now = chTimeNow();
+    if (rpc->session == rpcSessionStateActive) {
+        // everything published this pass shares one DATA_MULTI where the host allows it
+        (void)rpcBatchBegin(rpc);
+    }
+    while (rpc->session == rpcSessionStateActive && rpc->dueCount > 0 &&
+           (int32_t)(now - rpc->subs[rpc->due[0]].next) >= 0) {
+        // only the subscriptions that are due, earliest first
+        sub = &rpc->subs[rpc->due[0]];
+        (void)rpcDueRemove(rpc, sub);
+        (void)rpcPublish(rpc, sub);
+        if (sub->active) {
+            sub->next += sub->period;
+            if ((int32_t)(now - sub->next) >= 0) {
+                // fell behind, skip the missed periods rather than bursting
+                sub->next = now + sub->period;
             }
+            (void)rpcDuePush(rpc, sub);
         }
-        rpc->published = chTimeNow();
+    }
+    (void)rpcBatchEnd(rpc);
+    if (rpc->session == rpcSessionStateActive) {
+        // at most one cassette chunk per pass, so publishes and replies keep flowing
+        (void)rpcDownloadStep(rpc);
+    }
+    if (rpc->pingTimed && chTimeElapsedSince(rpc->pinged) >= RPC_PING_TIMEOUT) {
+        // only hosts that sent us a timed ping are known to answer one
+        rpc->pingSeq++;
+        (void)message_ping_timed_frame(&rpc->out.msg.ping, rpc->pingSeq, (uint32_t)micros());
+        (void)rpcSend(rpc, &rpc->out.msg);
+        rpc->pinged = chTimeNow();
     }
     if (chTimeElapsedSince(rpc->sendstats) >= RPC_INFO_TIMEOUT) {
         value32 = (uint32_t)chTimeNow();
@@ -109,46 +246,62 @@ rpcLoop(rpc_t *rpc)
 static void
 rpcPublish(rpc_t *rpc, rpcSubscription_t *sub)
 {
+    const rpcTopic_t *topic = rpcTopicFind(sub->topic);
+    int error = MESSAGES_ERROR_BAD_TOPIC;
+    uint32_t elapsed;
     if (!sub->active) {
         return;
     }
-    switch (sub->topic) {
-    case MESSAGES_TOPIC_CLOCK:
-        (void)rpcPublishClock(rpc, sub);
-        break;
-    case MESSAGES_TOPIC_MOTOR:
-        (void)rpcPublishMotor(rpc, sub);
-        break;
-    case MESSAGES_TOPIC_ALL:
-        (void)rpcPublishAll(rpc, sub);
-        break;
-    default:
-        (void)rpcSendPubError(rpc, sub, MESSAGES_ERROR_BAD_TOPIC);
-        (void)rpcSubReset(sub);
-        break;
+    elapsed = (uint32_t)chTimeElapsedSince(sub->published);
+    if (!(sub->flags & RPC_SUB_FLAG_FORCE)) {
+        if (sub->maxInterval != 0 && elapsed >= sub->maxInterval) {
+            // quiet for too long, refresh even if nothing changed
+            sub->flags |= RPC_SUB_FLAG_FORCE;
+        } else if (elapsed < sub->minInterval) {
+            return;
+        }
+    }
+    if (sub->topic == MESSAGES_TOPIC_ALL) {
+        error = rpcPublishAll(rpc, sub);
+    } else if (topic != NULL && topic->publish != NULL) {
+        error = topic->publish(rpc, sub);
+    }
+    if (error != 0) {
+        (void)rpcSendPubError(rpc, sub, (uint8_t)error);
+        (void)rpcSubReset(rpc, sub);
+        return;
+    }
+    if (sub->flags & RPC_SUB_FLAG_SENT) {
+        // a forced publish stays forced until the topic had something to send
+        sub->flags &= (uint8_t)(~(RPC_SUB_FLAG_SENT | RPC_SUB_FLAG_FORCE));
+        sub->published = chTimeNow();
     }
     return;
 }
 
-static void
+static int
 rpcPublishClock(rpc_t *rpc, rpcSubscription_t *sub)
 {
     uint64_t value;
+    uint32_t now;
     switch (sub->subtopic) {
     case MESSAGES_TOPIC_CLOCK_SUBTOPIC_NOW:
-        value = (uint64_t)chTimeNow();
+        now = (uint32_t)chTimeNow();
+        if (!rpcSubChanged(sub, 0, (int32_t)now)) {
+            return 0;
+        }
+        (void)rpcSubRemember(sub, 0, (int32_t)now);
+        value = (uint64_t)now;
         value = (uint64_t)(htonll(value));
         (void)rpcSendPub(rpc, sub, 8, (void *)&value);
         break;
     default:
-        (void)rpcSendPubError(rpc, sub, MESSAGES_ERROR_BAD_SUBTOPIC);
-        (void)rpcSubReset(sub);
-        break;
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
     }
-    return;
+    return 0;
 }
 
-static void
+static int
 rpcPublishMotor(rpc_t *rpc, rpcSubscription_t *sub)
 {
     int16_t i;
@@ -157,25 +310,24 @@ rpcPublishMotor(rpc_t *rpc, rpcSubscription_t *sub)
     uint8_t *tbuf = (void *)rpc->tmp;
     uint8_t tlen = 0;
     if (sub->subtopic < kVexMotorNum) {
-        index = sub->subtopic;
         i = (int16_t)sub->subtopic;
         value = (int8_t)vexMotorGet(i);
-        if (value == rpc->motor[index]) {
-            return;
+        if (!rpcSubChanged(sub, 0, value)) {
+            return 0;
         }
-        rpc->motor[index] = value;
+        (void)rpcSubRemember(sub, 0, value);
         (void)rpcSendPub(rpc, sub, 1, (void *)&value);
-        return;
+        return 0;
     }
     switch (sub->subtopic) {
     case MESSAGES_TOPIC_MOTOR_SUBTOPIC_ALL:
         for (i = kVexMotor_1; i < kVexMotorNum; i++) {
             index = (int8_t)i;
             value = (int8_t)vexMotorGet(i);
-            if (value == rpc->motor[index]) {
+            if (!rpcSubChanged(sub, (uint8_t)index, value)) {
                 continue;
             }
-            rpc->motor[index] = value;
+            (void)rpcSubRemember(sub, (uint8_t)index, value);
             (void)memcpy(tbuf, &index, 1);
             tbuf += 1;
             tlen += 1;
@@ -188,37 +340,36 @@ rpcPublishMotor(rpc_t *rpc, rpcSubscription_t *sub)
         }
         break;
     default:
-        (void)rpcSendPubError(rpc, sub, MESSAGES_ERROR_BAD_SUBTOPIC);
-        (void)rpcSubReset(sub);
-        break;
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
     }
-    return;
+    return 0;
 }
 
-static void
+static int
 rpcPublishAll(rpc_t *rpc, rpcSubscription_t *sub)
 {
+    int i;
     uint8_t topic;
     uint8_t subtopic;
-    switch (sub->subtopic) {
-    case MESSAGES_TOPIC_ALL_SUBTOPIC_ALL:
-        topic = sub->topic;
-        subtopic = sub->subtopic;
-        sub->topic = MESSAGES_TOPIC_CLOCK;
-        sub->subtopic = MESSAGES_TOPIC_CLOCK_SUBTOPIC_NOW;
-        (void)rpcPublishClock(rpc, sub);
-        sub->topic = MESSAGES_TOPIC_MOTOR;
-        sub->subtopic = MESSAGES_TOPIC_MOTOR_SUBTOPIC_ALL;
-        (void)rpcPublishMotor(rpc, sub);
-        sub->topic = topic;
-        sub->subtopic = subtopic;
-        break;
-    default:
-        (void)rpcSendPubError(rpc, sub, MESSAGES_ERROR_BAD_SUBTOPIC);
-        (void)rpcSubReset(sub);
-        break;
+    if (sub->subtopic != MESSAGES_TOPIC_ALL_SUBTOPIC_ALL) {
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
     }
-    return;
+    topic = sub->topic;
+    subtopic = sub->subtopic;
+    for (i = 0; i < RPC_TOPIC_MAX; i++) {
+        if (rpcTopics[i] == NULL || rpcTopics[i]->publish == NULL || !(rpcTopics[i]->flags & RPC_TOPIC_FLAG_ALL)) {
+            continue;
+        }
+        sub->topic = rpcTopics[i]->topic;
+        sub->subtopic = rpcTopics[i]->all;
+        (void)rpcTopics[i]->publish(rpc, sub);
+        // each topic remembers its values in its own slots
+        sub->base = (uint8_t)(sub->base + rpcTopics[i]->count);
+    }
+    sub->topic = topic;
+    sub->subtopic = subtopic;
+    sub->base = 0;
+    return 0;
 }
 
 void
@@ -230,6 +381,7 @@ rpcRecv(rpc_t *rpc, const message_any_t *message)
         (void)rpcRecvPing(rpc, &message->ping);
         break;
     case MESSAGES_OP_PONG:
+        (void)rpcRecvPong(rpc, &message->pong);
         break;
     case MESSAGES_OP_INFO:
         (void)rpcRecvInfo(rpc, &message->info);
@@ -239,6 +391,9 @@ rpcRecv(rpc_t *rpc, const message_any_t *message)
     case MESSAGES_OP_READ:
         (void)rpcRecvRead(rpc, &message->read);
         break;
+    case MESSAGES_OP_READ_MULTI:
+        (void)rpcRecvReadMulti(rpc, &message->read_multi);
+        break;
     case MESSAGES_OP_WRITE:
         (void)rpcRecvWrite(rpc, &message->write);
         break;
@@ -248,6 +403,15 @@ rpcRecv(rpc_t *rpc, const message_any_t *message)
     case MESSAGES_OP_UNSUBSCRIBE:
         (void)rpcRecvUnsubscribe(rpc, &message->unsubscribe);
         break;
+    case MESSAGES_OP_WRITE_LONG:
+        (void)rpcRecvWriteLong(rpc, &message->write_long);
+        break;
+    case MESSAGES_OP_FRAGMENT:
+        (void)rpcRecvFragment(rpc, &message->fragment);
+        break;
+    case MESSAGES_OP_BATCH:
+        (void)rpcRecvBatch(rpc, &message->batch);
+        break;
     default:
         updateHeartbeat = 0;
         break;
@@ -263,12 +427,35 @@ rpcRecvPing(rpc_t *rpc, const message_ping_t *ping)
 {
     rpc->seq_id = ping->seq_id;
     // vex_printf("PING: seq_id=%d\r\n", ping->seq_id);
-    (void)message_pong_frame(&rpc->out.msg.pong, ping->seq_id);
+    if (ping->timed) {
+        rpc->pingTimed = true;
+        (void)message_pong_timed_frame(&rpc->out.msg.pong, ping->seq_id, ping->timestamp, rpc->rxstamp, (uint32_t)micros());
+    } else {
+        (void)message_pong_frame(&rpc->out.msg.pong, ping->seq_id);
+    }
     (void)rpcSend(rpc, &rpc->out.msg);
     // vex_printf("PONG: seq_id=%d\r\n", rpc->out.msg.pong.seq_id);
     return;
 }
 
+static void
+rpcRecvPong(rpc_t *rpc, const message_pong_t *pong)
+{
+    uint32_t now = (uint32_t)micros();
+    uint32_t elapsed;
+    uint32_t held;
+    if (!pong->timed || pong->seq_id != rpc->pingSeq) {
+        return;
+    }
+    // round trip minus the time the host sat on the ping
+    elapsed = now - pong->origin;
+    held = pong->transmit - pong->receive;
+    (void)histogramRecord(&rpc->rtt, (held < elapsed) ? (elapsed - held) : 0);
+    // when the frame came in, not when the server got round to it
+    (void)clocksyncSample(&rpc->clock, pong->origin, pong->receive, pong->transmit, (rpc->rxstamp != 0) ? rpc->rxstamp : now);
+    return;
+}
+
 static void
 rpcRecvInfo(rpc_t *rpc, const message_info_t *info)
 {
@@ -276,6 +463,9 @@ rpcRecvInfo(rpc_t *rpc, const message_info_t *info)
     case MESSAGES_TOPIC_NETWORK:
         (void)rpcRecvInfoNetwork(rpc, info);
         break;
+    case MESSAGES_TOPIC_SESSION:
+        (void)rpcRecvInfoSession(rpc, info);
+        break;
     default:
         break;
     }
@@ -299,29 +489,119 @@ rpcRecvInfoNetwork(rpc_t *rpc, const message_info_t *info)
 }
 
 static void
-rpcRecvRead(rpc_t *rpc, const message_read_t *read)
+rpcRecvInfoSession(rpc_t *rpc, const message_info_t *info)
 {
-    switch (read->topic) {
-    case MESSAGES_TOPIC_PUBSUB:
-        (void)rpcRecvReadPubsub(rpc, read);
-        break;
-    case MESSAGES_TOPIC_CLOCK:
-        (void)rpcRecvReadClock(rpc, read);
-        break;
-    case MESSAGES_TOPIC_MOTOR:
-        (void)rpcRecvReadMotor(rpc, read);
+    int i;
+    uint32_t token;
+    switch (info->subtopic) {
+    case MESSAGES_TOPIC_SESSION_SUBTOPIC_RESUME:
+        if (info->len != 4) {
+            return;
+        }
+        (void)memcpy(&token, info->value, 4);
+        token = (uint32_t)(ntohl(token));
+        if (rpc->session != rpcSessionStatePending) {
+            // tell the host which session it is talking to
+            (void)rpcSessionAnnounce(rpc, (token == rpc->token) ? MESSAGES_SESSION_RESUMED : MESSAGES_SESSION_NEW);
+            return;
+        }
+        if (token != rpc->token) {
+            (void)rpcSessionReset(rpc);
+            return;
+        }
+        rpc->session = rpcSessionStateActive;
+        // publish on the next tick instead of waiting out a full period
+        for (i = 0; i < rpc->dueCount; i++) {
+            rpc->subs[rpc->due[i]].next = chTimeNow();
+            // the host may have missed changes while detached
+            rpc->subs[rpc->due[i]].flags |= RPC_SUB_FLAG_FORCE;
+        }
+        (void)rpcSessionAnnounce(rpc, MESSAGES_SESSION_RESUMED);
         break;
-    case MESSAGES_TOPIC_CASSETTE:
-        (void)rpcRecvReadCassette(rpc, read);
+    case MESSAGES_TOPIC_SESSION_SUBTOPIC_FEATURES:
+        if (info->len < 1) {
+            return;
+        }
+        // the host asks for what it can decode, we grant what we can send
+        rpc->features = info->value[0] & RPC_FEATURES;
+        // the host restarts its DATA_COMPACT timestamps from 0 when it reads this
+        rpc->compactStamp = 0;
+        (void)message_info_frame(&rpc->out.msg.info, MESSAGES_TOPIC_SESSION, MESSAGES_TOPIC_SESSION_SUBTOPIC_FEATURES, 1,
+                                 &rpc->features);
+        (void)rpcSend(rpc, &rpc->out.msg);
         break;
     default:
-        (void)rpcSendRepError(rpc, read->req_id, read->topic, read->subtopic, MESSAGES_ERROR_BAD_TOPIC);
         break;
     }
     return;
 }
 
 static void
+rpcRecvRead(rpc_t *rpc, const message_read_t *read)
+{
+    const rpcTopic_t *topic = rpcTopicFind(read->topic);
+    int error = MESSAGES_ERROR_BAD_TOPIC;
+    if (topic != NULL && topic->read != NULL) {
+        error = topic->read(rpc, read);
+    }
+    if (error != 0) {
+        (void)rpcSendRepError(rpc, read->req_id, read->topic, read->subtopic, (uint8_t)error);
+    }
+    return;
+}
+
+/* Every pair is handled as its own READ, their replies sharing DATA_MULTI frames where the host allows it. */
+static void
+rpcRecvReadMulti(rpc_t *rpc, const message_read_multi_t *multi)
+{
+    message_read_t read;
+    uint8_t i;
+    (void)rpcBatchBegin(rpc);
+    for (i = 0; i < multi->count; i++) {
+        (void)message_read_frame(&read, multi->req_id, multi->pairs[2 * i], multi->pairs[2 * i + 1]);
+        (void)rpcRecvRead(rpc, &read);
+    }
+    (void)rpcBatchEnd(rpc);
+    return;
+}
+
+static void
+rpcRecvReadPubsubList(rpc_t *rpc, const message_read_t *read, uint8_t subtopic, uint8_t flag)
+{
+    int i;
+    uint16_t req_id;
+    uint8_t *tbuf = (void *)rpc->tmp;
+    uint8_t tlen = 0;
+    for (i = 0; i < RPC_SUB_MAX; i++) {
+        if (!rpc->subs[i].active) {
+            continue;
+        }
+        if (tlen + 5 > RPC_DATA_MAX) {
+            // more subscriptions than fit in one reply, continue in the next
+            (void)rpcSendData(rpc, read->req_id, read->topic, subtopic, 0, tlen, (void *)rpc->tmp);
+            tbuf = (void *)rpc->tmp;
+            tlen = 0;
+        }
+        (void)memcpy(tbuf, &i, 1);
+        tbuf += 1;
+        tlen += 1;
+        req_id = rpc->subs[i].req_id;
+        req_id = (uint16_t)(htons(req_id));
+        (void)memcpy(tbuf, &req_id, 2);
+        tbuf += 2;
+        tlen += 2;
+        (void)memcpy(tbuf, &rpc->subs[i].topic, 1);
+        tbuf += 1;
+        tlen += 1;
+        (void)memcpy(tbuf, &rpc->subs[i].subtopic, 1);
+        tbuf += 1;
+        tlen += 1;
+    }
+    (void)rpcSendData(rpc, read->req_id, read->topic, subtopic, flag, tlen, (void *)rpc->tmp);
+    return;
+}
+
+static int
 rpcRecvReadPubsub(rpc_t *rpc, const message_read_t *read)
 {
     int i;
@@ -329,12 +609,11 @@ rpcRecvReadPubsub(rpc_t *rpc, const message_read_t *read)
     uint8_t value;
     uint16_t req_id;
     uint8_t *tbuf = (void *)rpc->tmp;
-    uint8_t tlen = 0;
     if (read->subtopic < RPC_SUB_MAX) {
         i = (int)read->subtopic;
         if (!rpc->subs[i].active) {
             (void)rpcSendRep(rpc, read, 0, NULL);
-            return;
+            return 0;
         }
         req_id = rpc->subs[i].req_id;
         req_id = (uint16_t)(htons(req_id));
@@ -342,16 +621,15 @@ rpcRecvReadPubsub(rpc_t *rpc, const message_read_t *read)
         (void)memcpy(tbuf + 2, &rpc->subs[i].topic, 1);
         (void)memcpy(tbuf + 3, &rpc->subs[i].subtopic, 1);
         (void)rpcSendRep(rpc, read, 4, (void *)tbuf);
-        return;
+        return 0;
     }
     switch (read->subtopic) {
     case MESSAGES_TOPIC_PUBSUB_SUBTOPIC_COUNT:
-        value = (uint8_t)rpcSubFree(rpc, NULL);
-        value = RPC_SUB_MAX - value;
+        value = rpc->subCount;
         (void)rpcSendRep(rpc, read, 1, (void *)&value);
         break;
     case MESSAGES_TOPIC_PUBSUB_SUBTOPIC_FREE:
-        value = (uint8_t)rpcSubFree(rpc, NULL);
+        value = RPC_SUB_MAX - rpc->subCount;
         (void)rpcSendRep(rpc, read, 1, (void *)&value);
         break;
     case MESSAGES_TOPIC_PUBSUB_SUBTOPIC_MAX:
@@ -359,54 +637,17 @@ rpcRecvReadPubsub(rpc_t *rpc, const message_read_t *read)
         (void)rpcSendRep(rpc, read, 1, (void *)&value);
         break;
     case MESSAGES_TOPIC_PUBSUB_SUBTOPIC_LIST:
-        for (i = 0; i < RPC_SUB_MAX; i++) {
-            if (rpc->subs[i].active) {
-                (void)memcpy(tbuf, &i, 1);
-                tbuf += 1;
-                tlen += 1;
-                req_id = rpc->subs[i].req_id;
-                req_id = (uint16_t)(htons(req_id));
-                (void)memcpy(tbuf, &req_id, 2);
-                tbuf += 2;
-                tlen += 2;
-                (void)memcpy(tbuf, &rpc->subs[i].topic, 1);
-                tbuf += 1;
-                tlen += 1;
-                (void)memcpy(tbuf, &rpc->subs[i].subtopic, 1);
-                tbuf += 1;
-                tlen += 1;
-            }
-        }
-        (void)rpcSendRep(rpc, read, tlen, (void *)rpc->tmp);
+        (void)rpcRecvReadPubsubList(rpc, read, read->subtopic, MESSAGES_DATA_FLAG_END);
         break;
     case MESSAGES_TOPIC_PUBSUB_SUBTOPIC_ALL:
         flag = 0;
         // LIST
-        for (i = 0; i < RPC_SUB_MAX; i++) {
-            if (rpc->subs[i].active) {
-                (void)memcpy(tbuf, &i, 1);
-                tbuf += 1;
-                tlen += 1;
-                req_id = rpc->subs[i].req_id;
-                req_id = (uint16_t)(htons(req_id));
-                (void)memcpy(tbuf, &req_id, 2);
-                tbuf += 2;
-                tlen += 2;
-                (void)memcpy(tbuf, &rpc->subs[i].topic, 1);
-                tbuf += 1;
-                tlen += 1;
-                (void)memcpy(tbuf, &rpc->subs[i].subtopic, 1);
-                tbuf += 1;
-                tlen += 1;
-            }
-        }
-        (void)rpcSendData(rpc, read->req_id, read->topic, MESSAGES_TOPIC_PUBSUB_SUBTOPIC_LIST, flag, tlen, (void *)rpc->tmp);
+        (void)rpcRecvReadPubsubList(rpc, read, MESSAGES_TOPIC_PUBSUB_SUBTOPIC_LIST, flag);
         // COUNT
-        value = (uint8_t)rpcSubFree(rpc, NULL);
-        value = RPC_SUB_MAX - value;
+        value = rpc->subCount;
         (void)rpcSendData(rpc, read->req_id, read->topic, MESSAGES_TOPIC_PUBSUB_SUBTOPIC_COUNT, flag, 1, (void *)&value);
         // FREE
-        value = (uint8_t)rpcSubFree(rpc, NULL);
+        value = RPC_SUB_MAX - rpc->subCount;
         (void)rpcSendData(rpc, read->req_id, read->topic, MESSAGES_TOPIC_PUBSUB_SUBTOPIC_FREE, flag, 1, (void *)&value);
         // MAX
         value = RPC_SUB_MAX;
@@ -415,30 +656,52 @@ rpcRecvReadPubsub(rpc_t *rpc, const message_read_t *read)
         (void)rpcSendData(rpc, read->req_id, read->topic, read->subtopic, flag, 0, NULL);
         break;
     default:
-        (void)rpcSendRepError(rpc, read->req_id, read->topic, read->subtopic, MESSAGES_ERROR_BAD_SUBTOPIC);
-        break;
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
     }
-    return;
+    return 0;
 }
 
-static void
+/* synced | micros (4) | offset (4) | drift (4) | delay (4), offset being the host's clock less
+ * micros, drift in parts per billion and delay the round trip of the last sample used */
+static uint8_t
+rpcClockEncodeSync(rpc_t *rpc, uint8_t *tbuf)
+{
+    uint32_t now = (uint32_t)micros();
+    uint32_t value32;
+    tbuf[0] = rpc->clock.synced ? 1 : 0;
+    value32 = (uint32_t)(htonl(now));
+    (void)memcpy(tbuf + 1, &value32, 4);
+    value32 = (uint32_t)(htonl(clocksyncOffset(&rpc->clock, now)));
+    (void)memcpy(tbuf + 5, &value32, 4);
+    value32 = (uint32_t)(htonl((uint32_t)clocksyncDriftPpb(&rpc->clock)));
+    (void)memcpy(tbuf + 9, &value32, 4);
+    value32 = (uint32_t)(htonl(rpc->clock.delay));
+    (void)memcpy(tbuf + 13, &value32, 4);
+    return 17;
+}
+
+static int
 rpcRecvReadClock(rpc_t *rpc, const message_read_t *read)
 {
     uint64_t value;
+    uint8_t tlen;
     switch (read->subtopic) {
     case MESSAGES_TOPIC_CLOCK_SUBTOPIC_NOW:
         value = (uint64_t)chTimeNow();
         value = (uint64_t)(htonll(value));
         (void)rpcSendRep(rpc, read, 8, (void *)&value);
         break;
-    default:
-        (void)rpcSendRepError(rpc, read->req_id, read->topic, read->subtopic, MESSAGES_ERROR_BAD_SUBTOPIC);
+    case MESSAGES_TOPIC_CLOCK_SUBTOPIC_SYNC:
+        tlen = rpcClockEncodeSync(rpc, rpc->tmp);
+        (void)rpcSendRep(rpc, read, tlen, (void *)rpc->tmp);
         break;
+    default:
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
     }
-    return;
+    return 0;
 }
 
-static void
+static int
 rpcRecvReadMotor(rpc_t *rpc, const message_read_t *read)
 {
     int16_t i;
@@ -450,20 +713,14 @@ rpcRecvReadMotor(rpc_t *rpc, const message_read_t *read)
         index = read->subtopic;
         i = (int16_t)read->subtopic;
         value = (int8_t)vexMotorGet(i);
-        if (value != rpc->motor[index]) {
-            rpc->motor[index] = value;
-        }
         (void)rpcSendRep(rpc, read, 1, (void *)&value);
-        return;
+        return 0;
     }
     switch (read->subtopic) {
     case MESSAGES_TOPIC_MOTOR_SUBTOPIC_ALL:
         for (i = kVexMotor_1; i < kVexMotorNum; i++) {
             index = (int8_t)i;
             value = (int8_t)vexMotorGet(i);
-            if (value != rpc->motor[index]) {
-                rpc->motor[index] = value;
-            }
             (void)memcpy(tbuf, &index, 1);
             tbuf += 1;
             tlen += 1;
@@ -474,72 +731,30 @@ rpcRecvReadMotor(rpc_t *rpc, const message_read_t *read)
         (void)rpcSendRep(rpc, read, tlen, (void *)rpc->tmp);
         break;
     default:
-        (void)rpcSendRepError(rpc, read->req_id, read->topic, read->subtopic, MESSAGES_ERROR_BAD_SUBTOPIC);
-        break;
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
     }
-    return;
+    return 0;
 }
 
-static void
+static int
 rpcRecvReadCassette(rpc_t *rpc, const message_read_t *read)
 {
-    uint8_t flag;
     uint8_t value;
     uint32_t rlen = 0;
-    int c;
     uint8_t *tbuf = (void *)rpc->tmp;
     uint8_t tlen = 0;
-    PROS_FILE *fp = NULL;
     if (read->subtopic < cassetteMax()) {
         if (rpc->fp != NULL) {
             (void)fflush(rpc->fp);
             (void)rpcSendRep(rpc, read, 0, NULL);
-            return;
-        }
-        fp = cassetteOpenRead(read->subtopic);
-        if (fp == NULL) {
-            (void)rpcSendRep(rpc, read, 0, NULL);
-            return;
-        }
-        flag = 0;
-        while (!feof(fp)) {
-            // printf("[0] rlen=%lu\r\n", rlen);
-            if (fcount(fp) == 0) {
-                vexSleep(2);
-            } else {
-                c = fgetc(fp);
-                if (c == -1) {
-                    vexSleep(2);
-                } else {
-                    // printf("c = %d\r\n", c);
-                    // value = (uint8_t)c;
-                    (void)memcpy(tbuf, &c, 1);
-                    tbuf += 1;
-                    tlen += 1;
-                    rlen += 1;
-                    if (tlen >= 128) {
-                        tbuf = (void *)rpc->tmp;
-                        (void)rpcSendData(rpc, read->req_id, read->topic, read->subtopic, flag, tlen, tbuf);
-                        tlen = 0;
-                    }
-                }
-            }
-            // printf("[1] rlen=%lu\r\n", rlen);
-        }
-        if (tlen > 0) {
-            tbuf = (void *)rpc->tmp;
-            (void)rpcSendData(rpc, read->req_id, read->topic, read->subtopic, flag, tlen, tbuf);
-            tlen = 0;
+            return 0;
         }
-        rlen = (uint32_t)(htonl(rlen));
-        (void)rpcSendRep(rpc, read, 4, (void *)&rlen);
-        (void)fclose(fp);
-        return;
+        return rpcDownloadStart(rpc, read->req_id, read->subtopic, 0, false);
     }
     switch (read->subtopic) {
     case MESSAGES_TOPIC_CASSETTE_SUBTOPIC_OPEN:
         if (rpc->fp != NULL) {
-            rlen = (uint32_t)ftell(rpc->fp);
+            rlen = rpc->upload.offset;
         }
         value = (uint8_t)rpc->cassette;
         (void)memcpy(tbuf, &value, 1);
@@ -565,30 +780,136 @@ rpcRecvReadCassette(rpc_t *rpc, const message_read_t *read)
         (void)rpcSendRep(rpc, read, 1, (void *)&value);
         break;
     default:
-        (void)rpcSendRepError(rpc, read->req_id, read->topic, read->subtopic, MESSAGES_ERROR_BAD_SUBTOPIC);
-        break;
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
     }
-    return;
+    return 0;
 }
 
-static void
-rpcRecvWrite(rpc_t *rpc, const message_write_t *write)
+static uint8_t
+rpcLatencyEncode(const histogram_t *h, uint8_t *tbuf)
+{
+    histogramSummary_t summary;
+    uint32_t value32;
+    (void)histogramSummarize(h, &summary);
+    value32 = (uint32_t)(htonl(summary.count));
+    (void)memcpy(tbuf, &value32, 4);
+    value32 = (uint32_t)(htonl(summary.min));
+    (void)memcpy(tbuf + 4, &value32, 4);
+    value32 = (uint32_t)(htonl(summary.p50));
+    (void)memcpy(tbuf + 8, &value32, 4);
+    value32 = (uint32_t)(htonl(summary.p99));
+    (void)memcpy(tbuf + 12, &value32, 4);
+    value32 = (uint32_t)(htonl(summary.max));
+    (void)memcpy(tbuf + 16, &value32, 4);
+    return 20;
+}
+
+static int
+rpcRecvReadLatency(rpc_t *rpc, const message_read_t *read)
 {
-    switch (write->topic) {
-    case MESSAGES_TOPIC_MOTOR:
-        (void)rpcRecvWriteMotor(rpc, write);
+    uint8_t flag;
+    uint8_t tlen;
+    switch (read->subtopic) {
+    case MESSAGES_TOPIC_LATENCY_SUBTOPIC_RTT:
+        tlen = rpcLatencyEncode(&rpc->rtt, rpc->tmp);
+        (void)rpcSendRep(rpc, read, tlen, (void *)rpc->tmp);
         break;
-    case MESSAGES_TOPIC_CASSETTE:
-        (void)rpcRecvWriteCassette(rpc, write);
+    case MESSAGES_TOPIC_LATENCY_SUBTOPIC_REPLY:
+        tlen = rpcLatencyEncode(&rpc->reply, rpc->tmp);
+        (void)rpcSendRep(rpc, read, tlen, (void *)rpc->tmp);
         break;
-    default:
-        (void)rpcSendRepError(rpc, write->req_id, write->topic, write->subtopic, MESSAGES_ERROR_BAD_TOPIC);
+    case MESSAGES_TOPIC_LATENCY_SUBTOPIC_ALL:
+        flag = 0;
+        tlen = rpcLatencyEncode(&rpc->rtt, rpc->tmp);
+        (void)rpcSendData(rpc, read->req_id, read->topic, MESSAGES_TOPIC_LATENCY_SUBTOPIC_RTT, flag, tlen, (void *)rpc->tmp);
+        tlen = rpcLatencyEncode(&rpc->reply, rpc->tmp);
+        (void)rpcSendData(rpc, read->req_id, read->topic, MESSAGES_TOPIC_LATENCY_SUBTOPIC_REPLY, flag, tlen, (void *)rpc->tmp);
+        flag |= MESSAGES_DATA_FLAG_END;
+        (void)rpcSendData(rpc, read->req_id, read->topic, read->subtopic, flag, 0, NULL);
         break;
+    default:
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
+    }
+    return 0;
+}
+
+static void
+rpcRecvWrite(rpc_t *rpc, const message_write_t *write)
+{
+    const rpcTopic_t *topic = rpcTopicFind(write->topic);
+    int error = MESSAGES_ERROR_BAD_TOPIC;
+    if (topic != NULL && topic->write != NULL) {
+        error = topic->write(rpc, write);
+    }
+    if (error != 0) {
+        (void)rpcSendRepError(rpc, write->req_id, write->topic, write->subtopic, (uint8_t)error);
+    }
+    return;
+}
+
+/* Cassette blocks are written in place, anything else has to fit a plain WRITE. */
+static void
+rpcRecvWriteLong(rpc_t *rpc, const message_write_long_t *write)
+{
+    message_write_t shortWrite;
+    int error = MESSAGES_ERROR_BAD_VALUE;
+    if (write->topic == MESSAGES_TOPIC_CASSETTE && write->subtopic == MESSAGES_TOPIC_CASSETTE_SUBTOPIC_WRITE) {
+        (void)rpcSessionBegin(rpc);
+        error = rpcCassetteWrite(rpc, write->value, write->len);
+    } else if (write->len <= 0xff) {
+        (void)message_write_frame(&shortWrite, write->req_id, write->topic, write->subtopic, (uint8_t)write->len, write->value);
+        (void)rpcRecvWrite(rpc, &shortWrite);
+        return;
+    }
+    if (error != 0) {
+        (void)rpcSendRepError(rpc, write->req_id, write->topic, write->subtopic, (uint8_t)error);
+    }
+    return;
+}
+
+static void
+rpcRecvFragment(rpc_t *rpc, const message_fragment_t *fragment)
+{
+    message_any_t message;
+    int retval = message_reassemble(&rpc->reassembly, fragment);
+    if (retval < 0 && fragment->offset == 0 && fragment->len >= 5 &&
+        (fragment->value[0] == MESSAGES_OP_WRITE_LONG || fragment->value[0] == MESSAGES_OP_WRITE)) {
+        // too long to take, the head is all there is to answer it with
+        (void)rpcSendRepError(rpc, (uint16_t)((fragment->value[1] << 8) | fragment->value[2]), fragment->value[3],
+                              fragment->value[4], MESSAGES_ERROR_BAD_VALUE);
+    }
+    if (retval != 1 || message_deserialize(&message, rpc->reassembly.buf, rpc->reassembly.len) != 0 ||
+        message.message.op == MESSAGES_OP_FRAGMENT) {
+        return;
     }
+    // points into the reassembly buffer, which the next fragment overwrites
+    (void)rpcRecv(rpc, &message);
     return;
 }
 
+/* Each message of a BATCH in turn, their replies sharing DATA_MULTI frames where the host allows it. */
 static void
+rpcRecvBatch(rpc_t *rpc, const message_batch_t *batch)
+{
+    message_any_t message;
+    size_t offset = 0;
+    bool outer = !rpc->batching;
+    int retval;
+    if (outer) {
+        (void)rpcBatchBegin(rpc);
+    }
+    while ((retval = message_batch_next(batch, &offset, &message)) != 0) {
+        if (retval == 1 && message.message.op != MESSAGES_OP_BATCH) {
+            (void)rpcRecv(rpc, &message);
+        }
+    }
+    if (outer) {
+        (void)rpcBatchEnd(rpc);
+    }
+    return;
+}
+
+static int
 rpcRecvWriteMotor(rpc_t *rpc, const message_write_t *write)
 {
     (void)rpc;
@@ -602,7 +923,7 @@ rpcRecvWriteMotor(rpc_t *rpc, const message_write_t *write)
         // (void)vex_printf("WRITING ALL?\r\n");
         if (write->len == 0 || (write->len % 2) != 0) {
             // (void)vex_printf("BAD LEN: %d \%2 = %d\r\n", write->len, write->len % 2);
-            return;
+            return 0;
         }
         n = (write->len / 2);
         for (i = 0; i < n; i++) {
@@ -616,17 +937,17 @@ rpcRecvWriteMotor(rpc_t *rpc, const message_write_t *write)
         }
     } else if (write->subtopic >= kVexMotorNum) {
         // (void)vex_printf("BAD SUBTOPIC: %d >= %d\r\n", write->subtopic, kVexMotorNum);
-        return;
+        return 0;
     } else if (write->len != 1) {
         // (void)vex_printf("BAD WRITE LENGTH: %d\r\n", write->len);
-        return;
+        return 0;
     } else {
         index = (int8_t)write->subtopic;
         value = (int8_t)(*wbuf);
         // (void)vex_printf("WRITE MOTOR: %d -> %d\r\n", (int16_t)index, (int16_t)value);
         (void)vexMotorSet((int16_t)index, (int16_t)value);
     }
-    return;
+    return 0;
 }
 
 static size_t
@@ -642,91 +963,357 @@ sdAsynchronousWrite(PROS_FILE *sd, const uint8_t *buf, size_t len)
     // return fwrite((const void *)buf, 1, len, sd);
 }
 
-static void
+static int
 rpcRecvWriteCassette(rpc_t *rpc, const message_write_t *write)
 {
     uint8_t *wbuf = write->value;
+    uint32_t offset;
+    (void)rpcSessionBegin(rpc);
     switch (write->subtopic) {
+    case MESSAGES_TOPIC_CASSETTE_SUBTOPIC_READ:
+        // index | offset, continues a download the host lost part way through
+        if (write->len != 5 || *wbuf >= cassetteMax()) {
+            return MESSAGES_ERROR_BAD_SUBTOPIC;
+        }
+        if (rpc->fp != NULL) {
+            (void)rpcSendData(rpc, write->req_id, MESSAGES_TOPIC_CASSETTE, *wbuf, MESSAGES_DATA_FLAG_END, 0, NULL);
+            return 0;
+        }
+        (void)memcpy(&offset, wbuf + 1, 4);
+        return rpcDownloadStart(rpc, write->req_id, *wbuf, (uint32_t)(ntohl(offset)), true);
     case MESSAGES_TOPIC_CASSETTE_SUBTOPIC_OPEN:
         if (write->len != 1) {
-            return;
+            return 0;
         }
         if (*wbuf >= cassetteMax()) {
-            return;
+            return 0;
         }
         if (rpc->cassette != 0xff) {
-            return;
+            return 0;
         }
         rpc->cassette = *wbuf;
         rpc->fp = cassetteOpenWrite(rpc->cassette);
         if (rpc->fp == NULL) {
             rpc->cassette = 0xff;
         }
-        return;
+        rpc->upload.offset = 0;
+        rpc->upload.len = 0;
+        return 0;
     case MESSAGES_TOPIC_CASSETTE_SUBTOPIC_CLOSE:
         if (write->len != 1) {
-            return;
+            return 0;
         }
         if (*wbuf >= cassetteMax()) {
-            return;
+            return 0;
         }
         if (rpc->cassette == 0xff && rpc->fp == NULL) {
-            return;
+            return 0;
         }
         if (rpc->cassette != *wbuf) {
-            return;
+            return 0;
+        }
+        // commit: nothing is acknowledged as stored until the last block is flushed
+        if (!rpcUploadFlush(rpc)) {
+            (void)rpcUploadAbort(rpc);
+            return MESSAGES_ERROR_STORAGE;
+        }
+        (void)rpcUploadAbort(rpc);
+        offset = (uint32_t)(htonl(rpc->upload.offset));
+        (void)rpcSendData(rpc, write->req_id, write->topic, write->subtopic, MESSAGES_DATA_FLAG_END, 4, (void *)&offset);
+        return 0;
+    case MESSAGES_TOPIC_CASSETTE_SUBTOPIC_WRITE:
+        if (write->len == 2) {
+            // index | octet, from hosts that predate the offset form
+            if (rpc->fp == NULL || rpc->cassette != *wbuf) {
+                return 0;
+            }
+            (void)rpcUploadAppend(rpc, wbuf + 1, 1);
+            return 0;
+        }
+        return rpcCassetteWrite(rpc, wbuf, write->len);
+    default:
+        break;
+    }
+    return 0;
+}
+
+/* index | offset | octets, as many as fit in the frame or a WRITE_LONG */
+static int
+rpcCassetteWrite(rpc_t *rpc, const uint8_t *wbuf, size_t len)
+{
+    uint32_t offset;
+    uint32_t skip;
+    if (len < 6 || rpc->fp == NULL || rpc->cassette != *wbuf) {
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
+    }
+    (void)memcpy(&offset, wbuf + 1, 4);
+    offset = (uint32_t)(ntohl(offset));
+    if (offset > rpc->upload.offset) {
+        return MESSAGES_ERROR_BAD_OFFSET;
+    }
+    // a retransmission may overlap what was already taken, keep only what is new
+    len -= 5;
+    skip = rpc->upload.offset - offset;
+    if (skip >= len) {
+        return 0;
+    }
+    return rpcUploadAppend(rpc, wbuf + 5 + skip, len - skip);
+}
+
+/*
+ * Uploads go through a RAM block the size of a flash page, written out and
+ * flushed only when it fills or at CLOSE, instead of flushing every WRITE.
+ * upload.offset counts every octet taken, buffered or not.
+ */
+
+static int
+rpcUploadAppend(rpc_t *rpc, const uint8_t *buf, size_t len)
+{
+    rpcUpload_t *upload = &rpc->upload;
+    size_t n;
+    while (len > 0) {
+        n = RPC_UPLOAD_BLOCK - upload->len;
+        if (n > len) {
+            n = len;
+        }
+        (void)memcpy(upload->buf + upload->len, buf, n);
+        upload->len += (uint16_t)n;
+        upload->offset += (uint32_t)n;
+        buf += n;
+        len -= n;
+        if (upload->len == RPC_UPLOAD_BLOCK && !rpcUploadFlush(rpc)) {
+            (void)rpcUploadAbort(rpc);
+            return MESSAGES_ERROR_STORAGE;
         }
-        rpc->cassette = 0xff;
-        // uint8_t writeval = 0;
-        // (void)fwrite(&writeval, 1, 1, rpc->fp);
-        (void)fflush(rpc->fp);
+    }
+    return 0;
+}
+
+static bool
+rpcUploadFlush(rpc_t *rpc)
+{
+    rpcUpload_t *upload = &rpc->upload;
+    if (upload->len == 0) {
+        return true;
+    }
+    (void)sdAsynchronousWrite(rpc->fp, upload->buf, upload->len);
+    upload->len = 0;
+    return (fflush(rpc->fp) != EOF);
+}
+
+static void
+rpcUploadAbort(rpc_t *rpc)
+{
+    rpc->cassette = 0xff;
+    rpc->upload.len = 0;
+    if (rpc->fp != NULL) {
         (void)fclose(rpc->fp);
         rpc->fp = NULL;
-        return;
-    case MESSAGES_TOPIC_CASSETTE_SUBTOPIC_WRITE:
-        if (write->len == 1 || write->len > 2) {
-            return;
+    }
+    return;
+}
+
+/*
+ * Reading a cassette streams it as DATA chunks on the cassette's subtopic,
+ * ending with a DATA END carrying the offset reached, which is the file
+ * length.  rpcLoop() sends one chunk per pass, no bigger than the tx queue
+ * can take without blocking, so a download never stalls the server thread.
+ * A host that lost the link part way through can WRITE the READ subtopic
+ * with the cassette and the number of octets it got to continue from there.
+ * Hosts that take long messages get RPC_DOWNLOAD_BLOCK octets per DATA_LONG
+ * instead, still a FRAGMENT per pass, read from the file as they are sent.
+ */
+
+static int
+rpcDownloadStart(rpc_t *rpc, uint16_t req_id, uint8_t cassette, uint32_t offset, bool resume)
+{
+    rpcDownload_t *download = &rpc->download;
+    PROS_FILE *fp;
+    if (download->fp != NULL) {
+        if (!resume || download->cassette != cassette) {
+            return MESSAGES_ERROR_BUSY;
         }
-        if (*wbuf >= cassetteMax()) {
-            return;
+        // the host is resuming this download under a new req_id
+        (void)rpcDownloadStop(rpc);
+    }
+    fp = cassetteOpenRead(cassette);
+    if (fp == NULL) {
+        (void)rpcSendData(rpc, req_id, MESSAGES_TOPIC_CASSETTE, cassette, MESSAGES_DATA_FLAG_END, 0, NULL);
+        return 0;
+    }
+    if (offset != 0 && fseek(fp, (long int)offset, SEEK_SET) != 0) {
+        (void)fclose(fp);
+        return MESSAGES_ERROR_BAD_OFFSET;
+    }
+    download->fp = fp;
+    download->req_id = req_id;
+    download->cassette = cassette;
+    download->offset = offset;
+    download->total = 0;
+    download->sent = 0;
+    return 0;
+}
+
+static void
+rpcDownloadStep(rpc_t *rpc)
+{
+    rpcDownload_t *download = &rpc->download;
+    // a block already begun is finished as fragments even if the host renegotiated
+    bool fragments = (download->sent < download->total) || (rpc->features & MESSAGES_FEATURE_LONG);
+    size_t header = fragments ? MESSAGES_FRAGMENT_HEADER : RPC_DATA_HEADER;
+    size_t max = fragments ? RPC_FRAGMENT_MAX : RPC_DATA_MAX;
+    size_t space = max;
+    size_t len;
+    int avail;
+    uint32_t end;
+    if (download->fp == NULL) {
+        return;
+    }
+    if (rpc->writeSpace != NULL) {
+        space = rpc->writeSpace((void *)rpc);
+        space = (space > RPC_WIRE_SIZE(header)) ? (space - RPC_WIRE_SIZE(header)) / 2 : 0;
+        if (space > max) {
+            space = max;
         }
-        if (rpc->cassette == 0xff && rpc->fp == NULL) {
+    }
+    avail = fcount(download->fp);
+    if (avail > 0) {
+        if (space < RPC_DOWNLOAD_MIN) {
+            // let the link drain rather than send a runt chunk
             return;
         }
-        if (rpc->cassette != *wbuf) {
-            return;
+        if (fragments) {
+            len = rpcDownloadFragment(rpc, (size_t)avail, space);
+        } else {
+            len = ((size_t)avail < space) ? (size_t)avail : space;
+            len = fread(rpc->tmp, 1, len, download->fp);
+            if (len > 0) {
+                (void)rpcSendData(rpc, download->req_id, MESSAGES_TOPIC_CASSETTE, download->cassette, 0, (uint8_t)len,
+                                  (void *)rpc->tmp);
+            }
         }
-        wbuf += 1;
-        (void)sdAsynchronousWrite(rpc->fp, wbuf, write->len - 1);
-        // (void)fflush(rpc->fp);
-        // (void)fwrite(wbuf, 1, write->len - 1, rpc->fp);
-        if (fflush(rpc->fp) == EOF) {
-            rpc->cassette = 0xff;
-            (void)fclose(rpc->fp);
-            rpc->fp = NULL;
+        download->offset += (uint32_t)len;
+    }
+    if (feof(download->fp) && download->sent < download->total) {
+        // the file came up short of the DATA_LONG already begun, the host drops it with what follows
+        (void)rpcSendRepError(rpc, download->req_id, MESSAGES_TOPIC_CASSETTE, download->cassette, MESSAGES_ERROR_STORAGE);
+        (void)rpcDownloadStop(rpc);
+    } else if (feof(download->fp)) {
+        end = (uint32_t)(htonl(download->offset));
+        (void)rpcSendData(rpc, download->req_id, MESSAGES_TOPIC_CASSETTE, download->cassette, MESSAGES_DATA_FLAG_END, 4,
+                          (void *)&end);
+        (void)rpcDownloadStop(rpc);
+    }
+    return;
+}
+
+/* Send the next FRAGMENT of the block's DATA_LONG, beginning a block with its head when none is under way.  Returns the
+ * cassette octets sent. */
+static size_t
+rpcDownloadFragment(rpc_t *rpc, size_t avail, size_t space)
+{
+    rpcDownload_t *download = &rpc->download;
+    size_t head = 0;
+    size_t len;
+    if (download->sent == download->total) {
+        len = (avail < RPC_DOWNLOAD_BLOCK) ? avail : RPC_DOWNLOAD_BLOCK;
+        (void)message_data_long_frame(&rpc->out.msg.data_long, download->req_id, MESSAGES_TOPIC_CASSETTE, download->cassette, 0,
+                                      rpcTimestamp(rpc), (uint16_t)len, NULL);
+        if (message_serialize_head(&rpc->out.msg, rpc->tmp, sizeof(rpc->tmp), &head) != 0) {
+            return 0;
         }
-        return;
-    default:
-        break;
+        download->total = (uint16_t)(head + len);
+        download->sent = 0;
+    }
+    len = (size_t)(download->total - download->sent) - head;
+    if (len > space - head) {
+        len = space - head;
+    }
+    len = fread(rpc->tmp + head, 1, len, download->fp);
+    if (head + len == 0) {
+        return 0;
+    }
+    (void)message_fragment_frame(&rpc->out.msg.fragment, download->total, download->sent, (uint8_t)(head + len),
+                                 (void *)rpc->tmp);
+    (void)rpcSend(rpc, &rpc->out.msg);
+    download->sent = (uint16_t)(download->sent + head + len);
+    return len;
+}
+
+static void
+rpcDownloadStop(rpc_t *rpc)
+{
+    if (rpc->download.fp != NULL) {
+        (void)fclose(rpc->download.fp);
+        rpc->download.fp = NULL;
     }
+    rpc->download.total = 0;
+    rpc->download.sent = 0;
     return;
 }
 
+static int
+rpcSubValidate(rpc_t *rpc, const message_subscribe_t *subscribe)
+{
+    const rpcTopic_t *topic = rpcTopicFind(subscribe->topic);
+    if (subscribe->topic == MESSAGES_TOPIC_ALL) {
+        return (subscribe->subtopic == MESSAGES_TOPIC_ALL_SUBTOPIC_ALL) ? 0 : MESSAGES_ERROR_BAD_SUBTOPIC;
+    }
+    if (topic == NULL || topic->publish == NULL) {
+        return MESSAGES_ERROR_BAD_TOPIC;
+    }
+    if (topic->subscribe != NULL) {
+        return topic->subscribe(rpc, subscribe);
+    }
+    if (subscribe->subtopic < topic->count || subscribe->subtopic == topic->all) {
+        return 0;
+    }
+    return MESSAGES_ERROR_BAD_SUBTOPIC;
+}
+
 static void
 rpcRecvSubscribe(rpc_t *rpc, const message_subscribe_t *subscribe)
 {
-    rpcSubscription_t tmp = {.active = 1, .req_id = subscribe->req_id, .topic = subscribe->topic, .subtopic = subscribe->subtopic};
+    rpcSubscription_t tmp = {.active = 1, .req_id = subscribe->req_id, .topic = subscribe->topic, .subtopic = subscribe->subtopic,
+                             .due = RPC_DUE_NONE, .period = subscribe->period, .next = chTimeNow()};
     rpcSubscription_t *sub = NULL;
+    int error;
+    if (tmp.period == 0) {
+        tmp.period = RPC_PUB_TIMEOUT;
+    } else if (tmp.period < RPC_PUB_PERIOD_MIN) {
+        tmp.period = RPC_PUB_PERIOD_MIN;
+    } else if (tmp.period > RPC_PUB_PERIOD_MAX) {
+        tmp.period = RPC_PUB_PERIOD_MAX;
+    }
+    (void)rpcSessionBegin(rpc);
     if (rpcSubFind(rpc, subscribe->req_id, NULL) != 0) {
-        sub = &tmp;
-        (void)rpcSendPubError(rpc, sub, MESSAGES_ERROR_BAD_REQ_ID);
+        (void)rpcSendPubError(rpc, &tmp, MESSAGES_ERROR_BAD_REQ_ID);
+        return;
     }
-    if (rpcSubFree(rpc, &sub) == 0) {
-        sub = &tmp;
-        (void)rpcSendPubError(rpc, sub, MESSAGES_ERROR_SUB_MAX);
+    error = rpcSubValidate(rpc, subscribe);
+    if (error != 0) {
+        (void)rpcSendPubError(rpc, &tmp, (uint8_t)error);
         return;
     }
-    (void)memcpy(sub, &tmp, sizeof(rpcSubscription_t));
+    sub = rpcSubAlloc(rpc, subscribe->req_id);
+    if (sub == NULL) {
+        (void)rpcSendPubError(rpc, &tmp, MESSAGES_ERROR_SUB_MAX);
+        return;
+    }
+    sub->topic = tmp.topic;
+    sub->subtopic = tmp.subtopic;
+    sub->period = tmp.period;
+    sub->next = tmp.next;
+    // the first publish always goes out, later ones only when they pass the filters
+    sub->flags = RPC_SUB_FLAG_FORCE;
+    sub->published = tmp.next;
+    if (subscribe->options & MESSAGES_SUBSCRIBE_OPTIONS) {
+        sub->flags |= RPC_SUB_FLAG_DEADBAND;
+        sub->deadband = subscribe->deadband;
+        sub->minInterval = subscribe->min_interval;
+        sub->maxInterval = subscribe->max_interval;
+    }
+    (void)rpcDuePush(rpc, sub);
     return;
 }
 
@@ -735,47 +1322,209 @@ rpcRecvUnsubscribe(rpc_t *rpc, const message_unsubscribe_t *unsubscribe)
 {
     uint8_t flag = (MESSAGES_DATA_FLAG_PUB | MESSAGES_DATA_FLAG_END);
     rpcSubscription_t tmp = {
-        .active = 1, .req_id = unsubscribe->req_id, .topic = MESSAGES_TOPIC_ALL, .subtopic = MESSAGES_TOPIC_ALL_SUBTOPIC_ALL};
+        .active = 1,
+        .req_id = unsubscribe->req_id,
+        .topic = MESSAGES_TOPIC_ALL,
+        .subtopic = MESSAGES_TOPIC_ALL_SUBTOPIC_ALL,
+        .due = RPC_DUE_NONE};
     rpcSubscription_t *sub = NULL;
+    (void)rpcSessionBegin(rpc);
     if (rpcSubFind(rpc, unsubscribe->req_id, &sub) == 0) {
         sub = &tmp;
         (void)rpcSendPubError(rpc, sub, MESSAGES_ERROR_BAD_REQ_ID);
+        (void)rpcSendData(rpc, sub->req_id, sub->topic, sub->subtopic, flag, 0, NULL);
+        return;
     }
     (void)rpcSendData(rpc, sub->req_id, sub->topic, sub->subtopic, flag, 0, NULL);
-    (void)rpcSubReset(sub);
+    (void)rpcSubReset(rpc, sub);
     return;
 }
 
 int
 rpcSend(rpc_t *rpc, const message_any_t *message)
 {
-    if (rpc->writePacket == NULL) {
+    if (rpc->writePacket == NULL && rpc->writeReserve == NULL) {
         return -1;
     }
     int retval;
     size_t outlen;
-    retval = message_serialize(message, rpc->out.buf, SFP_CONFIG_MAX_PACKET_SIZE, &outlen);
-    if (retval == 0) {
-        (void)rpc->writePacket(rpc->out.buf, outlen, NULL, (void *)rpc);
+    if (rpc->writeReserve != NULL) {
+        // straight into the transmitter's history, which only escaping reads again
+        retval = message_serialize(message, rpc->writeReserve((void *)rpc), SFP_CONFIG_MAX_PACKET_SIZE, &outlen);
+        (void)rpc->writeCommit((retval == 0) ? outlen : 0, NULL, (void *)rpc);
+    } else {
+        retval = message_serialize(message, rpc->out.buf, SFP_CONFIG_MAX_PACKET_SIZE, &outlen);
+        if (retval == 0) {
+            (void)rpc->writePacket(rpc->out.buf, outlen, NULL, (void *)rpc);
+        }
+    }
+    if (retval == 0 && rpc->rxstamp != 0) {
+        // first reply to the frame being handled
+        (void)histogramRecord(&rpc->reply, (uint32_t)micros() - rpc->rxstamp);
+        rpc->rxstamp = 0;
     }
     return retval;
 }
 
 static int
-rpcSendData(rpc_t *rpc, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag, uint8_t len, uint8_t *value)
+rpcRecvWriteLatency(rpc_t *rpc, const message_write_t *write)
 {
-    (void)message_data_frame(&rpc->out.msg.data, req_id, topic, subtopic, flag, (uint32_t)(chTimeElapsedSince(rpc->timestamp)), len,
-                             value);
-    return rpcSend(rpc, &rpc->out.msg);
+    switch (write->subtopic) {
+    case MESSAGES_TOPIC_LATENCY_SUBTOPIC_RESET:
+        (void)histogramReset(&rpc->rtt);
+        (void)histogramReset(&rpc->reply);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      The clock DATA timestamps are in.                              */
+/** @param[in]  rpc The session                                               */
+/** @returns    Milliseconds into the session, or the host's own microsecond   */
+/**             clock if it negotiated MESSAGES_FEATURE_MICROS                 */
+/*-----------------------------------------------------------------------------*/
+uint32_t
+rpcTimestamp(rpc_t *rpc)
+{
+    if (rpc->features & MESSAGES_FEATURE_MICROS) {
+        return clocksyncRemote(&rpc->clock, (uint32_t)micros());
+    }
+    return (uint32_t)(chTimeElapsedSince(rpc->timestamp));
 }
 
+/* One DATA frame, compact if the host negotiated it. */
 static int
+rpcSendDataFrame(rpc_t *rpc, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag, uint32_t timestamp, uint8_t len,
+                 uint8_t *value)
+{
+    int retval;
+    if (!(rpc->features & MESSAGES_FEATURE_DATA_COMPACT)) {
+        (void)message_data_frame(&rpc->out.msg.data, req_id, topic, subtopic, flag, timestamp, len, value);
+        return rpcSend(rpc, &rpc->out.msg);
+    }
+    (void)message_data_compact_frame(&rpc->out.msg.compact, req_id, topic, subtopic, flag, timestamp - rpc->compactStamp, len,
+                                     value);
+    retval = rpcSend(rpc, &rpc->out.msg);
+    if (retval == 0) {
+        rpc->compactStamp = timestamp;
+    }
+    return retval;
+}
+
+int
+rpcSendData(rpc_t *rpc, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t flag, uint8_t len, uint8_t *value)
+{
+    size_t offset;
+    if (rpc->batching) {
+        offset = message_record_append(rpc->batch, RPC_BATCH_MAX, rpc->batchLen, req_id, topic, subtopic, flag, len, value);
+        if (offset == 0 && rpc->batchLen > 0) {
+            (void)rpcBatchEnd(rpc);
+            (void)rpcBatchBegin(rpc);
+            offset = message_record_append(rpc->batch, RPC_BATCH_MAX, rpc->batchLen, req_id, topic, subtopic, flag, len, value);
+        }
+        if (offset != 0) {
+            rpc->batchLen = (uint8_t)offset;
+            return 0;
+        }
+        // too big to ever share a frame, send it on its own
+    }
+    return rpcSendDataFrame(rpc, req_id, topic, subtopic, flag, rpcTimestamp(rpc), len, value);
+}
+
+int
 rpcSendPub(rpc_t *rpc, rpcSubscription_t *sub, uint8_t len, uint8_t *value)
 {
     uint8_t flag = (MESSAGES_DATA_FLAG_PUB);
+    sub->flags |= RPC_SUB_FLAG_SENT;
     return rpcSendData(rpc, sub->req_id, sub->topic, sub->subtopic, flag, len, value);
 }
 
+/*-----------------------------------------------------------------------------*/
+/** @brief      Whether a value has moved far enough to publish.               */
+/** @param[in]  sub The subscription being published                          */
+/** @param[in]  index Which of the subscription's values, from 0              */
+/** @param[in]  value The value as it is now                                  */
+/** @returns    true if it should be sent                                      */
+/*-----------------------------------------------------------------------------*/
+bool
+rpcSubChanged(const rpcSubscription_t *sub, uint8_t index, int32_t value)
+{
+    const rpcTopic_t *topic;
+    unsigned int slot = (unsigned int)sub->base + index;
+    uint32_t threshold = sub->deadband;
+    uint32_t delta;
+    if ((sub->flags & RPC_SUB_FLAG_FORCE) || slot >= RPC_SUB_VALUES) {
+        return true;
+    }
+    if (!(sub->flags & RPC_SUB_FLAG_DEADBAND)) {
+        topic = rpcTopicFind(sub->topic);
+        threshold = (topic != NULL && (topic->flags & RPC_TOPIC_FLAG_CHANGES)) ? 1 : 0;
+    }
+    // modular, so clocks and counters that wrap still compare by distance
+    delta = (uint32_t)value - (uint32_t)sub->last[slot];
+    if ((int32_t)delta < 0) {
+        delta = (uint32_t)0 - delta;
+    }
+    return delta >= threshold;
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Record a value that is being published.                        */
+/** @param[in]  sub The subscription being published                          */
+/** @param[in]  index Which of the subscription's values, from 0              */
+/** @param[in]  value The value being sent                                    */
+/*-----------------------------------------------------------------------------*/
+void
+rpcSubRemember(rpcSubscription_t *sub, uint8_t index, int32_t value)
+{
+    unsigned int slot = (unsigned int)sub->base + index;
+    if (slot < RPC_SUB_VALUES) {
+        sub->last[slot] = value;
+    }
+}
+
+/* Start collecting DATA records into one DATA_MULTI, if the host negotiated it. */
+static void
+rpcBatchBegin(rpc_t *rpc)
+{
+    if (!(rpc->features & MESSAGES_FEATURE_DATA_MULTI)) {
+        return;
+    }
+    rpc->batching = true;
+    rpc->batchLen = 0;
+    rpc->batchStamp = rpcTimestamp(rpc);
+}
+
+/* Send whatever records were collected and go back to one DATA per record. */
+static void
+rpcBatchEnd(rpc_t *rpc)
+{
+    message_data_multi_t multi;
+    message_record_t record;
+    size_t offset = 0;
+    if (!rpc->batching) {
+        return;
+    }
+    rpc->batching = false;
+    if (rpc->batchLen == 0) {
+        return;
+    }
+    if ((rpc->features & MESSAGES_FEATURE_DATA_COMPACT) && rpc->batchLen == MESSAGES_DATA_MULTI_RECORD + rpc->batch[5]) {
+        // a lone record is smaller as a DATA_COMPACT of its own
+        (void)message_data_multi_frame(&multi, rpc->batchStamp, rpc->batchLen, rpc->batch);
+        (void)message_record_next(&multi, &offset, &record);
+        (void)rpcSendDataFrame(rpc, record.req_id, record.topic, record.subtopic, record.flag, rpc->batchStamp, record.len,
+                               record.value);
+    } else {
+        (void)message_data_multi_frame(&rpc->out.msg.multi, rpc->batchStamp, rpc->batchLen, rpc->batch);
+        (void)rpcSend(rpc, &rpc->out.msg);
+    }
+    rpc->batchLen = 0;
+}
+
 static int
 rpcSendPubError(rpc_t *rpc, rpcSubscription_t *sub, uint8_t error)
 {
@@ -783,63 +1532,270 @@ rpcSendPubError(rpc_t *rpc, rpcSubscription_t *sub, uint8_t error)
     return rpcSendData(rpc, sub->req_id, sub->topic, sub->subtopic, flag, 1, (void *)&error);
 }
 
-static int
+int
 rpcSendRep(rpc_t *rpc, const message_read_t *read, uint8_t len, uint8_t *value)
 {
     uint8_t flag = (MESSAGES_DATA_FLAG_END);
     return rpcSendData(rpc, read->req_id, read->topic, read->subtopic, flag, len, value);
 }
 
-static int
+int
 rpcSendRepError(rpc_t *rpc, uint16_t req_id, uint8_t topic, uint8_t subtopic, uint8_t error)
 {
     uint8_t flag = (MESSAGES_DATA_FLAG_ERROR | MESSAGES_DATA_FLAG_END);
     return rpcSendData(rpc, req_id, topic, subtopic, flag, 1, (void *)&error);
 }
 
-static int
-rpcSubFind(rpc_t *rpc, uint16_t req_id, rpcSubscription_t **subp)
+/*
+ * Subscriptions live in a fixed pool.  Free entries are chained through
+ * `link` into a free list, and active ones are chained through the same
+ * field into buckets of a hash on req_id, so allocation, lookup and release
+ * do not scan the pool.
+ */
+
+static void
+rpcSubInit(rpc_t *rpc)
 {
     int i;
     for (i = 0; i < RPC_SUB_MAX; i++) {
-        if (rpc->subs[i].active && rpc->subs[i].req_id == req_id) {
-            if (subp != NULL) {
-                *subp = &rpc->subs[i];
-                return 1;
-            }
-        }
+        (void)memset(&rpc->subs[i], 0, sizeof(rpcSubscription_t));
+        rpc->subs[i].due = RPC_DUE_NONE;
+        rpc->subs[i].link = (i + 1 < RPC_SUB_MAX) ? (uint8_t)(i + 1) : RPC_SUB_NONE;
     }
-    if (subp != NULL) {
-        *subp = NULL;
+    for (i = 0; i < RPC_SUB_HASH; i++) {
+        rpc->subHash[i] = RPC_SUB_NONE;
     }
-    return 0;
+    rpc->subFree = 0;
+    rpc->subCount = 0;
+    rpc->dueCount = 0;
+}
+
+static inline uint8_t *
+rpcSubBucket(rpc_t *rpc, uint16_t req_id)
+{
+    // hosts hand out req_ids sequentially, so the low bits spread well
+    return &rpc->subHash[req_id & (RPC_SUB_HASH - 1)];
 }
 
 static int
-rpcSubFree(rpc_t *rpc, rpcSubscription_t **subp)
+rpcSubFind(rpc_t *rpc, uint16_t req_id, rpcSubscription_t **subp)
 {
-    int i;
-    int nextCnt = 0;
-    rpcSubscription_t *nextSub = NULL;
-    for (i = 0; i < RPC_SUB_MAX; i++) {
-        if (!rpc->subs[i].active) {
-            if (nextSub == NULL) {
-                nextSub = &rpc->subs[i];
-            }
-            nextCnt++;
-        }
+    uint8_t i = *rpcSubBucket(rpc, req_id);
+    while (i != RPC_SUB_NONE && rpc->subs[i].req_id != req_id) {
+        i = rpc->subs[i].link;
     }
     if (subp != NULL) {
-        *subp = nextSub;
+        *subp = (i == RPC_SUB_NONE) ? NULL : &rpc->subs[i];
+    }
+    return (i != RPC_SUB_NONE);
+}
+
+static rpcSubscription_t *
+rpcSubAlloc(rpc_t *rpc, uint16_t req_id)
+{
+    uint8_t *bucket = rpcSubBucket(rpc, req_id);
+    uint8_t i = rpc->subFree;
+    rpcSubscription_t *sub;
+    if (i == RPC_SUB_NONE) {
+        return NULL;
     }
-    return nextCnt;
+    sub = &rpc->subs[i];
+    rpc->subFree = sub->link;
+    sub->active = 1;
+    sub->req_id = req_id;
+    sub->link = *bucket;
+    *bucket = i;
+    rpc->subCount++;
+    return sub;
 }
 
 static void
-rpcSubReset(rpcSubscription_t *sub)
+rpcSubReset(rpc_t *rpc, rpcSubscription_t *sub)
 {
+    uint8_t index = (uint8_t)(sub - rpc->subs);
+    uint8_t *link;
+    if (!sub->active) {
+        return;
+    }
+    (void)rpcDueRemove(rpc, sub);
+    link = rpcSubBucket(rpc, sub->req_id);
+    while (*link != index) {
+        link = &rpc->subs[*link].link;
+    }
+    *link = sub->link;
     sub->active = 0;
     sub->req_id = 0;
     sub->topic = 0;
     sub->subtopic = 0;
+    sub->period = 0;
+    sub->flags = 0;
+    sub->deadband = 0;
+    sub->minInterval = 0;
+    sub->maxInterval = 0;
+    sub->link = rpc->subFree;
+    rpc->subFree = index;
+    rpc->subCount--;
+}
+
+/*
+ * The subscriptions waiting to publish are kept in a binary min-heap ordered
+ * by their next deadline, so rpcLoop() only ever looks at the ones that are
+ * due.  Each subscription remembers its position in the heap for removal.
+ */
+
+static inline bool
+rpcDueBefore(rpc_t *rpc, uint8_t a, uint8_t b)
+{
+    return (int32_t)(rpc->subs[rpc->due[a]].next - rpc->subs[rpc->due[b]].next) < 0;
+}
+
+static void
+rpcDueSwap(rpc_t *rpc, uint8_t a, uint8_t b)
+{
+    uint8_t index = rpc->due[a];
+    rpc->due[a] = rpc->due[b];
+    rpc->due[b] = index;
+    rpc->subs[rpc->due[a]].due = a;
+    rpc->subs[rpc->due[b]].due = b;
+}
+
+static void
+rpcDueUp(rpc_t *rpc, uint8_t pos)
+{
+    uint8_t parent;
+    while (pos > 0) {
+        parent = (uint8_t)((pos - 1) / 2);
+        if (!rpcDueBefore(rpc, pos, parent)) {
+            break;
+        }
+        (void)rpcDueSwap(rpc, pos, parent);
+        pos = parent;
+    }
+}
+
+static void
+rpcDueDown(rpc_t *rpc, uint8_t pos)
+{
+    uint8_t child;
+    uint8_t least;
+    for (;;) {
+        least = pos;
+        child = (uint8_t)(2 * pos + 1);
+        if (child < rpc->dueCount && rpcDueBefore(rpc, child, least)) {
+            least = child;
+        }
+        child++;
+        if (child < rpc->dueCount && rpcDueBefore(rpc, child, least)) {
+            least = child;
+        }
+        if (least == pos) {
+            break;
+        }
+        (void)rpcDueSwap(rpc, pos, least);
+        pos = least;
+    }
+}
+
+static void
+rpcDuePush(rpc_t *rpc, rpcSubscription_t *sub)
+{
+    uint8_t pos = rpc->dueCount++;
+    rpc->due[pos] = (uint8_t)(sub - rpc->subs);
+    sub->due = pos;
+    (void)rpcDueUp(rpc, pos);
+}
+
+static void
+rpcDueRemove(rpc_t *rpc, rpcSubscription_t *sub)
+{
+    uint8_t pos = sub->due;
+    if (pos == RPC_DUE_NONE) {
+        return;
+    }
+    sub->due = RPC_DUE_NONE;
+    rpc->dueCount--;
+    if (pos == rpc->dueCount) {
+        return;
+    }
+    rpc->due[pos] = rpc->due[rpc->dueCount];
+    rpc->subs[rpc->due[pos]].due = pos;
+    (void)rpcDueUp(rpc, pos);
+    (void)rpcDueDown(rpc, rpc->subs[rpc->due[pos]].due);
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Attach a freshly connected host to the session.                */
+/** @param[in]  rpc The rpc context                                            */
+/*-----------------------------------------------------------------------------*/
+void
+rpcSessionAttach(rpc_t *rpc)
+{
+    // features are negotiated per connection
+    rpc->features = 0;
+    if (rpc->session == rpcSessionStateDetached && rpc->token != 0 && chTimeElapsedSince(rpc->detached) <= RPC_SESSION_GRACE) {
+        // keep subscriptions and cassette parked until the host resumes or gives up
+        rpc->session = rpcSessionStatePending;
+        (void)rpcSessionAnnounce(rpc, MESSAGES_SESSION_RESUMABLE);
+        return;
+    }
+    (void)rpcSessionReset(rpc);
+    return;
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Park the session after the host connection was lost.           */
+/** @param[in]  rpc The rpc context                                            */
+/*-----------------------------------------------------------------------------*/
+void
+rpcSessionDetach(rpc_t *rpc)
+{
+    if (rpc->session == rpcSessionStateActive) {
+        rpc->detached = chTimeNow();
+        rpc->session = rpcSessionStateDetached;
+    } else if (rpc->session == rpcSessionStatePending) {
+        rpc->session = rpcSessionStateDetached;
+    }
+    return;
+}
+
+static void
+rpcSessionAnnounce(rpc_t *rpc, uint8_t state)
+{
+    uint32_t token = (uint32_t)(htonl(rpc->token));
+    (void)memcpy(rpc->tmp, &token, 4);
+    (void)memcpy(rpc->tmp + 4, &state, 1);
+    (void)message_info_frame(&rpc->out.msg.info, MESSAGES_TOPIC_SESSION, MESSAGES_TOPIC_SESSION_SUBTOPIC_TOKEN, 5,
+                             (void *)rpc->tmp);
+    (void)rpcSend(rpc, &rpc->out.msg);
+    return;
+}
+
+static void
+rpcSessionReset(rpc_t *rpc)
+{
+    int i;
+    uint32_t token;
+    for (i = 0; i < RPC_SUB_MAX; i++) {
+        (void)rpcSubReset(rpc, &rpc->subs[i]);
+    }
+    (void)rpcUploadAbort(rpc);
+    (void)rpcDownloadStop(rpc);
+    do {
+        token = (uint32_t)micros() ^ (rpc->token * 2654435761UL);
+    } while (token == 0 || token == rpc->token);
+    rpc->token = token;
+    rpc->timestamp = chTimeNow();
+    rpc->session = rpcSessionStateActive;
+    (void)rpcSessionAnnounce(rpc, MESSAGES_SESSION_NEW);
+    return;
+}
+
+/* Any stateful request from the host while a session is pending means it chose to start over. */
+static void
+rpcSessionBegin(rpc_t *rpc)
+{
+    if (rpc->session == rpcSessionStatePending) {
+        (void)rpcSessionReset(rpc);
+    }
+    return;
 }
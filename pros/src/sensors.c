@@ -0,0 +1,417 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*-----------------------------------------------------------------------------*/
+/** @file    sensors.c                                                         */
+/** @brief   Fixed rate sensor sampling and the sensor topics served from it   */
+/*-----------------------------------------------------------------------------*/
+
+#include "sensors.h"
+#include "portable_endian.h"
+#include "rpc.h"
+
+#include <string.h>
+
+/* The task samples into the buffer the readers are not using and then bumps
+ * seq.  `writing` is bumped before a buffer is touched, so a reader that
+ * copied buf[seq & 1] knows the copy is whole while writing - seq < 2. */
+typedef struct sensors_s {
+    TaskHandle task;
+    volatile uint32_t seq;
+    volatile uint32_t writing;
+    sensorsSnapshot_t buf[2];
+    Encoder encoder[SENSORS_ENCODER_MAX];
+    Gyro gyro[SENSORS_GYRO_MAX];
+    Ultrasonic ultrasonic[SENSORS_ULTRASONIC_MAX];
+    int32_t ime[SENSORS_IME_MAX];
+    uint8_t encoders;
+    uint8_t gyros;
+    uint8_t imes;
+    uint8_t ultrasonics;
+} sensors_t;
+
+static sensors_t sensors;
+
+static int sensorsRead(rpc_t *rpc, const message_read_t *read);
+static int sensorsPublish(rpc_t *rpc, rpcSubscription_t *sub);
+static int sensorsSubscribe(rpc_t *rpc, const message_subscribe_t *subscribe);
+
+static const rpcTopic_t sensorsTopics[] = {
+    {.topic = MESSAGES_TOPIC_ANALOG,
+     .count = SENSORS_ANALOG_MAX,
+     .all = MESSAGES_TOPIC_ANALOG_SUBTOPIC_ALL,
+     .read = sensorsRead,
+     .publish = sensorsPublish,
+     .subscribe = sensorsSubscribe},
+    {.topic = MESSAGES_TOPIC_DIGITAL,
+     .count = SENSORS_DIGITAL_MAX,
+     .all = MESSAGES_TOPIC_DIGITAL_SUBTOPIC_ALL,
+     .read = sensorsRead,
+     .publish = sensorsPublish,
+     .subscribe = sensorsSubscribe},
+    {.topic = MESSAGES_TOPIC_ENCODER,
+     .count = SENSORS_ENCODER_MAX,
+     .all = MESSAGES_TOPIC_ENCODER_SUBTOPIC_ALL,
+     .read = sensorsRead,
+     .publish = sensorsPublish,
+     .subscribe = sensorsSubscribe},
+    {.topic = MESSAGES_TOPIC_GYRO,
+     .count = SENSORS_GYRO_MAX,
+     .all = MESSAGES_TOPIC_GYRO_SUBTOPIC_ALL,
+     .read = sensorsRead,
+     .publish = sensorsPublish,
+     .subscribe = sensorsSubscribe},
+    {.topic = MESSAGES_TOPIC_IME,
+     .count = SENSORS_IME_MAX,
+     .all = MESSAGES_TOPIC_IME_SUBTOPIC_ALL,
+     .read = sensorsRead,
+     .publish = sensorsPublish,
+     .subscribe = sensorsSubscribe},
+    {.topic = MESSAGES_TOPIC_ULTRASONIC,
+     .count = SENSORS_ULTRASONIC_MAX,
+     .all = MESSAGES_TOPIC_ULTRASONIC_SUBTOPIC_ALL,
+     .read = sensorsRead,
+     .publish = sensorsPublish,
+     .subscribe = sensorsSubscribe},
+};
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Register the sensor topics with rpc.                           */
+/*-----------------------------------------------------------------------------*/
+void
+sensorsInit(void)
+{
+    size_t i;
+    for (i = 0; i < sizeof(sensorsTopics) / sizeof(sensorsTopics[0]); i++) {
+        (void)rpcTopicRegister(&sensorsTopics[i]);
+    }
+}
+
+static void
+sensorsSample(sensorsSnapshot_t *snapshot)
+{
+    uint8_t i;
+    int value;
+    snapshot->stamp = (uint32_t)millis();
+    snapshot->digital = 0;
+    for (i = 0; i < SENSORS_DIGITAL_MAX; i++) {
+        if (digitalRead((unsigned char)(i + 1))) {
+            snapshot->digital |= (uint16_t)(1 << i);
+        }
+    }
+    for (i = 0; i < SENSORS_ANALOG_MAX; i++) {
+        snapshot->analog[i] = (uint16_t)analogRead((unsigned char)(i + 1));
+    }
+    for (i = 0; i < sensors.encoders; i++) {
+        snapshot->encoder[i] = (int32_t)encoderGet(sensors.encoder[i]);
+    }
+    for (i = 0; i < sensors.gyros; i++) {
+        snapshot->gyro[i] = (int16_t)gyroGet(sensors.gyro[i]);
+    }
+    for (i = 0; i < sensors.imes; i++) {
+        // a failed I2C read keeps the last good count
+        if (imeGet((unsigned char)i, &value)) {
+            sensors.ime[i] = (int32_t)value;
+        }
+        snapshot->ime[i] = sensors.ime[i];
+    }
+    for (i = 0; i < sensors.ultrasonics; i++) {
+        snapshot->ultrasonic[i] = (int16_t)ultrasonicGet(sensors.ultrasonic[i]);
+    }
+    snapshot->encoders = sensors.encoders;
+    snapshot->gyros = sensors.gyros;
+    snapshot->imes = sensors.imes;
+    snapshot->ultrasonics = sensors.ultrasonics;
+}
+
+static void
+sensorsTask(void *ignore)
+{
+    (void)ignore;
+    unsigned long wake = millis();
+    uint32_t next;
+    for (;;) {
+        next = sensors.seq + 1;
+        sensors.writing = next;
+        __sync_synchronize();
+        (void)sensorsSample(&sensors.buf[next & 1]);
+        __sync_synchronize();
+        sensors.seq = next;
+        (void)taskDelayUntil(&wake, SENSORS_PERIOD);
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Start sampling, call once the sensors have been added.         */
+/*-----------------------------------------------------------------------------*/
+void
+sensorsStart(void)
+{
+    if (sensors.task != NULL) {
+        return;
+    }
+    sensors.task = taskCreate(sensorsTask, TASK_DEFAULT_STACK_SIZE, NULL, TASK_PRIORITY_DEFAULT + 1);
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Sample an encoder, its subtopic is the returned index.         */
+/** @param[in]  encoder The encoder from encoderInit()                         */
+/** @returns    The subtopic or -1 when all slots are taken                    */
+/*-----------------------------------------------------------------------------*/
+int
+sensorsAddEncoder(Encoder encoder)
+{
+    if (sensors.encoders >= SENSORS_ENCODER_MAX) {
+        return -1;
+    }
+    sensors.encoder[sensors.encoders] = encoder;
+    return sensors.encoders++;
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Sample a gyro, its subtopic is the returned index.             */
+/** @param[in]  gyro The gyro from gyroInit()                                  */
+/** @returns    The subtopic or -1 when all slots are taken                    */
+/*-----------------------------------------------------------------------------*/
+int
+sensorsAddGyro(Gyro gyro)
+{
+    if (sensors.gyros >= SENSORS_GYRO_MAX) {
+        return -1;
+    }
+    sensors.gyro[sensors.gyros] = gyro;
+    return sensors.gyros++;
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Sample an ultrasonic, its subtopic is the returned index.      */
+/** @param[in]  ultrasonic The sensor from ultrasonicInit()                    */
+/** @returns    The subtopic or -1 when all slots are taken                    */
+/*-----------------------------------------------------------------------------*/
+int
+sensorsAddUltrasonic(Ultrasonic ultrasonic)
+{
+    if (sensors.ultrasonics >= SENSORS_ULTRASONIC_MAX) {
+        return -1;
+    }
+    sensors.ultrasonic[sensors.ultrasonics] = ultrasonic;
+    return sensors.ultrasonics++;
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Sample the IMEs at addresses 0..count-1.                       */
+/** @param[in]  count The chain length from imeInitializeAll()                 */
+/*-----------------------------------------------------------------------------*/
+void
+sensorsSetImeCount(unsigned int count)
+{
+    sensors.imes = (uint8_t)((count > SENSORS_IME_MAX) ? SENSORS_IME_MAX : count);
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Copy the latest complete sample without touching the hardware. */
+/** @param[out] snapshot Where to copy it                                      */
+/*-----------------------------------------------------------------------------*/
+void
+sensorsSnapshot(sensorsSnapshot_t *snapshot)
+{
+    uint32_t seq;
+    do {
+        seq = sensors.seq;
+        __sync_synchronize();
+        (void)memcpy(snapshot, &sensors.buf[seq & 1], sizeof(sensorsSnapshot_t));
+        __sync_synchronize();
+    } while (sensors.writing - seq > 1);
+}
+
+static uint8_t
+sensorsCount(uint8_t topic, const sensorsSnapshot_t *snapshot)
+{
+    switch (topic) {
+    case MESSAGES_TOPIC_ANALOG:
+        return SENSORS_ANALOG_MAX;
+    case MESSAGES_TOPIC_DIGITAL:
+        return SENSORS_DIGITAL_MAX;
+    case MESSAGES_TOPIC_ENCODER:
+        return snapshot->encoders;
+    case MESSAGES_TOPIC_GYRO:
+        return snapshot->gyros;
+    case MESSAGES_TOPIC_IME:
+        return snapshot->imes;
+    case MESSAGES_TOPIC_ULTRASONIC:
+        return snapshot->ultrasonics;
+    default:
+        return 0;
+    }
+}
+
+static uint8_t
+sensorsEncodeOne(uint8_t topic, uint8_t index, const sensorsSnapshot_t *snapshot, uint8_t *buf)
+{
+    uint16_t value16;
+    uint32_t value32;
+    switch (topic) {
+    case MESSAGES_TOPIC_ANALOG:
+        value16 = (uint16_t)(htons(snapshot->analog[index]));
+        (void)memcpy(buf, &value16, 2);
+        return 2;
+    case MESSAGES_TOPIC_DIGITAL:
+        buf[0] = (uint8_t)((snapshot->digital >> index) & 1);
+        return 1;
+    case MESSAGES_TOPIC_ENCODER:
+        value32 = (uint32_t)(htonl((uint32_t)snapshot->encoder[index]));
+        (void)memcpy(buf, &value32, 4);
+        return 4;
+    case MESSAGES_TOPIC_GYRO:
+        value16 = (uint16_t)(htons((uint16_t)snapshot->gyro[index]));
+        (void)memcpy(buf, &value16, 2);
+        return 2;
+    case MESSAGES_TOPIC_IME:
+        value32 = (uint32_t)(htonl((uint32_t)snapshot->ime[index]));
+        (void)memcpy(buf, &value32, 4);
+        return 4;
+    case MESSAGES_TOPIC_ULTRASONIC:
+        value16 = (uint16_t)(htons((uint16_t)snapshot->ultrasonic[index]));
+        (void)memcpy(buf, &value16, 2);
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+static int32_t
+sensorsValueAt(uint8_t topic, uint8_t index, const sensorsSnapshot_t *snapshot)
+{
+    switch (topic) {
+    case MESSAGES_TOPIC_ANALOG:
+        return (int32_t)snapshot->analog[index];
+    case MESSAGES_TOPIC_DIGITAL:
+        return (int32_t)((snapshot->digital >> index) & 1);
+    case MESSAGES_TOPIC_ENCODER:
+        return snapshot->encoder[index];
+    case MESSAGES_TOPIC_GYRO:
+        return (int32_t)snapshot->gyro[index];
+    case MESSAGES_TOPIC_IME:
+        return snapshot->ime[index];
+    case MESSAGES_TOPIC_ULTRASONIC:
+        return (int32_t)snapshot->ultrasonic[index];
+    default:
+        return 0;
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      One value of a snapshot by sensor topic and subtopic.          */
+/** @param[in]  snapshot A snapshot from sensorsSnapshot()                     */
+/** @param[in]  topic A MESSAGES_TOPIC_* sensor topic                          */
+/** @param[in]  index The subtopic                                             */
+/** @param[out] value The value, digital ports read 0 or 1                     */
+/** @returns    false if the snapshot has no such value                        */
+/*-----------------------------------------------------------------------------*/
+bool
+sensorsValue(const sensorsSnapshot_t *snapshot, uint8_t topic, uint8_t index, int32_t *value)
+{
+    if (index >= sensorsCount(topic, snapshot)) {
+        return false;
+    }
+    *value = sensorsValueAt(topic, index, snapshot);
+    return true;
+}
+
+/* ALL is sent whole, so any one value passing the subscription's filter sends
+ * them all and every value is remembered as sent. */
+static bool
+sensorsChanged(rpcSubscription_t *sub, const sensorsSnapshot_t *snapshot)
+{
+    uint8_t count = sensorsCount(sub->topic, snapshot);
+    uint8_t i;
+    bool changed = false;
+    if (sub->subtopic < count) {
+        if (!rpcSubChanged(sub, 0, sensorsValueAt(sub->topic, sub->subtopic, snapshot))) {
+            return false;
+        }
+        (void)rpcSubRemember(sub, 0, sensorsValueAt(sub->topic, sub->subtopic, snapshot));
+        return true;
+    }
+    for (i = 0; i < count && !changed; i++) {
+        changed = rpcSubChanged(sub, i, sensorsValueAt(sub->topic, i, snapshot));
+    }
+    if (!changed) {
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        (void)rpcSubRemember(sub, i, sensorsValueAt(sub->topic, i, snapshot));
+    }
+    return true;
+}
+
+/* A single subtopic is one big endian value, the ALL subtopic is every value
+ * in subtopic order, except DIGITAL ALL which is a uint16_t bitmask with bit
+ * n for port n + 1. */
+static int
+sensorsEncode(uint8_t topic, uint8_t subtopic, const sensorsSnapshot_t *snapshot, uint8_t *buf)
+{
+    uint8_t count = sensorsCount(topic, snapshot);
+    uint8_t len = 0;
+    uint8_t i;
+    uint16_t value16;
+    if (subtopic < count) {
+        return sensorsEncodeOne(topic, subtopic, snapshot, buf);
+    }
+    if (subtopic != 0xff) {
+        return -1;
+    }
+    if (topic == MESSAGES_TOPIC_DIGITAL) {
+        value16 = (uint16_t)(htons(snapshot->digital));
+        (void)memcpy(buf, &value16, 2);
+        return 2;
+    }
+    for (i = 0; i < count; i++) {
+        len += sensorsEncodeOne(topic, i, snapshot, buf + len);
+    }
+    return len;
+}
+
+static int
+sensorsRead(rpc_t *rpc, const message_read_t *read)
+{
+    sensorsSnapshot_t snapshot;
+    int len;
+    (void)sensorsSnapshot(&snapshot);
+    len = sensorsEncode(read->topic, read->subtopic, &snapshot, rpc->tmp);
+    if (len < 0) {
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
+    }
+    (void)rpcSendRep(rpc, read, (uint8_t)len, (void *)rpc->tmp);
+    return 0;
+}
+
+static int
+sensorsPublish(rpc_t *rpc, rpcSubscription_t *sub)
+{
+    sensorsSnapshot_t snapshot;
+    int len;
+    (void)sensorsSnapshot(&snapshot);
+    len = sensorsEncode(sub->topic, sub->subtopic, &snapshot, rpc->tmp);
+    if (len < 0) {
+        // validated at subscribe time, just not sampled yet
+        return 0;
+    }
+    if (!sensorsChanged(sub, &snapshot)) {
+        return 0;
+    }
+    (void)rpcSendPub(rpc, sub, (uint8_t)len, (void *)rpc->tmp);
+    return 0;
+}
+
+static int
+sensorsSubscribe(rpc_t *rpc, const message_subscribe_t *subscribe)
+{
+    (void)rpc;
+    // what has been added so far, the task may not have sampled it yet
+    sensorsSnapshot_t added = {
+        .encoders = sensors.encoders, .gyros = sensors.gyros, .imes = sensors.imes, .ultrasonics = sensors.ultrasonics};
+    if (subscribe->subtopic != 0xff && subscribe->subtopic >= sensorsCount(subscribe->topic, &added)) {
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
+    }
+    return 0;
+}
@@ -177,15 +177,26 @@ sfpDeliverOctet(SFPcontext *ctx, uint8_t octet, uint8_t *buf, size_t len, size_t
 int
 sfpWritePacket(SFPcontext *ctx, const uint8_t *buf, size_t len, size_t *outlen)
 {
-    /* TODO maybe get rid of SFPpacket altogether? Would be more annoying to
-     * pass buf and len through everything, but would speed this up for sure. */
-    SFPpacket packet;
-    memcpy(packet.buf, buf, len);
-    packet.len = len;
+    memcpy(sfpReservePacket(ctx), buf, len);
+    return sfpCommitPacket(ctx, len, outlen);
+}
 
-    int ret = sfpTransmitUSR(ctx, &packet, outlen);
+/* Zero-copy entry point for transmitter: the packet is built straight into
+ * the history slot it will be retransmitted from. */
+uint8_t *
+sfpReservePacket(SFPcontext *ctx)
+{
+    return potRingbufferReserveBack(&(ctx->tx.history))->buf;
+}
 
-    return ret;
+int
+sfpCommitPacket(SFPcontext *ctx, size_t len, size_t *outlen)
+{
+    SFPpacket *packet = potRingbufferReserveBack(&(ctx->tx.history));
+    packet->len = len;
+    potRingbufferCommitBack(&(ctx->tx.history));
+
+    return sfpTransmitUSR(ctx, packet, outlen);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -588,12 +599,12 @@ sfpTransmitFrameImpl(SFPcontext *ctx, SFPpacket *packet, size_t *outlen, int ret
 {
     SFPheader header = ctx->tx.seq << SFP_FIRST_SEQ_BIT;
 
+    /* Both come from the history: new packets are committed to it before they
+     * are first sent, so there is nothing to put back in. */
     if (retransmit) {
         header |= SFP_FRAME_RTX << SFP_FIRST_CONTROL_BIT;
-        /* Retransmissions come from the history, so we don't put them back in. */
     } else {
         header |= SFP_FRAME_USR << SFP_FIRST_CONTROL_BIT;
-        potRingbufferPushBack(&(ctx->tx.history), packet);
     }
 
     int ret = sfpTransmitFrameWithHeader(ctx, header, packet, outlen);
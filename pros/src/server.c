@@ -6,7 +6,9 @@
 /*-----------------------------------------------------------------------------*/
 
 #include "server.h"
+#include "capture.h"
 #include "rpc.h"
+#include "spscring.h"
 #include "convex_compat.h"
 
 #include <stdlib.h>
@@ -20,20 +22,45 @@ typedef struct server_s {
     PROS_FILE *sd;
     serverState_t state;
     SFPcontext sfp;
+    Mutex lock;
+    spscRing_t rxq;
+    spscRing_t txq;
+    size_t rxpos;
+    size_t rxlen;
+    uint8_t rxbuf[SERVER_UART_CHUNK];
+    uint8_t txbuf[SERVER_UART_CHUNK];
+    uint8_t rxqbuf[SERVER_RX_QUEUE_SIZE];
+    uint8_t txqbuf[SERVER_TX_QUEUE_SIZE];
 } server_t;
 
+// every frame in the rx queue is prefixed by its length and the time it completed
+typedef struct serverFrameHeader_s {
+    uint32_t stamp;
+    uint16_t len;
+} serverFrameHeader_t;
+
+#define SERVER_FRAME_MAX (sizeof(serverFrameHeader_t) + SFP_CONFIG_MAX_PACKET_SIZE)
+
 // storage for server
 static server_t server;
 
-// thread pointer
+// thread pointers
 static TaskHandle serverThreadPointer = NULL;
+static TaskHandle serverRxThreadPointer = NULL;
+static TaskHandle serverTxThreadPointer = NULL;
 
 // private functions
 static void serverThread(void *arg);
+static void serverRxThread(void *arg);
+static void serverTxThread(void *arg);
 static void serverReset(server_t *ctx);
+static bool serverRecv(server_t *srv);
 static void serverRead(uint8_t *buf, size_t len, void *userdata);
 static int serverWrite(uint8_t *octets, size_t len, size_t *outlen, void *userdata);
 static int serverWritePacket(const uint8_t *octets, size_t len, size_t *outlen, void *userdata);
+static size_t serverWriteSpace(void *userdata);
+static uint8_t *serverWriteReserve(void *userdata);
+static int serverWriteCommit(size_t len, size_t *outlen, void *userdata);
 static void serverCheckConnection(server_t *ctx);
 
 // compatability with convex
@@ -79,6 +106,9 @@ serverSetup(PROS_FILE *sd)
 {
     server.sd = sd;
     server.rpc.writePacket = serverWritePacket;
+    server.rpc.writeSpace = serverWriteSpace;
+    server.rpc.writeReserve = serverWriteReserve;
+    server.rpc.writeCommit = serverWriteCommit;
     return;
 }
 
@@ -88,6 +118,10 @@ serverSetup(PROS_FILE *sd)
 void
 serverInit(void)
 {
+    server.lock = mutexCreate();
+    (void)rpcInit(&server.rpc);
+    (void)spscRingInit(&server.rxq, server.rxqbuf, SERVER_RX_QUEUE_SIZE);
+    (void)spscRingInit(&server.txq, server.txqbuf, SERVER_TX_QUEUE_SIZE);
     serverReset(&server);
     // (void)usartInit(server.sd, 115200, SERIAL_STOPBITS_1); // 115200 or 230400
     (void)usartInit(server.sd, 115200, SERIAL_8N1); // 115200 or 230400
@@ -95,7 +129,7 @@ serverInit(void)
 }
 
 /*-----------------------------------------------------------------------------*/
-/** @brief      Start the server system thread                                 */
+/** @brief      Start the server rx, rpc and tx threads                        */
 /*-----------------------------------------------------------------------------*/
 void
 serverStart(void)
@@ -103,18 +137,22 @@ serverStart(void)
     if (serverThreadPointer != NULL) {
         return;
     }
+    serverTxThreadPointer = taskCreate(serverTxThread, TASK_DEFAULT_STACK_SIZE, NULL, TASK_PRIORITY_DEFAULT);
+    serverRxThreadPointer = taskCreate(serverRxThread, TASK_DEFAULT_STACK_SIZE, NULL, TASK_PRIORITY_DEFAULT);
     serverThreadPointer = taskCreate(serverThread, 1024, NULL, TASK_PRIORITY_DEFAULT - 1);
     // serverThreadPointer = taskCreate(serverThread, 1024, NULL, TASK_PRIORITY_HIGHEST);
     return;
 }
 
 /*-----------------------------------------------------------------------------*/
-/** @brief      Stop the server system thread                                  */
+/** @brief      Stop the server system threads                                 */
 /*-----------------------------------------------------------------------------*/
 void
 serverStop(void)
 {
     serverThreadPointer = NULL;
+    serverRxThreadPointer = NULL;
+    serverTxThreadPointer = NULL;
 }
 
 /*-----------------------------------------------------------------------------*/
@@ -137,10 +175,50 @@ serverGetIpv4(void)
     return ipv4;
 }
 
+/*-----------------------------------------------------------------------------*/
+/** @brief      Summaries of the ping round trip and frame to reply latencies  */
+/** @param[out] rtt Robot to host to robot round trip in microseconds         */
+/** @param[out] reply Frame completion to reply enqueue in microseconds        */
+/*-----------------------------------------------------------------------------*/
+void
+serverGetLatency(histogramSummary_t *rtt, histogramSummary_t *reply)
+{
+    (void)histogramSummarize(&server.rpc.rtt, rtt);
+    (void)histogramSummarize(&server.rpc.reply, reply);
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Forget all recorded latencies.                                 */
+/*-----------------------------------------------------------------------------*/
+void
+serverResetLatency(void)
+{
+    (void)histogramReset(&server.rpc.rtt);
+    (void)histogramReset(&server.rpc.reply);
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Current and peak occupancy of the rx and tx queues.            */
+/*-----------------------------------------------------------------------------*/
+serverQueueStats_t
+serverGetQueueStats(void)
+{
+    serverQueueStats_t stats;
+    stats.rxCount = (uint16_t)spscRingCount(&server.rxq);
+    stats.rxPeak = (uint16_t)server.rxq.peak;
+    stats.rxSize = (uint16_t)server.rxq.size;
+    stats.rxStalls = server.rxq.stalls;
+    stats.txCount = (uint16_t)spscRingCount(&server.txq);
+    stats.txPeak = (uint16_t)server.txq.peak;
+    stats.txSize = (uint16_t)server.txq.size;
+    stats.txStalls = server.txq.stalls;
+    return stats;
+}
+
 // extern void usartFlushBuffers(void);
 
 /*-----------------------------------------------------------------------------*/
-/** @brief      The server thread                                              */
+/** @brief      The server rpc thread, handles frames queued by the rx thread  */
 /** @param[in]  arg Unused                                                     */
 /*-----------------------------------------------------------------------------*/
 static void
@@ -149,132 +227,170 @@ serverThread(void *arg)
     // Unused
     (void)arg;
 
-    // Register the task
-    // vexTaskRegister("server");
-
-    // (void)usartInit(server.sd, 115200, SERIAL_8N1);
-    // (void)usartFlushBuffers();
-
-    // taskDelay(5000);
-    // printf("Foo\r\n");
-    // printf("Foo\r\n");
-    // printf("Foo\r\n");
-    // printf("Foo\r\n");
-    // printf("Foo\r\n");
-
     // local variables
-    size_t rlen = 0;
-    uint8_t *rbuf = NULL;
     server_t *srv = &server;
-    // int has_read = 0;
+    bool busy;
 
-    // reset the heartbeat and published timers
-    srv->rpc.timestamp = srv->rpc.heartbeat = srv->rpc.published = srv->rpc.sendstats = chTimeNow();
-    srv->rpc.cassette = 0xff;
-    srv->rpc.fp = NULL;
+    // reset the heartbeat and stats timers
+    srv->rpc.timestamp = srv->rpc.heartbeat = srv->rpc.sendstats = chTimeNow();
 
     while (1) {
-        // printf("0 READ\r\n");
-        rlen = sdAsynchronousRead(srv->sd, srv->rpc.in.buf, SFP_CONFIG_MAX_PACKET_SIZE);
-        rbuf = srv->rpc.in.buf;
-        // printf("1 READ: rlen=%lu\r\n", rlen);
-        // printf("0 DELIVER\r\n");
-        // if (rlen > 0) {
-        //     has_read = 1;
-        //     printf("READ:");
-        // }
-        while (rlen-- > 0) {
-            // printf(" %u", *rbuf);
-            (void)sfpDeliverOctet(&srv->sfp, *rbuf, NULL, 0, NULL);
-            rbuf++;
-        }
-        // if (has_read) {
-        //     printf("\r\n");
-        // }
-        // has_read = 0;
-        // printf("1 DELIVER\r\n");
-        // printf("0 CHECK\r\n");
+        busy = serverRecv(srv);
         (void)serverCheckConnection(srv);
-        // printf("1 CHECK\r\n");
         if (serverIsConnected()) {
-            // printf("0 LOOP\r\n");
             (void)rpcLoop(&srv->rpc);
-            // printf("1 LOOP\r\n");
         }
-        // printf("0 SLEEP\r\n");
-        vexSleep(SERVER_WAIT_MILLISECONDS);
-        // printf("1 SLEEP\r\n");
+        if (!busy) {
+            vexSleep(SERVER_WAIT_MILLISECONDS);
+        }
     }
 
+    (void)mutexTake(srv->lock, -1);
     (void)serverReset(srv);
+    (void)mutexGive(srv->lock);
     serverThreadPointer = NULL;
     (void)taskDelete(NULL);
 
     return;
 }
 
+/*-----------------------------------------------------------------------------*/
+/** @brief      The server rx thread, decodes SFP frames into the rx queue     */
+/** @param[in]  arg Unused                                                     */
+/*-----------------------------------------------------------------------------*/
+static void
+serverRxThread(void *arg)
+{
+    // Unused
+    (void)arg;
+
+    server_t *srv = &server;
+
+    while (1) {
+        if (srv->rxpos == srv->rxlen) {
+            srv->rxpos = 0;
+            srv->rxlen = sdAsynchronousRead(srv->sd, srv->rxbuf, SERVER_UART_CHUNK);
+            (void)captureOctets(CAPTURE_DIR_RX, srv->rxbuf, srv->rxlen);
+        }
+        if (srv->rxlen == 0) {
+            vexSleep(SERVER_WAIT_MILLISECONDS);
+            continue;
+        }
+        (void)mutexTake(srv->lock, -1);
+        // leave octets in rxbuf rather than decode a frame the rpc thread has no room for
+        while (srv->rxpos < srv->rxlen && spscRingFree(&srv->rxq) >= SERVER_FRAME_MAX) {
+            (void)sfpDeliverOctet(&srv->sfp, srv->rxbuf[srv->rxpos++], NULL, 0, NULL);
+        }
+        (void)mutexGive(srv->lock);
+        if (srv->rxpos < srv->rxlen) {
+            srv->rxq.stalls++;
+            vexSleep(SERVER_WAIT_MILLISECONDS);
+        }
+    }
+
+    serverRxThreadPointer = NULL;
+    (void)taskDelete(NULL);
+
+    return;
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      The server tx thread, drains the tx queue to the UART          */
+/** @param[in]  arg Unused                                                     */
+/*-----------------------------------------------------------------------------*/
+static void
+serverTxThread(void *arg)
+{
+    // Unused
+    (void)arg;
+
+    server_t *srv = &server;
+    size_t wlen;
+
+    while (1) {
+        wlen = spscRingRead(&srv->txq, srv->txbuf, SERVER_UART_CHUNK);
+        if (wlen == 0) {
+            vexSleep(SERVER_WAIT_MILLISECONDS);
+            continue;
+        }
+        (void)captureOctets(CAPTURE_DIR_TX, srv->txbuf, wlen);
+        (void)sdAsynchronousWrite(srv->sd, srv->txbuf, wlen);
+    }
+
+    serverTxThreadPointer = NULL;
+    (void)taskDelete(NULL);
+
+    return;
+}
+
 static void
 serverReset(server_t *srv)
 {
     serverIpv4_t ipv4Empty = {{0, 0, 0, 0}};
     srv->state = serverStateDisconnected;
     srv->rpc.seq_id = 0;
-    srv->rpc.motor[0] = srv->rpc.motor[1] = srv->rpc.motor[2] = srv->rpc.motor[3] = srv->rpc.motor[4] = srv->rpc.motor[5] =
-        srv->rpc.motor[6] = srv->rpc.motor[7] = srv->rpc.motor[8] = srv->rpc.motor[9] = 0;
-    srv->rpc.timestamp = chTimeNow();
     (void)memcpy(&srv->rpc.ipv4, &ipv4Empty, 4);
+    (void)spscRingClear(&srv->rxq);
     (void)sfpInit(&srv->sfp);
     (void)sfpSetDeliverCallback(&srv->sfp, serverRead, (void *)srv);
     (void)sfpSetWriteCallback(&srv->sfp, serverWrite, (void *)srv);
     return;
 }
 
+/* Pop and handle every frame currently in the rx queue, returns true if any were handled. */
+static bool
+serverRecv(server_t *srv)
+{
+    serverFrameHeader_t frame;
+    bool busy = false;
+    while (spscRingPeek(&srv->rxq, 0, (uint8_t *)&frame, sizeof(frame))) {
+        // the rx thread may have finished a handshake since we last looked
+        (void)serverCheckConnection(srv);
+        (void)spscRingSkip(&srv->rxq, sizeof(frame));
+        (void)spscRingRead(&srv->rxq, srv->rpc.in.buf, frame.len);
+        if (message_deserialize(&srv->rpc.in.msg, srv->rpc.in.buf, frame.len) == 0) {
+            srv->rpc.rxstamp = frame.stamp;
+            (void)rpcRecv(&srv->rpc, &srv->rpc.in.msg);
+            srv->rpc.rxstamp = 0;
+        }
+        busy = true;
+    }
+    return busy;
+}
+
+/* Called by sfpDeliverOctet() on the rx thread, the rx thread guarantees there is room. */
 static void
 serverRead(uint8_t *buf, size_t len, void *userdata)
 {
     server_t *srv = (void *)userdata;
-    if (message_deserialize(&srv->rpc.in.msg, buf, len) == 0) {
-        (void)rpcRecv(&srv->rpc, &srv->rpc.in.msg);
-    }
-    (void)serverCheckConnection(srv);
+    serverFrameHeader_t frame;
+    frame.stamp = (uint32_t)micros();
+    frame.len = (uint16_t)len;
+    (void)spscRingWrite(&srv->rxq, (const uint8_t *)&frame, sizeof(frame));
+    (void)spscRingWrite(&srv->rxq, buf, len);
     return;
 }
 
+/* Called by the SFP transmitter with the lock held, blocks only while the tx queue is full. */
 static int
 serverWrite(uint8_t *octets, size_t len, size_t *outlen, void *userdata)
 {
     server_t *srv = (void *)userdata;
     size_t wlen = 0;
     size_t wcnt = 0;
-    // printf("WANT TO WRITE %u BYTES:", len);
-    // for (int i = 0; i < len; i++) {
-    //     printf(" %u", (uint8_t)octets[i]);
-    // }
-    // printf("\r\n");
-    wlen = sdAsynchronousWrite(srv->sd, octets, len);
-    // printf("WROTE         %u BYTES\r\n", wlen);
+    wlen = spscRingWrite(&srv->txq, octets, len);
     wcnt += wlen;
     len -= wlen;
     while (len > 0) {
         octets += wlen;
         vexSleep(SERVER_WAIT_MILLISECONDS);
-        // printf("NEED TO WRITE %u BYTES:", len);
-        // for (int i = 0; i < len; i++) {
-        //     printf(" %u", (uint8_t)octets[i]);
-        // }
-        // printf("\r\n");
-        wlen = sdAsynchronousWrite(srv->sd, octets, len);
-        // printf("WROTE         %u BYTES\r\n", wlen);
-        // if (wlen == 0) {
-        //     vexSleep(1000);
-        // }
+        wlen = spscRingWrite(&srv->txq, octets, len);
         wcnt += wlen;
         len -= wlen;
     }
     if (outlen != NULL) {
         *outlen = wcnt;
     }
-    (void)serverCheckConnection(srv);
     return 0;
 }
 
@@ -282,32 +398,63 @@ static int
 serverWritePacket(const uint8_t *octets, size_t len, size_t *outlen, void *userdata)
 {
     server_t *srv = (void *)userdata;
-    return sfpWritePacket(&srv->sfp, octets, len, outlen);
+    int retval;
+    (void)mutexTake(srv->lock, -1);
+    retval = sfpWritePacket(&srv->sfp, octets, len, outlen);
+    (void)mutexGive(srv->lock);
+    return retval;
+}
+
+/* Holds the lock until serverWriteCommit(), so nothing else can send from the history slot in between. */
+static uint8_t *
+serverWriteReserve(void *userdata)
+{
+    server_t *srv = (void *)userdata;
+    (void)mutexTake(srv->lock, -1);
+    return sfpReservePacket(&srv->sfp);
+}
+
+static int
+serverWriteCommit(size_t len, size_t *outlen, void *userdata)
+{
+    server_t *srv = (void *)userdata;
+    int retval = 0;
+    if (len > 0) {
+        retval = sfpCommitPacket(&srv->sfp, len, outlen);
+    }
+    (void)mutexGive(srv->lock);
+    return retval;
+}
+
+/* Octets the tx queue can take right now without serverWrite() blocking. */
+static size_t
+serverWriteSpace(void *userdata)
+{
+    server_t *srv = (void *)userdata;
+    return spscRingFree(&srv->txq);
 }
 
+/* Called on the rpc thread without the lock held, rpc messages sent from here take it. */
 static void
 serverCheckConnection(server_t *srv)
 {
+    int connected;
+    (void)mutexTake(srv->lock, -1);
+    connected = sfpIsConnected(&srv->sfp);
+    (void)mutexGive(srv->lock);
     if (srv->state == serverStateDisconnected) {
-        if (sfpIsConnected(&srv->sfp)) {
-            srv->rpc.timestamp = srv->rpc.heartbeat = srv->rpc.published = srv->rpc.sendstats = chTimeNow();
-            for (int i = 0; i < RPC_SUB_MAX; i++) {
-                srv->rpc.subs[i].active = false;
-                srv->rpc.subs[i].req_id = 0;
-                srv->rpc.subs[i].topic = 0;
-                srv->rpc.subs[i].subtopic = 0;
-            }
-            srv->rpc.cassette = 0xff;
-            if (srv->rpc.fp != NULL) {
-                (void)fclose(srv->rpc.fp);
-                srv->rpc.fp = NULL;
-            }
+        if (connected) {
+            srv->rpc.heartbeat = srv->rpc.sendstats = chTimeNow();
             srv->state = serverStateConnected;
+            (void)rpcSessionAttach(&srv->rpc);
         }
     } else if (srv->state == serverStateConnected) {
-        if (!sfpIsConnected(&srv->sfp) || (chTimeElapsedSince(srv->rpc.heartbeat) > 5000) ||
+        if (!connected || (chTimeElapsedSince(srv->rpc.heartbeat) > 5000) ||
             (chTimeElapsedSince(srv->rpc.timestamp) > 2147483647)) {
+            (void)rpcSessionDetach(&srv->rpc);
+            (void)mutexTake(srv->lock, -1);
             (void)serverReset(srv);
+            (void)mutexGive(srv->lock);
         }
     }
 }
@@ -0,0 +1,102 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+
+#include "spscring.h"
+
+#include <string.h>
+
+// make sure the data is visible before the index that publishes it
+#define spscRingBarrier() __sync_synchronize()
+
+void
+spscRingInit(spscRing_t *r, uint8_t *buf, size_t size)
+{
+    r->head = 0;
+    r->tail = 0;
+    r->size = size;
+    r->peak = 0;
+    r->stalls = 0;
+    r->buf = buf;
+}
+
+size_t
+spscRingCount(const spscRing_t *r)
+{
+    return (r->head - r->tail);
+}
+
+size_t
+spscRingFree(const spscRing_t *r)
+{
+    return r->size - spscRingCount(r);
+}
+
+size_t
+spscRingWrite(spscRing_t *r, const uint8_t *buf, size_t len)
+{
+    size_t head = r->head;
+    size_t avail = r->size - (head - r->tail);
+    size_t offset = head & (r->size - 1);
+    size_t first;
+    if (len > avail) {
+        len = avail;
+        r->stalls++;
+    }
+    first = r->size - offset;
+    if (first > len) {
+        first = len;
+    }
+    (void)memcpy(r->buf + offset, buf, first);
+    (void)memcpy(r->buf, buf + first, len - first);
+    spscRingBarrier();
+    r->head = head + len;
+    if ((head + len - r->tail) > r->peak) {
+        r->peak = head + len - r->tail;
+    }
+    return len;
+}
+
+bool
+spscRingPeek(const spscRing_t *r, size_t offset, uint8_t *buf, size_t len)
+{
+    size_t tail = r->tail;
+    size_t first;
+    if (offset + len > (r->head - tail)) {
+        return false;
+    }
+    spscRingBarrier();
+    tail = (tail + offset) & (r->size - 1);
+    first = r->size - tail;
+    if (first > len) {
+        first = len;
+    }
+    (void)memcpy(buf, r->buf + tail, first);
+    (void)memcpy(buf + first, r->buf, len - first);
+    return true;
+}
+
+size_t
+spscRingRead(spscRing_t *r, uint8_t *buf, size_t len)
+{
+    size_t count = spscRingCount(r);
+    if (len > count) {
+        len = count;
+    }
+    (void)spscRingPeek(r, 0, buf, len);
+    spscRingSkip(r, len);
+    return len;
+}
+
+void
+spscRingSkip(spscRing_t *r, size_t len)
+{
+    spscRingBarrier();
+    r->tail += len;
+}
+
+void
+spscRingClear(spscRing_t *r)
+{
+    spscRingBarrier();
+    r->tail = r->head;
+}
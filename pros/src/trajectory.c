@@ -0,0 +1,279 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: nil; st-rulers: [132] -*-
+// vim: ts=4 sw=4 ft=c++ et
+/*-----------------------------------------------------------------------------*/
+/** @file    trajectory.c                                                      */
+/** @brief   Motor setpoints streamed ahead over rpc, applied on time          */
+/*-----------------------------------------------------------------------------*/
+
+#include "trajectory.h"
+#include "mtrmgr.h"
+#include "portable_endian.h"
+#include "rpc.h"
+
+#include <string.h>
+
+typedef struct trajectoryStep_s {
+    uint32_t due;
+    uint16_t interval;
+    uint16_t ports;
+    bool end;
+    int8_t speed[NUM_MOTORS];
+} trajectoryStep_t;
+
+typedef struct trajectory_s {
+    TaskHandle task;
+    Mutex lock;
+    trajectoryStep_t steps[TRAJECTORY_MAX];
+    uint8_t head;
+    uint8_t count;
+    bool running;
+    // motors driven since the trajectory started, stopped on an underrun
+    uint16_t driven;
+    trajectoryStep_t last;
+    uint32_t applied;
+    uint32_t late;
+    uint32_t underruns;
+} trajectory_t;
+
+static trajectory_t trajectory;
+
+static int trajectoryRead(rpc_t *rpc, const message_read_t *read);
+static int trajectoryWrite(rpc_t *rpc, const message_write_t *write);
+static int trajectoryPublish(rpc_t *rpc, rpcSubscription_t *sub);
+
+static const rpcTopic_t trajectoryTopic = {
+    .topic = MESSAGES_TOPIC_TRAJECTORY,
+    .flags = RPC_TOPIC_FLAG_CHANGES,
+    .count = 1,
+    .all = MESSAGES_TOPIC_TRAJECTORY_SUBTOPIC_SETPOINTS,
+    .read = trajectoryRead,
+    .write = trajectoryWrite,
+    .publish = trajectoryPublish,
+};
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Register the trajectory topic with rpc.                        */
+/*-----------------------------------------------------------------------------*/
+void
+trajectoryInit(void)
+{
+    trajectory.lock = mutexCreate();
+    (void)rpcTopicRegister(&trajectoryTopic);
+}
+
+static void
+trajectorySet(uint16_t ports, const int8_t *speed)
+{
+    uint8_t i;
+    for (i = 0; i < NUM_MOTORS; i++) {
+        if (ports & (1u << i)) {
+            (void)blrsMotorSet(i + 1, speed[i], true);
+        }
+    }
+}
+
+/* Take every step that is due off the queue, returns the motors to set to speed. */
+static uint16_t
+trajectoryAdvance(uint32_t now, int8_t *speed)
+{
+    trajectoryStep_t *step;
+    uint16_t ports = 0;
+    uint8_t i;
+    while (trajectory.count > 0) {
+        step = &trajectory.steps[trajectory.head];
+        if ((int32_t)(now - step->due) < 0) {
+            break;
+        }
+        trajectory.head = (uint8_t)((trajectory.head + 1) % TRAJECTORY_MAX);
+        trajectory.count--;
+        if ((int32_t)(now - step->due) >= TRAJECTORY_PERIOD ||
+            (trajectory.count > 0 && (int32_t)(now - trajectory.steps[trajectory.head].due) >= 0)) {
+            trajectory.late++;
+        }
+        for (i = 0; i < NUM_MOTORS; i++) {
+            if (step->ports & (1u << i)) {
+                speed[i] = step->speed[i];
+            }
+        }
+        ports |= step->ports;
+        trajectory.last = *step;
+        trajectory.running = true;
+        trajectory.driven |= step->ports;
+        trajectory.applied++;
+    }
+    if (trajectory.running && trajectory.count == 0 &&
+        (int32_t)(now - trajectory.last.due) >= (int32_t)trajectory.last.interval) {
+        trajectory.running = false;
+        if (!trajectory.last.end) {
+            trajectory.underruns++;
+            for (i = 0; i < NUM_MOTORS; i++) {
+                if (trajectory.driven & (1u << i)) {
+                    speed[i] = 0;
+                }
+            }
+            ports |= trajectory.driven;
+        }
+        trajectory.driven = 0;
+    }
+    return ports;
+}
+
+static void
+trajectoryTask(void *ignore)
+{
+    (void)ignore;
+    unsigned long wake = millis();
+    int8_t speed[NUM_MOTORS];
+    uint16_t ports;
+    for (;;) {
+        (void)mutexTake(trajectory.lock, -1);
+        ports = trajectoryAdvance((uint32_t)millis(), speed);
+        (void)mutexGive(trajectory.lock);
+        // outside the lock, the motor manager may make us wait for its mutex
+        (void)trajectorySet(ports, speed);
+        (void)taskDelayUntil(&wake, TRAJECTORY_PERIOD);
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/** @brief      Start applying setpoints.                                      */
+/*-----------------------------------------------------------------------------*/
+void
+trajectoryStart(void)
+{
+    if (trajectory.task != NULL) {
+        return;
+    }
+    trajectory.task = taskCreate(trajectoryTask, TASK_DEFAULT_STACK_SIZE, NULL, TASK_PRIORITY_HIGHEST - 1);
+}
+
+static uint8_t
+trajectoryEncodeStatus(uint8_t *buf)
+{
+    uint32_t value32;
+    buf[0] = trajectory.running;
+    buf[1] = trajectory.count;
+    value32 = (uint32_t)(htonl(trajectory.applied));
+    (void)memcpy(buf + 2, &value32, 4);
+    value32 = (uint32_t)(htonl(trajectory.late));
+    (void)memcpy(buf + 6, &value32, 4);
+    value32 = (uint32_t)(htonl(trajectory.underruns));
+    (void)memcpy(buf + 10, &value32, 4);
+    return TRAJECTORY_STATUS_SIZE;
+}
+
+static int
+trajectoryRead(rpc_t *rpc, const message_read_t *read)
+{
+    uint8_t tlen;
+    if (read->subtopic != MESSAGES_TOPIC_TRAJECTORY_SUBTOPIC_SETPOINTS) {
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
+    }
+    (void)mutexTake(trajectory.lock, -1);
+    tlen = trajectoryEncodeStatus((void *)rpc->tmp);
+    (void)mutexGive(trajectory.lock);
+    (void)rpcSendRep(rpc, read, tlen, (void *)rpc->tmp);
+    return 0;
+}
+
+/* Queue a batch, replacing the steps it overlaps, or stop on an empty one. */
+static int
+trajectoryWrite(rpc_t *rpc, const message_write_t *write)
+{
+    static const int8_t stopped[NUM_MOTORS];
+    trajectoryStep_t *step;
+    const uint8_t *speeds;
+    uint32_t value32;
+    uint16_t value16;
+    uint32_t at;
+    int32_t ahead;
+    uint16_t interval;
+    uint16_t ports;
+    uint8_t flags;
+    uint8_t width = 0;
+    uint8_t steps;
+    uint8_t keep;
+    uint8_t i;
+    uint8_t k;
+    if (write->subtopic != MESSAGES_TOPIC_TRAJECTORY_SUBTOPIC_SETPOINTS) {
+        return MESSAGES_ERROR_BAD_SUBTOPIC;
+    }
+    if (write->len == 0) {
+        (void)mutexTake(trajectory.lock, -1);
+        ports = trajectory.driven;
+        trajectory.count = 0;
+        trajectory.running = false;
+        trajectory.driven = 0;
+        (void)mutexGive(trajectory.lock);
+        (void)trajectorySet(ports, stopped);
+        return 0;
+    }
+    if (write->len <= TRAJECTORY_BATCH_HEADER) {
+        return MESSAGES_ERROR_BAD_VALUE;
+    }
+    (void)memcpy(&value32, write->value, 4);
+    at = (uint32_t)(ntohl(value32));
+    (void)memcpy(&value16, write->value + 4, 2);
+    interval = (uint16_t)(ntohs(value16));
+    (void)memcpy(&value16, write->value + 6, 2);
+    ports = (uint16_t)(ntohs(value16));
+    flags = write->value[8];
+    for (i = 0; i < NUM_MOTORS; i++) {
+        width = (uint8_t)(width + ((ports >> i) & 1));
+    }
+    if (width == 0 || (ports >> NUM_MOTORS) != 0 || interval == 0 || (write->len - TRAJECTORY_BATCH_HEADER) % width != 0) {
+        return MESSAGES_ERROR_BAD_VALUE;
+    }
+    steps = (uint8_t)((write->len - TRAJECTORY_BATCH_HEADER) / width);
+    ahead = (int32_t)(at - rpcTimestamp(rpc));
+    if (rpc->features & MESSAGES_FEATURE_MICROS) {
+        ahead /= 1000;
+    }
+    if (ahead > TRAJECTORY_AHEAD || ahead < -TRAJECTORY_AHEAD) {
+        return MESSAGES_ERROR_BAD_VALUE;
+    }
+    // from here on in our own milliseconds, a start in the past is applied at once
+    at = (uint32_t)millis() + (uint32_t)ahead;
+    (void)mutexTake(trajectory.lock, -1);
+    keep = trajectory.count;
+    while (keep > 0 && (int32_t)(trajectory.steps[(trajectory.head + keep - 1) % TRAJECTORY_MAX].due - at) >= 0) {
+        keep--;
+    }
+    if (keep + steps > TRAJECTORY_MAX) {
+        (void)mutexGive(trajectory.lock);
+        return MESSAGES_ERROR_BUSY;
+    }
+    trajectory.count = keep;
+    speeds = write->value + TRAJECTORY_BATCH_HEADER;
+    for (k = 0; k < steps; k++) {
+        step = &trajectory.steps[(trajectory.head + trajectory.count) % TRAJECTORY_MAX];
+        step->due = at + (uint32_t)k * interval;
+        step->interval = interval;
+        step->ports = ports;
+        step->end = (k == steps - 1) && (flags & MESSAGES_TRAJECTORY_FLAG_END);
+        for (i = 0; i < NUM_MOTORS; i++) {
+            step->speed[i] = (ports & (1u << i)) ? (int8_t)*speeds++ : 0;
+        }
+        trajectory.count++;
+    }
+    (void)mutexGive(trajectory.lock);
+    return 0;
+}
+
+/* Publishes the status when the trajectory starts, stops or underruns. */
+static int
+trajectoryPublish(rpc_t *rpc, rpcSubscription_t *sub)
+{
+    uint8_t tlen = 0;
+    (void)mutexTake(trajectory.lock, -1);
+    if (rpcSubChanged(sub, 0, (int32_t)trajectory.underruns) || rpcSubChanged(sub, 1, trajectory.running)) {
+        (void)rpcSubRemember(sub, 0, (int32_t)trajectory.underruns);
+        (void)rpcSubRemember(sub, 1, trajectory.running);
+        tlen = trajectoryEncodeStatus((void *)rpc->tmp);
+    }
+    (void)mutexGive(trajectory.lock);
+    if (tlen > 0) {
+        (void)rpcSendPub(rpc, sub, tlen, (void *)rpc->tmp);
+    }
+    return 0;
+}